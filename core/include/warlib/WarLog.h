@@ -12,12 +12,33 @@
 #include <memory>
 #include <vector>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <type_traits>
 #include <boost/system/error_code.hpp>
 #include <boost/utility/string_ref.hpp>
 #include <warlib/basics.h>
+#include <warlib/tsc_clock.h>
 
 
-#define __WAR_LOG_WITH_LEVEL_AND_FILTER(level, filter) war::log::LogEngine::IsRelevant(level, filter) && war::log::Log(level, filter).Get()
+/* Call-site statistics.
+
+   When WAR_LOG_CALLSITE_STATS is defined, each log statement gets a
+   static LogCallSite that counts the messages, bytes and formatting
+   time for that statement. See LogCallSite::Dump().
+*/
+#ifdef WAR_LOG_CALLSITE_STATS
+#   define __WAR_LOG_STATS_SITE(level) ([](const war::log::LogLevel war_level) noexcept -> war::log::LogCallSite& { static war::log::LogCallSite war_stats_site(__FILE__, __LINE__, war_level); return war_stats_site; }(level))
+#   define __WAR_LOG_OBJECT(level, filter) war::log::Log(level, filter, __WAR_LOG_STATS_SITE(level))
+#   define __WAR_LOG_OBJECT_SUPPRESSED(level, filter) war::log::Log(level, filter, war::log::Log::TakeSuppressed(), &__WAR_LOG_STATS_SITE(level))
+#else
+#   define __WAR_LOG_OBJECT(level, filter) war::log::Log(level, filter)
+#   define __WAR_LOG_OBJECT_SUPPRESSED(level, filter) war::log::Log(level, filter, war::log::Log::TakeSuppressed())
+#endif
+
+#define __WAR_LOG_WITH_LEVEL_AND_FILTER(level, filter) war::log::LogEngine::IsRelevant(level, filter) && __WAR_LOG_OBJECT(level, filter).Get()
 
 #define LOG_FATAL __WAR_LOG_WITH_LEVEL_AND_FILTER(war::log::LL_FATAL, war::log::LA_GENERAL)
 #define LOG_FATAL_F(filter) __WAR_LOG_WITH_LEVEL_AND_FILTER(war::log::LL_FATAL, filter)
@@ -61,15 +82,94 @@
 #define LOG_TRACE4_FN __WAR_LOG_WITH_LEVEL_AND_FILTER(war::log::LL_TRACE4, war::log::LA_GENERAL) << "{" << WAR_FUNCTION_NAME << "}: "
 #define LOG_TRACE4_F_FN(filter) __WAR_LOG_WITH_LEVEL_AND_FILTER(war::log::LL_TRACE4, filter) << "{" << WAR_FUNCTION_NAME << "}: "
 
+/* Rate-limited and sampled variants.
+
+   Each call-site has its own static limiter, so a log-statement in a
+   hot loop (or an error that repeats itself) can not flood the logs.
+   The number of suppressed messages is reported in the next message
+   that gets through. For LOG_xxx_RL, that is the number of messages
+   the logging thread itself suppressed at the call-site.
+
+   LOG_xxx_RL(perSecond) logs at most perSecond messages each second.
+   LOG_xxx_SAMPLED(everyN) logs every N'th message.
+*/
+#define __WAR_LOG_CALL_SITE(type) ([]() noexcept -> type& { static type war_site; return war_site; }())
+#define __WAR_LOG_SUPPRESSED_BY_THREAD ([]() noexcept -> std::uint32_t& { static thread_local std::uint32_t war_suppressed; return war_suppressed; }())
+#define __WAR_LOG_RATE_LIMITED(level, filter, perSecond) war::log::LogEngine::IsRelevant(level, filter) && __WAR_LOG_CALL_SITE(war::log::RateLimiter).Allow(perSecond, __WAR_LOG_SUPPRESSED_BY_THREAD) && __WAR_LOG_OBJECT_SUPPRESSED(level, filter).Get()
+#define __WAR_LOG_SAMPLED(level, filter, everyN) war::log::LogEngine::IsRelevant(level, filter) && __WAR_LOG_CALL_SITE(war::log::Sampler).Allow(everyN) && __WAR_LOG_OBJECT_SUPPRESSED(level, filter).Get()
+
+#define LOG_FATAL_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_FATAL, war::log::LA_GENERAL, perSecond)
+#define LOG_FATAL_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_FATAL, filter, perSecond)
+#define LOG_FATAL_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_FATAL, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_ERROR_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_ERROR, war::log::LA_GENERAL, perSecond)
+#define LOG_ERROR_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_ERROR, filter, perSecond)
+#define LOG_ERROR_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_ERROR, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_WARN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_WARNING, war::log::LA_GENERAL, perSecond)
+#define LOG_WARN_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_WARNING, filter, perSecond)
+#define LOG_WARN_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_WARNING, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_INFO_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_INFO, war::log::LA_GENERAL, perSecond)
+#define LOG_INFO_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_INFO, filter, perSecond)
+#define LOG_INFO_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_INFO, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_NOTICE_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_NOTICE, war::log::LA_GENERAL, perSecond)
+#define LOG_NOTICE_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_NOTICE, filter, perSecond)
+#define LOG_NOTICE_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_NOTICE, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_DEBUG_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_DEBUG, war::log::LA_GENERAL, perSecond)
+#define LOG_DEBUG_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_DEBUG, filter, perSecond)
+#define LOG_DEBUG_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_DEBUG, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE1_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE1, war::log::LA_GENERAL, perSecond)
+#define LOG_TRACE1_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE1, filter, perSecond)
+#define LOG_TRACE1_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE1, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE2_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE2, war::log::LA_GENERAL, perSecond)
+#define LOG_TRACE2_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE2, filter, perSecond)
+#define LOG_TRACE2_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE2, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE3_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE3, war::log::LA_GENERAL, perSecond)
+#define LOG_TRACE3_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE3, filter, perSecond)
+#define LOG_TRACE3_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE3, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE4_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE4, war::log::LA_GENERAL, perSecond)
+#define LOG_TRACE4_F_RL(filter, perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE4, filter, perSecond)
+#define LOG_TRACE4_FN_RL(perSecond) __WAR_LOG_RATE_LIMITED(war::log::LL_TRACE4, war::log::LA_GENERAL, perSecond) << "{" << WAR_FUNCTION_NAME << "}: "
+
+#define LOG_FATAL_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_FATAL, war::log::LA_GENERAL, everyN)
+#define LOG_FATAL_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_FATAL, filter, everyN)
+#define LOG_FATAL_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_FATAL, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_ERROR_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_ERROR, war::log::LA_GENERAL, everyN)
+#define LOG_ERROR_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_ERROR, filter, everyN)
+#define LOG_ERROR_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_ERROR, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_WARN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_WARNING, war::log::LA_GENERAL, everyN)
+#define LOG_WARN_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_WARNING, filter, everyN)
+#define LOG_WARN_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_WARNING, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_INFO_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_INFO, war::log::LA_GENERAL, everyN)
+#define LOG_INFO_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_INFO, filter, everyN)
+#define LOG_INFO_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_INFO, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_NOTICE_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_NOTICE, war::log::LA_GENERAL, everyN)
+#define LOG_NOTICE_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_NOTICE, filter, everyN)
+#define LOG_NOTICE_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_NOTICE, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_DEBUG_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_DEBUG, war::log::LA_GENERAL, everyN)
+#define LOG_DEBUG_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_DEBUG, filter, everyN)
+#define LOG_DEBUG_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_DEBUG, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE1_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE1, war::log::LA_GENERAL, everyN)
+#define LOG_TRACE1_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE1, filter, everyN)
+#define LOG_TRACE1_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE1, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE2_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE2, war::log::LA_GENERAL, everyN)
+#define LOG_TRACE2_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE2, filter, everyN)
+#define LOG_TRACE2_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE2, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE3_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE3, war::log::LA_GENERAL, everyN)
+#define LOG_TRACE3_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE3, filter, everyN)
+#define LOG_TRACE3_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE3, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+#define LOG_TRACE4_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE4, war::log::LA_GENERAL, everyN)
+#define LOG_TRACE4_F_SAMPLED(filter, everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE4, filter, everyN)
+#define LOG_TRACE4_FN_SAMPLED(everyN) __WAR_LOG_SAMPLED(war::log::LL_TRACE4, war::log::LA_GENERAL, everyN) << "{" << WAR_FUNCTION_NAME << "}: "
+
 
 namespace war {
 
 /*! Logging library
  *
- * Currently, logging is done from the thread that performs the logging.
+ * By default, logging is done from the thread that performs the logging.
  * The library still performs well.
  *
- * Logging via a dedicated thread is planned for the future.
+ * Handlers that write to slow devices can be wrapped in a LogQueue,
+ * which use a dedicated thread for the handler.
  *
  * \note Most of the frequently used methods are marked as noexcept.
  *      This means that the application will crash if an exception
@@ -128,6 +228,9 @@ enum LogLevel {
 /*! Log regarding bitflag.
 
   Note that one log-message may regard several matters.
+
+  The bits that are not used here can be registered by the application
+  at runtime, with LogEngine::RegisterCategory().
 */
 enum LogAbout {
     /// General message
@@ -162,10 +265,184 @@ enum LogAboutDefaults {
                         | LA_FUNCTION_CALL
 };
 
+/// The number of log-levels
+constexpr int LL_NUM_LEVELS = LL_TRACE4 + 1;
+
+/// The number of categories (bits in filter_t)
+constexpr int LA_NUM_CATEGORIES = sizeof(filter_t) * 8;
+
+/*! A typed key/value pair attached to a log message
+
+    Fields are streamed to the log like any other value:
+
+        LOG_NOTICE << "Request completed" << log::Field("status", 200)
+            << log::Field("user", user_name);
+
+    When streamed to a Log, the field is kept with its type in the
+    SubmitInfo, so that handlers like LogToJsonFile can serialize it
+    without parsing the text. The text handlers add it as " key=value"
+    after the message. Streamed to any other std::ostream, the field is
+    written as "key=value".
+*/
+class Field
+{
+public:
+    enum Type {
+        FT_INT,
+        FT_UINT,
+        FT_DOUBLE,
+        FT_BOOL,
+        FT_STRING
+    };
+
+    using fields_t = std::vector<Field>;
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value
+        && std::is_signed<T>::value>::type * = nullptr>
+    Field(std::string key, const T value)
+        : key_(std::move(key)), type_(FT_INT), int_(value) {}
+
+    template <typename T, typename std::enable_if<std::is_integral<T>::value
+        && !std::is_signed<T>::value && !std::is_same<T, bool>::value>::type * = nullptr>
+    Field(std::string key, const T value)
+        : key_(std::move(key)), type_(FT_UINT), uint_(value) {}
+
+    Field(std::string key, const bool value)
+        : key_(std::move(key)), type_(FT_BOOL), bool_(value) {}
+
+    Field(std::string key, const double value)
+        : key_(std::move(key)), type_(FT_DOUBLE), double_(value) {}
+
+    Field(std::string key, std::string value)
+        : key_(std::move(key)), type_(FT_STRING), str_(std::move(value)) {}
+
+    Field(std::string key, const boost::string_ref& value)
+        : key_(std::move(key)), type_(FT_STRING), str_(value.data(), value.size()) {}
+
+    Field(std::string key, const char *value)
+        : key_(std::move(key)), type_(FT_STRING), str_(value ? value : "") {}
+
+    const std::string& GetKey() const noexcept { return key_; }
+    Type GetType() const noexcept { return type_; }
+    std::int64_t GetInt() const noexcept { return int_; }
+    std::uint64_t GetUint() const noexcept { return uint_; }
+    double GetDouble() const noexcept { return double_; }
+    bool GetBool() const noexcept { return bool_; }
+    const std::string& GetString() const noexcept { return str_; }
+
+    /*! Write the field as key=value
+
+        Strings that are empty or contain space, quotes, '=' or control
+        characters are quoted, with '"' and '\\' escaped by a backslash,
+        and control characters as %hh.
+    */
+    std::ostream& Write(std::ostream& out) const;
+
+    /*! Index of the std::ostream::pword() that points to the fields of a Log */
+    static int GetStreamIndex() noexcept;
+
+private:
+    std::string key_;
+    Type type_;
+    union {
+        std::int64_t int_;
+        std::uint64_t uint_;
+        double double_;
+        bool bool_;
+    };
+    std::string str_;
+};
+
+/*! Identity of a thread, as it appears in the logs
+
+    Each thread that logs gets a small numeric id, starting at 1. A
+    thread can also register a name. The text ("name#id", or "#id" if
+    the thread has no name) is formatted once, and copied to each
+    log event. Handlers that write from another thread, like LogQueue,
+    will therefore report the thread that logged the message.
+*/
+class ThreadIdentity
+{
+public:
+    /// Max length of the text
+    static constexpr std::size_t max_length = 31;
+
+    constexpr ThreadIdentity() noexcept = default;
+
+    /*! The numeric id. 0 for an empty identity. */
+    std::uint32_t GetId() const noexcept { return id_; }
+
+    /*! The formatted identity */
+    boost::string_ref GetText() const noexcept { return {text_, size_}; }
+
+    bool IsEmpty() const noexcept { return size_ == 0; }
+
+    /*! Returns the identity of the current thread */
+    static const ThreadIdentity& GetCurrent() noexcept;
+
+    /*! Set the name of the current thread.
+
+        The name is truncated if the text becomes longer than max_length.
+    */
+    static void SetName(const boost::string_ref& name) noexcept;
+
+private:
+    void Format(const boost::string_ref& name) noexcept;
+
+    std::uint32_t id_ = 0;
+    std::uint8_t size_ = 0;
+    char text_[max_length + 1] = {};
+};
+
+/*! When a handler that writes to a stream flushes its output
+
+    The output is flushed when any of the conditions are met. A handler
+    that is not flushed for every record lets the stream collect
+    consecutive records in its buffer, and write them with one
+    system-call.
+
+    The default is to flush after every record.
+*/
+struct FlushPolicy
+{
+    /// Flush after this many records. 0 disables the check.
+    unsigned records_ = 1;
+    /// Flush when the oldest record not flushed is this old. 0 disables the check.
+    /// This is done by a background thread in the LogEngine.
+    std::chrono::milliseconds interval_ {0};
+    /// Flush immediately on records at this level or more severe.
+    /// LL_FATAL records are always flushed.
+    LogLevel level_ = LL_ERROR;
+
+    /*! Flush after every record */
+    static FlushPolicy EveryRecord() noexcept {
+        return {};
+    }
+
+    /*! Only flush when the stream decides to, and on LL_FATAL */
+    static FlushPolicy Never() noexcept {
+        return {0, std::chrono::milliseconds(0), LL_FATAL};
+    }
+
+    /*! Flush after records records or when interval has passed,
+        and immediately for records at level or more severe.
+    */
+    static FlushPolicy Batched(const unsigned records = 1000,
+                               const std::chrono::milliseconds interval
+                                = std::chrono::milliseconds(200),
+                               const LogLevel level = LL_ERROR) noexcept {
+        return {records, interval, level};
+    }
+};
+
 /*! The log event handler interface
 
     \note Any constructor or method may throw war::ExceptionBase
         derived exceptions
+
+    \note Submit() is called directly from the threads that log, and
+        may be called from several threads at the same time. Handlers
+        must serialize access to their devices themselves.
 */
 
 class LogEventHandler
@@ -175,8 +452,7 @@ public:
     struct Exception : public war::ExceptionBase {};
 
     LogEventHandler(const std::string& name, const LogLevel level,
-                    const filter_t filter)
-        : name_ (name), level_ (level), filter_ (filter) {}
+                    const filter_t filter);
 
     virtual ~LogEventHandler() {}
 
@@ -187,9 +463,26 @@ public:
         const LogLevel level_;
         const filter_t filter_;
         const std::string buf_;
-        const std::chrono::system_clock::time_point time_;
+        // When the event was logged, in TscClock ticks
+        const std::uint64_t ticks_;
+        const std::thread::id thread_;
+        const Field::fields_t fields_;
+        const ThreadIdentity identity_;
+
+        /*! Returns the wall time for the event */
+        std::chrono::system_clock::time_point GetTime() const noexcept {
+            return TscClock::ToSystemTime(ticks_);
+        }
     };
 
+    /*! Write a log event
+
+        Called directly from the threads that log, without any lock in
+        the LogEngine. It may therefore be called from several threads
+        at the same time, and must be thread-safe. It may also still be
+        called for a short while after the handler is removed from
+        the engine.
+    */
     virtual void Submit (const SubmitInfo& info ) noexcept  = 0;
 
     const std::string& GetName() const noexcept {
@@ -197,11 +490,19 @@ public:
     }
 
     const LogLevel GetLevel() const noexcept {
-        return level_;
+        return level_.load(std::memory_order_relaxed);
     }
 
     const filter_t GetFilter() const noexcept {
-        return filter_;
+        return filter_.load(std::memory_order_relaxed);
+    }
+
+    /*! Returns true if the handler wants messages with this level and filter
+
+        Category levels set in the LogEngine are taken into consideration.
+    */
+    bool IsRelevant(const LogLevel level, const filter_t filter) const noexcept {
+        return (relevant_[level].load(std::memory_order_relaxed) & filter) != 0;
     }
 
     static const char *GetLevelName(const LogLevel level) noexcept;
@@ -209,8 +510,44 @@ public:
     static void WriteFilter(std::ostream& out, const filter_t filter,
                             const filter_t hide = LA_GENERAL) noexcept;
 
-    void SetLevel(const LogLevel level) {
-        level_ = level;
+    /*! Change the log-level.
+
+        The change takes effect immediately, also if the handler is
+        already added to the LogEngine.
+    */
+    void SetLevel(const LogLevel level);
+
+    /*! Change the filter.
+
+        The change takes effect immediately, also if the handler is
+        already added to the LogEngine.
+    */
+    void SetFilter(const filter_t filter);
+
+    /*! Change the flush policy.
+
+        Only relevant for handlers that write to a stream.
+    */
+    void SetFlushPolicy(const FlushPolicy& policy);
+
+    FlushPolicy GetFlushPolicy() const noexcept;
+
+    /*! Flush buffered output to the device
+
+        The default implementation does nothing.
+    */
+    virtual void Flush() noexcept {}
+
+    /*! Flush if the flush policy's interval has passed since the
+        oldest record that is not flushed was written.
+
+        Called regularly by the LogEngine's flush thread.
+    */
+    virtual void FlushIfDue(const std::chrono::steady_clock::time_point now) noexcept;
+
+    /*! Returns the flush interval, or 0 if the handler don't need timed flushing */
+    virtual std::chrono::milliseconds GetFlushInterval() const noexcept {
+        return std::chrono::milliseconds(flush_interval_.load(std::memory_order_relaxed));
     }
 
 protected:
@@ -220,19 +557,62 @@ protected:
     void WriteFilter(std::ostream& out, const SubmitInfo &si) const noexcept;
     void WriteTimestamp(std::ostream& out, const SubmitInfo &si) const noexcept;
 
+    /*! Writes the fields in the log-event as " key=value" */
+    void WriteFields(std::ostream& out, const SubmitInfo &si) const noexcept;
+
     /*! Writes the message in the log-event
 
     This method will ignore '\r', escape non-whitespace control characters
     as %hh (where hh is a two-digit hex number), and handle newline-characters
     by adding a new line, prefixed with two spaces.
+
+    The message is scanned with SIMD instructions where available, and
+    the spans between the characters that need special treatment are
+    written in bulk.
     */
     void WriteMessage(std::ostream& out, const SubmitInfo &si) const noexcept;
 
+    /*! Called by the handler after a record is written
+
+        \return true if the output must be flushed now, according to
+            the flush policy.
+    */
+    bool ShouldFlush(const SubmitInfo &si) noexcept;
+
+    /*! Called by the handler when the output is flushed */
+    void Flushed() noexcept {
+        pending_.store(0, std::memory_order_relaxed);
+    }
+
 private:
+    friend class LogEngine;
+
+    using find_special_t = const char *(*)(const char *begin, const char *end,
+                                           bool highBytes);
+
+    void UpdateRelevance() noexcept;
+
     std::string name_;
-    LogLevel level_;
-    filter_t filter_;
+    std::atomic<LogLevel> level_;
+    std::atomic<filter_t> filter_;
+    // The categories we want for each log-level
+    std::atomic<filter_t> relevant_[LL_NUM_LEVELS];
     const std::locale locale_;
+
+    // Characters that WriteMessage() must treat specially, according to locale_
+    bool special_[256];
+    // True if any character above 0x7f is special in locale_
+    bool high_special_ = false;
+    find_special_t find_special_ = nullptr;
+
+    // The flush policy
+    std::atomic<unsigned> flush_records_ {1};
+    std::atomic<std::int64_t> flush_interval_ {0};
+    std::atomic<LogLevel> flush_level_ {LL_ERROR};
+    // Records written, but not flushed
+    std::atomic<unsigned> pending_ {0};
+    // When the first of the pending records was written
+    std::atomic<std::chrono::steady_clock::rep> first_pending_ {0};
 };
 
 /*! Log event-handler that prints to the console */
@@ -245,12 +625,12 @@ public:
                 const filter_t filter = LA_DEFAULT_ENABLE)
         : LogEventHandler(name, level, filter), out_(stream) {}
 
-    virtual void Submit ( const SubmitInfo& info ) noexcept {
-        WriteDefaulInfo(out_, info);
-    }
+    virtual void Submit ( const SubmitInfo& info ) noexcept;
+    virtual void Flush() noexcept;
 
 private:
     std::ostream& out_;
+    std::mutex lock_;
 };
 
 /*! Log event handler that prints to a file on the file-system */
@@ -259,6 +639,11 @@ class LogToFile : public LogEventHandler
 public:
     typedef std::string path_t;
 
+    /// Size of the file buffer. Consecutive records are collected here
+    /// and written with one system-call, unless the flush policy
+    /// requires a flush.
+    static constexpr std::size_t buffer_size = 64 * 1024;
+
     /*! Constructs a file log handler.
 
         \exception Exception if the file cannot be opened for append.
@@ -269,9 +654,24 @@ public:
               const LogLevel level = LL_NOTICE,
               const filter_t filter = LA_DEFAULT_ENABLE);
 
-    virtual void Submit (const SubmitInfo& info) noexcept {
-        WriteDefaulInfo(out_, info);
-    }
+    virtual void Submit (const SubmitInfo& info) noexcept;
+    virtual void Flush() noexcept;
+
+    /*! Write a sparse index for the log-file
+
+        The index is written to a sidecar file, with ".idx" appended
+        to the log-file's name. It has one line, "<unix-time in
+        milliseconds> <byte-offset>", for the first record after every
+        \a interval bytes of log-data. Tools (like warlog_query) use
+        it to find a time-range in a large log-file without scanning
+        it from the start.
+
+        The index is appended to, or truncated, like the log-file. If the
+        log-file is empty, the index is always truncated.
+
+        \exception Exception if the index-file cannot be opened.
+    */
+    void EnableIndex(const std::size_t interval = 64 * 1024);
 
     /*! Helper */
     static LogEventHandler::ptr_t Create(const path_t& path,
@@ -280,9 +680,371 @@ public:
                                          const LogLevel level = LL_NOTICE,
                                          const filter_t filter = LA_DEFAULT_ENABLE);
 
-private:
+protected:
+    /*! Output buffer for the log-file
+
+        Collects the records in a buffer, and writes them to the
+        (unbuffered) file with one system-call. It keeps track of the
+        byte offset in the file, so that we don't have to query the
+        file (which flushes it) to get the position for the index.
+    */
+    class FileBuffer : public std::streambuf
+    {
+    public:
+        FileBuffer();
+        ~FileBuffer();
+
+        bool Open(const path_t& path, const std::ios_base::openmode mode);
+
+        /*! Current offset in the file, including buffered data */
+        std::uint64_t GetOffset() const noexcept {
+            return written_ + static_cast<std::uint64_t>(pptr() - pbase());
+        }
+
+    protected:
+        int overflow(int ch) override;
+        int sync() override;
+
+    private:
+        bool WriteBuffer() noexcept;
+
+        std::unique_ptr<char[]> buffer_;
+        std::filebuf file_;
+        std::uint64_t written_ = 0;
+    };
+
+    /*! Add an index entry if it's time for one. Call before the record is written. */
+    void UpdateIndex(const SubmitInfo& info) noexcept;
+
     const path_t path_;
-    std::ofstream out_;
+    const bool truncate_;
+    FileBuffer buffer_;
+    std::ostream out_;
+    std::ofstream index_;
+    std::size_t index_interval_ = 0;
+    std::uint64_t indexed_offset_ = 0;
+    bool have_indexed_ = false;
+    std::mutex lock_;
+};
+
+/*! Log event handler that writes JSON lines to a file
+
+    Each log event is written as one JSON object on one line:
+
+        {"ts":"2026-10-19T08:00:00.123Z","level":"NOTICE","filter":["GENERAL"],
+         "thread":"140031","msg":"Request completed","fields":{"status":200}}
+
+    The timestamp is UTC. The fields are written with their types, so
+    the logs can be consumed by log-processing tools without parsing
+    the text. The JSON is written directly to the file stream.
+*/
+class LogToJsonFile : public LogToFile
+{
+public:
+    /*! Constructs a JSON lines file log handler.
+
+        \exception Exception if the file cannot be opened for append.
+    */
+    LogToJsonFile(const path_t& path,
+                  const bool truncateFileOnOpen = false,
+                  const std::string& name = "json",
+                  const LogLevel level = LL_NOTICE,
+                  const filter_t filter = LA_DEFAULT_ENABLE);
+
+    virtual void Submit (const SubmitInfo& info) noexcept;
+
+    /*! Helper */
+    static LogEventHandler::ptr_t Create(const path_t& path,
+                                         const bool truncateFileOnOpen = false,
+                                         const std::string& name = "json",
+                                         const LogLevel level = LL_NOTICE,
+                                         const filter_t filter = LA_DEFAULT_ENABLE);
+
+    /*! Write the log event as a JSON object, without the trailing newline */
+    static void WriteJson(std::ostream& out, const SubmitInfo& si) noexcept;
+
+    /*! Write a string as a quoted and escaped JSON string */
+    static void WriteJsonString(std::ostream& out, const boost::string_ref& str) noexcept;
+};
+
+/*! Log event handler that decouples another handler from the logging threads
+
+    The records are copied to a bounded queue, and written to the
+    wrapped handler by a dedicated thread. A slow device (like a file
+    on a busy disk) will therefore only stall its own queue, and not
+    the other handlers or the threads that log.
+
+    What happens when the queue is full is decided by the overflow policy.
+*/
+class LogQueue : public LogEventHandler
+{
+public:
+    enum OverflowPolicy {
+        /// Wait until there is room in the queue
+        OP_BLOCK,
+        /// Discard the record
+        OP_DROP,
+        /// When the queue is more than half full, only every sampleRate'th
+        /// record is queued. Records are discarded when the queue is full.
+        OP_SAMPLE
+    };
+
+    struct Stats {
+        /// Records accepted into the queue
+        std::uint64_t queued_ = 0;
+        /// Records passed on to the wrapped handler
+        std::uint64_t written_ = 0;
+        /// Records discarded because of the overflow policy
+        std::uint64_t dropped_ = 0;
+    };
+
+    /*! Wrap a handler in a queue.
+
+        The queue use the name, level and filter of the wrapped handler.
+
+        \param handler Handler to wrap. It will only be called from the
+            queues own thread.
+        \param capacity Max number of records in the queue
+        \param policy What to do when the queue is full
+        \param sampleRate Used by OP_SAMPLE
+    */
+    LogQueue(LogEventHandler::ptr_t handler,
+             const std::size_t capacity = 4096,
+             const OverflowPolicy policy = OP_BLOCK,
+             const unsigned sampleRate = 10);
+
+    ~LogQueue();
+
+    virtual void Submit (const SubmitInfo& info) noexcept;
+
+    /*! Flush the wrapped handler */
+    virtual void Flush() noexcept;
+    virtual void FlushIfDue(const std::chrono::steady_clock::time_point now) noexcept;
+    virtual std::chrono::milliseconds GetFlushInterval() const noexcept;
+
+    /*! Returns a snapshot of the counters */
+    Stats GetStats() const noexcept;
+
+    /*! Returns the number of records currently in the queue */
+    std::size_t GetCount() const noexcept;
+
+    /*! Helper */
+    static LogEventHandler::ptr_t Create(LogEventHandler::ptr_t handler,
+                                         const std::size_t capacity = 4096,
+                                         const OverflowPolicy policy = OP_BLOCK,
+                                         const unsigned sampleRate = 10);
+
+private:
+    void Run() noexcept;
+
+    using queue_t = std::vector<SubmitInfo>;
+
+    const LogEventHandler::ptr_t handler_;
+    const std::size_t capacity_;
+    const OverflowPolicy policy_;
+    const unsigned sample_rate_;
+    queue_t queue_;
+    bool done_ = false;
+    mutable std::mutex lock_;
+    std::condition_variable have_data_;
+    std::condition_variable have_room_;
+    std::atomic<std::uint64_t> queued_ {0};
+    std::atomic<std::uint64_t> written_ {0};
+    std::atomic<std::uint64_t> dropped_ {0};
+    std::uint64_t sample_counter_ = 0;
+    std::thread thread_;
+};
+
+/*! Log event handler that keeps the most recent records in memory
+
+    The recorder is meant to run at a more detailed level (typically
+    LL_TRACE4) than the other handlers. It records into a ring-buffer
+    for each thread that logs. Nothing is formatted or written until
+    the records are dumped. The strings in the ring-buffers are reused,
+    so in steady state a record costs a copy of the message.
+
+    The records are dumped (oldest first):
+     - On demand, with Dump()
+     - When a LL_FATAL message is logged
+     - From a signal-handler, if a crash handler is installed with
+       InstallCrashHandler()
+*/
+class LogFlightRecorder : public LogEventHandler
+{
+public:
+    /*! Constructs a flight recorder.
+
+        \param recordsPerThread The number of records to keep for each thread
+        \param target Handler that receive the records when they are dumped
+            because of a LL_FATAL message. If empty, the records are written
+            to std::clog.
+    */
+    LogFlightRecorder(const std::size_t recordsPerThread = 2048,
+                      LogEventHandler::ptr_t target = {},
+                      const std::string& name = "flight-recorder",
+                      const LogLevel level = LL_TRACE4,
+                      const filter_t filter = LA_DEFAULT_ENABLE);
+
+    ~LogFlightRecorder();
+
+    virtual void Submit (const SubmitInfo& info) noexcept;
+
+    /*! Write the records to a stream, ordered by time */
+    void Dump(std::ostream& out) const;
+
+    /*! Pass the records to another handler, ordered by time
+
+        The handlers level and filter is not checked. Each message
+        is prefixed with "[flight-recorder] ".
+    */
+    void Dump(LogEventHandler& target) const;
+
+    /*! Returns the number of records currently held */
+    std::size_t GetCount() const noexcept;
+
+    /*! Dump the records to fd if the application crash
+
+        Only one recorder can have the crash handler. On POSIX systems,
+        a handler is installed for SIGSEGV, SIGBUS, SIGILL, SIGFPE and
+        SIGABRT. It writes the records, one thread at the time, with
+        async-signal-safe functions only, and then re-raise the signal
+        with the default handler. The records are read without locking,
+        so a record that is being written when the crash happens may be
+        garbled.
+
+        The conversion from TscClock ticks to wall time is prepared
+        here, so that the signal handler only has to do arithmetic.
+    */
+    void InstallCrashHandler(const int fd = 2);
+
+    /*! Helper */
+    static LogEventHandler::ptr_t Create(const std::size_t recordsPerThread = 2048,
+                                         LogEventHandler::ptr_t target = {},
+                                         const std::string& name = "flight-recorder",
+                                         const LogLevel level = LL_TRACE4,
+                                         const filter_t filter = LA_DEFAULT_ENABLE);
+
+private:
+    struct Record {
+        LogLevel level_ = LL_FATAL;
+        filter_t filter_ = 0;
+        std::uint64_t ticks_ = 0;
+        std::string buf_;
+        Field::fields_t fields_;
+        ThreadIdentity identity_;
+    };
+
+    struct Ring {
+        explicit Ring(const std::size_t capacity) : records_(capacity) {}
+
+        std::vector<Record> records_;
+        // Total number of records written to the ring
+        std::atomic<std::uint64_t> count_ {0};
+        const std::thread::id thread_ = std::this_thread::get_id();
+        Ring *next_ = nullptr;
+        mutable std::mutex lock_;
+    };
+
+    using records_t = std::vector<std::unique_ptr<const SubmitInfo>>;
+
+    Ring& GetRing();
+    records_t Collect(const std::string& prefix) const;
+    static void OnCrash(int signal);
+    void DumpFromSignal(const int fd) const noexcept;
+
+    // Used to convert the timestamps in DumpFromSignal()
+    TscClock::WallTimeSnapshot crash_clock_;
+
+    const std::size_t records_per_thread_;
+    const LogEventHandler::ptr_t target_;
+    // Identifies this recorder in the thread-local ring cache
+    const std::uint64_t id_;
+    /* Linked list of the rings, newest first. Rings are only added,
+     * so the list can be traversed without locking (also from a
+     * signal-handler). Rings are kept after their thread exits, so
+     * that the records can be dumped.
+     */
+    std::atomic<Ring *> rings_ {nullptr};
+    int crash_fd_ = -1;
+
+    static std::atomic<LogFlightRecorder *> crash_recorder_;
+};
+
+/*! Log-level and filter for the current thread
+
+    A context can make messages relevant that are not relevant for
+    any of the handlers. This makes it possible to trace one request,
+    connection or session, without tracing everything. Messages that
+    are relevant only because of the context are passed to all the
+    handlers.
+
+    The context belongs to the thread. Use ScopedLogContext to set it.
+    Tasks posted to a Pipeline carries the context of the thread that
+    posted them.
+
+    When no thread has an active context, the cost is one extra
+    load in LogEngine::IsRelevant() for messages that are not relevant.
+*/
+class LogContext
+{
+public:
+    /*! A context that does not change anything */
+    constexpr LogContext() noexcept = default;
+
+    /*! A context that logs messages at level or above that match filter */
+    constexpr LogContext(const LogLevel level,
+                         const filter_t filter = LA_DEFAULT_ENABLE) noexcept
+        : level_(level), filter_(filter), active_(true) {}
+
+    bool IsActive() const noexcept { return active_; }
+    LogLevel GetLevel() const noexcept { return level_; }
+    filter_t GetFilter() const noexcept { return filter_; }
+
+    bool IsRelevant(const LogLevel level, const filter_t filter) const noexcept {
+        return active_ && (level <= level_) && ((filter & filter_) != 0);
+    }
+
+    /*! Returns true if any thread has an active context */
+    static bool IsAnyActive() noexcept {
+        return active_count_.load(std::memory_order_relaxed) != 0;
+    }
+
+    /*! Returns the context of the current thread */
+    static const LogContext& GetCurrent() noexcept;
+
+    /*! Set the context of the current thread */
+    static void SetCurrent(const LogContext& context) noexcept;
+
+private:
+    LogLevel level_ = LL_FATAL;
+    filter_t filter_ = 0;
+    bool active_ = false;
+
+    // Number of threads with an active context
+    static std::atomic<int> active_count_;
+};
+
+/*! Set the log context for the current thread, and restore
+    the previous context when the object goes out of scope.
+*/
+class ScopedLogContext
+{
+public:
+    explicit ScopedLogContext(const LogContext& context) noexcept
+        : prev_(LogContext::GetCurrent())
+    {
+        LogContext::SetCurrent(context);
+    }
+
+    ~ScopedLogContext() {
+        LogContext::SetCurrent(prev_);
+    }
+
+    ScopedLogContext(const ScopedLogContext&) = delete;
+    ScopedLogContext& operator = (const ScopedLogContext&) = delete;
+
+private:
+    const LogContext prev_;
 };
 
 /*! The log-manager.
@@ -296,23 +1058,45 @@ class LogEngine
 public:
     struct Exception : public war::ExceptionBase {};
 
+    /*! Constructor
+
+        Calibrates the TscClock used for the timestamps, which blocks
+        for a few milliseconds if it is not already done.
+    */
     LogEngine();
     ~LogEngine();
 
     LogEngine& operator = (const LogEngine&) = delete;
 
-    /*! Returns true if the log-level and filter will be logged to at least one event-handler */
+    /*! Returns true if the log-level and filter will be logged to at least one event-handler
+
+        The combined filter of the handlers are pre-calculated for each
+        log-level (taking category levels into consideration), so this is
+        one load and a bitwise and. If that fails, the LogContext of the
+        current thread is checked, but only if some thread has an active
+        context.
+    */
     static bool IsRelevant (const LogLevel level, const filter_t filter) noexcept {
-        return (level <= current_level_) && ((filter & current_filter_) != 0);
+        return ((relevant_[level].load(std::memory_order_relaxed) & filter) != 0)
+            || (UNLIKELY(LogContext::IsAnyActive())
+                && LogContext::GetCurrent().IsRelevant(level, filter));
     }
 
     /*! Submit an event to the log event handlers
-    This method is therad safe, and log messages are passed to the
-    event-handlers in the order they are received.
+    This method is therad safe, and log messages are passed to each
+    event-handler in the order they are received.
+
+    No locks are taken to find the handlers. Each handler is responsible
+    for serializing its own output.
     */
-    static void  Submit ( Log& log ) noexcept {
+    static void  Submit ( Log& log ) noexcept;
+
+    /*! Submit a formatted message to the log event handlers */
+    static void  Submit ( const LogLevel level, const filter_t filter,
+                          std::string&& message,
+                          Field::fields_t&& fields = {} ) noexcept {
         WAR_ASSERT (instance_);
-        instance_->DoSubmit ( log );
+        instance_->DoSubmit ( level, filter, std::move(message), std::move(fields) );
     }
 
     /*! Add a new log event-handler.
@@ -324,6 +1108,69 @@ public:
     */
     void AddHandler ( LogEventHandler::ptr_t handler );
 
+    /*! Remove a log event-handler.
+
+        The log-level and filters are adjusted to the remaining handlers.
+
+        \note Other threads may still be using the handler when this
+            method returns. The engine keeps its reference to the handler
+            until no logging thread uses it. That is checked when this
+            method returns, and again each time a handler is added or
+            removed. A handler that was still in use is released by one
+            of those calls, or when the engine is destroyed.
+    */
+    void RemoveHandler ( const LogEventHandler::ptr_t& handler );
+
+    /*! Re-calculate the log-level and filter from the handlers.
+
+        This is done automatically when handlers are added or removed,
+        or when a handlers level, filter or flush policy is changed.
+    */
+    void UpdateLevelAndFilter();
+
+    /*! Register a new log category at runtime
+
+        The category get one of the bits in filter_t that are not used by
+        the LogAbout values. Categories are shared by all LogEngine instances,
+        and are normally registered during startup.
+
+        Remember to add the category to the filter of the log event-handlers
+        that shall receive the messages.
+
+        \param name Name of the category, as it appears in the logs.
+        \return The filter bit for the category.
+        \exception Exception if the name is in use, or if all the bits are used.
+    */
+    static filter_t RegisterCategory(const std::string& name);
+
+    /*! Get a category from it's name.
+
+        \exception Exception on invalid name.
+    */
+    static filter_t GetCategoryFromName(const std::string& name);
+
+    /*! Returns the name of a category, or nullptr if it's not registered */
+    static const char *GetCategoryName(const filter_t category) noexcept;
+
+    /*! Set the log-level for one or more categories.
+
+        For messages in these categories, the category level is used
+        in stead of the log-level of the handlers. The handlers still
+        need the category in their filter to get the messages.
+
+        This makes it possible to log one part of an application at
+        TRACE level without tracing everything.
+    */
+    void SetCategoryLevel(const filter_t categories, const LogLevel level);
+
+    /*! Use the log-level of the handlers again for these categories */
+    void ClearCategoryLevel(const filter_t categories);
+
+    /*! Returns true if a LogEngine exists */
+    static bool HasInstance() noexcept {
+        return instance_ != nullptr;
+    }
+
     /*! Get the log-level from it's name.
 
         \exception Exception on invalid name.
@@ -336,16 +1183,119 @@ public:
     }
 
 private:
-    void DoSubmit ( Log& log ) noexcept;
-    void UpdateLevelAndFilter();
-
+    friend class LogEventHandler;
     typedef std::vector<LogEventHandler::ptr_t> handlers_t;
-    handlers_t handlers_;
+
+    void DoSubmit ( const LogLevel level, const filter_t filter,
+                    std::string&& message, Field::fields_t&& fields ) noexcept;
+    void Publish(std::unique_ptr<handlers_t>&& handlers);
+    void Reclaim();
+    void RunFlusher() noexcept;
+    void UpdateFlusher();
+
+    /*! Calculate the categories wanted at each log-level for a handler
+        with this level and filter.
+    */
+    static void CalculateRelevance(const LogLevel level, const filter_t filter,
+                                   filter_t (&relevant)[LL_NUM_LEVELS]) noexcept;
+
+    /*! Pins the current set of handlers while a thread iterates over it */
+    class PinnedHandlers;
+
+    /*! The current set of handlers.
+
+        The set is never modified after it is published. Changes are
+        made to a copy that replace it. Readers can therefore use
+        the set without locking. A replaced set is moved to retired_,
+        and freed (with the handlers that were removed) as soon as no
+        thread has it pinned. If one has, it's checked again on the
+        next change.
+    */
+    std::atomic<const handlers_t *> handlers_ {nullptr};
+    std::vector<std::unique_ptr<const handlers_t>> retired_;
+
+    // Serialize changes to the handlers
     mutable std::mutex lock_;
 
+    // Timed flushing of the handlers
+    std::thread flusher_;
+    std::mutex flusher_lock_;
+    std::condition_variable flusher_cond_;
+    std::chrono::milliseconds flush_tick_ {0};
+    bool flusher_done_ = false;
+
     static LogEngine *instance_;
-    static LogLevel current_level_;
-    static filter_t current_filter_;
+
+    // The categories wanted by any handler, for each log-level
+    static std::atomic<filter_t> relevant_[LL_NUM_LEVELS];
+
+    // Registered categories. Names are never changed after they are set.
+    static std::mutex categories_lock_;
+    static std::atomic<const char *> category_names_[LA_NUM_CATEGORIES];
+    // Category log-levels, or -1 for categories that use the handlers level
+    static int category_levels_[LA_NUM_CATEGORIES];
+};
+
+/*! Log volume for one log statement
+
+    Only used when WAR_LOG_CALLSITE_STATS is defined. Then each
+    LOG_xxx statement has a static instance, that is registered in a
+    global list the first time the statement emits a message. It
+    counts the messages, the bytes in the messages and the time used
+    to format them, so that the statements that cost the most can be
+    found and demoted.
+
+    The counters are relaxed atomics, and the list is never locked,
+    so the overhead is a few atomic increments per message.
+*/
+class LogCallSite
+{
+public:
+    struct Stats {
+        const char *file = nullptr;
+        int line = 0;
+        LogLevel level = LL_FATAL;
+        std::uint64_t count = 0;
+        std::uint64_t bytes = 0;
+        std::chrono::nanoseconds format_time {0};
+    };
+
+    LogCallSite(const char *file, const int line, const LogLevel level) noexcept;
+    LogCallSite(const LogCallSite&) = delete;
+    LogCallSite& operator = (const LogCallSite&) = delete;
+
+    /*! Account for one message */
+    void Add(const std::size_t bytes, const std::uint64_t ticks) noexcept {
+        count_.fetch_add(1, std::memory_order_relaxed);
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        ticks_.fetch_add(ticks, std::memory_order_relaxed);
+    }
+
+    Stats GetStats() const noexcept;
+
+    /*! Get the statistics for all the call-sites that have been used,
+        with the most bytes first.
+    */
+    static std::vector<Stats> GetAll();
+
+    /*! Write a table with the statistics, with the most bytes first
+
+        \param max Max number of call-sites to write. 0 means all.
+    */
+    static void Dump(std::ostream& out, const std::size_t max = 0);
+
+    /*! Set all the counters to zero */
+    static void Reset() noexcept;
+
+private:
+    const char * const file_;
+    const int line_;
+    const LogLevel level_;
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> bytes_{0};
+    std::atomic<std::uint64_t> ticks_{0};
+    LogCallSite *next_ = nullptr;
+    static std::atomic<LogCallSite *> sites_;
 };
 
 /*! Logging class
@@ -357,12 +1307,47 @@ class Log
 {
 public:
     Log (const LogLevel level, const filter_t filter) noexcept
-        : level_ (level), filter_ (filter) {}
+        : level_ (level), filter_ (filter)
+    {
+        AttachFields();
+    }
+
+    /*! Used by the rate-limited and sampled log macros.
+
+        \param suppressed Number of messages suppressed at the
+            call-site since the last message that was logged.
+    */
+    Log (const LogLevel level, const filter_t filter,
+         const std::uint32_t suppressed,
+         LogCallSite *site = nullptr) noexcept
+        : level_ (level), filter_ (filter), site_ (site)
+    {
+        if (site_) {
+            start_ = TscClock::Ticks();
+        }
+        AttachFields();
+        if (suppressed) {
+            buf_ << '[' << suppressed << " messages suppressed] ";
+        }
+    }
+
+    /*! Used by the log macros when WAR_LOG_CALLSITE_STATS is defined. */
+    Log (const LogLevel level, const filter_t filter, LogCallSite& site) noexcept
+        : level_ (level), filter_ (filter), site_ (&site), start_ (TscClock::Ticks())
+    {
+        AttachFields();
+    }
 
     Log& operator = (Log &&log) = delete;
     Log& operator = (const Log &log) = delete;
 
     ~Log() noexcept {
+        if (UNLIKELY(site_ != nullptr)) {
+            auto message = buf_.str();
+            site_->Add(message.size(), TscClock::Ticks() - start_);
+            LogEngine::Submit(level_, filter_, std::move(message), std::move(fields_));
+            return;
+        }
         LogEngine::Submit ( *this );
     }
 
@@ -382,10 +1367,135 @@ public:
         return filter_;
     }
 
+    /*! The fields streamed to the log */
+    Field::fields_t& GetFields() noexcept {
+        return fields_;
+    }
+
+    /*! Returns the number of suppressed messages reported by the last
+        RateLimiter or Sampler that allowed a message on this thread,
+        and sets it to 0.
+    */
+    static std::uint32_t TakeSuppressed() noexcept {
+        const auto suppressed = suppressed_;
+        suppressed_ = 0;
+        return suppressed;
+    }
+
 private:
+    friend class RateLimiter;
+    friend class Sampler;
+
+    // Let operator << (std::ostream&, const Field&) find fields_
+    void AttachFields() noexcept {
+        buf_.pword(Field::GetStreamIndex()) = &fields_;
+    }
+
     std::ostringstream buf_;
+    Field::fields_t fields_;
     LogLevel level_;
     filter_t filter_;
+    LogCallSite *site_ = nullptr;
+    std::uint64_t start_ = 0;
+    static thread_local std::uint32_t suppressed_;
+};
+
+inline void LogEngine::Submit ( Log& log ) noexcept {
+    Submit ( log.GetLevel(), log.GetFilter(), log.Get().str(),
+             std::move(log.GetFields()) );
+}
+
+/*! Coarse monotonic time in seconds
+
+    This is cheap (no system-call) on Linux, and good enough to
+    rate-limit log messages.
+*/
+inline std::uint32_t GetCoarseSeconds() noexcept {
+#ifdef CLOCK_MONOTONIC_COARSE
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<std::uint32_t>(ts.tv_sec);
+#else
+    return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/*! Per call-site rate limiter used by the LOG_xxx_RL macros
+
+    The state (the current second, and the number of messages
+    logged in that second) is packed into one atomic. When the limit
+    is reached, a suppressed message costs a read of the coarse clock
+    and a relaxed load. It does not write to the shared state, so
+    threads that hammer a suppressed call-site don't contend on it.
+    Each thread counts the messages it suppressed in its own counter.
+
+    The class is a literal type, so that a static instance at the
+    call-site is initialized without a guard-variable.
+*/
+class RateLimiter
+{
+public:
+    constexpr RateLimiter() noexcept {}
+
+    /*! Returns true if the message can be logged
+
+        \param perSecond Max messages each second
+        \param suppressed The calling threads count of suppressed
+            messages at this call-site.
+    */
+    bool Allow(const std::uint32_t perSecond, std::uint32_t& suppressed) noexcept {
+        const std::uint32_t now = GetCoarseSeconds();
+        std::uint64_t state = state_.load(std::memory_order_relaxed);
+        if (LIKELY(static_cast<std::uint32_t>(state >> 32) == now)) {
+            if (static_cast<std::uint32_t>(state) >= perSecond) {
+                ++suppressed;
+                return false;
+            }
+            state = state_.fetch_add(1, std::memory_order_relaxed);
+            if (LIKELY(static_cast<std::uint32_t>(state >> 32) == now)) {
+                if (static_cast<std::uint32_t>(state) >= perSecond) {
+                    // Another thread took the last slot
+                    ++suppressed;
+                    return false;
+                }
+                Log::suppressed_ = suppressed;
+                suppressed = 0;
+                return true;
+            }
+        }
+        return StartNewPeriod(now, perSecond, suppressed);
+    }
+
+private:
+    bool StartNewPeriod(const std::uint32_t now, const std::uint32_t perSecond,
+                        std::uint32_t& suppressed) noexcept;
+
+    std::atomic<std::uint64_t> state_ {0};
+};
+
+/*! Per call-site sampler used by the LOG_xxx_SAMPLED macros
+
+    Allows the first, and then every N'th message. If N is 0 or 1,
+    all the messages are allowed.
+*/
+class Sampler
+{
+public:
+    constexpr Sampler() noexcept {}
+
+    /*! Returns true if the message can be logged */
+    bool Allow(const std::uint32_t everyN) noexcept {
+        const std::uint32_t count = count_.fetch_add(1, std::memory_order_relaxed);
+        if ((everyN > 1) && (count % everyN)) {
+            return false;
+        }
+        Log::suppressed_ = (count && (everyN > 1)) ? (everyN - 1) : 0;
+        return true;
+    }
+
+private:
+    std::atomic<std::uint32_t> count_ {0};
 };
 
 
@@ -459,7 +1569,7 @@ public:
     std::ostream& Stream (std::ostream& o) const {
 
         const auto duration =
-            (is_running_ ? std::chrono::steady_clock::now() : end_) - start_;
+            (is_running_ ? TscClock::now() : end_) - start_;
 
         const auto mi = std::chrono::duration_cast<std::chrono::minutes>(duration).count();
         if (mi > 5) {
@@ -482,15 +1592,14 @@ public:
     }
 
     void Stop() {
-        end_ = std::chrono::steady_clock::now();
+        end_ = TscClock::now();
         is_running_ = false;
     }
 
 private:
-    std::chrono::steady_clock::time_point end_;
+    TscClock::time_point end_;
     bool is_running_ {true};
-    const std::chrono::steady_clock::time_point start_
-        = std::chrono::steady_clock::now();
+    const TscClock::time_point start_ = TscClock::now();
 };
 
 #if defined(_DEBUG) || defined(DEBUG)
@@ -510,3 +1619,6 @@ std::ostream& operator << (std::ostream& out, const boost::exception& ex);
 std::ostream& operator << (std::ostream& out, const boost::system::error_code& err);
 std::ostream& operator << (std::ostream& out, const war::log::Esc& esc);
 std::ostream& operator << (std::ostream& out, const war::log::Timer& timer);
+std::ostream& operator << (std::ostream& out, const war::log::Field& field);
+
+#include <warlib/log_format.h>
@@ -10,6 +10,11 @@
 #include <cstdint>
 #include <iostream>
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
@@ -17,9 +22,36 @@
 
 
 #include <warlib/asio.h>
+#include <warlib/task_trace.h>
+#include <warlib/tsc_clock.h>
 
 namespace war {
 
+/*! Execution statistics for all the tasks with the same name
+
+    See Pipeline::EnableTaskStats()
+*/
+struct TaskStats {
+    /*! The name of the task (task_t::second) */
+    const char *name = nullptr;
+
+    /*! Number of times a task with this name was executed */
+    std::uint64_t count = 0;
+
+    /*! Total wall time spent executing the tasks */
+    std::chrono::nanoseconds wall_time {0};
+
+    /*! Wall time for the slowest task */
+    std::chrono::nanoseconds max_wall_time {0};
+
+    /*! Total CPU time spent by the thread while executing the tasks.
+        Always 0 on platforms without CLOCK_THREAD_CPUTIME_ID.
+    */
+    std::chrono::nanoseconds cpu_time {0};
+};
+
+/*! Task statistics, ordered by wall time, most expensive first */
+using task_stats_t = std::vector<TaskStats>;
 
 /*! Single-thread task sequencer, timer and asio io_context instance
 
@@ -70,13 +102,72 @@ public:
     auto Post(const task_t& task, Token&& token) {
     return boost::asio::async_compose<Token, void(boost::system::error_code e)>
         ([this, &task](auto& self) mutable {
-            boost::asio::post(io_context_->get_executor(), [this, self=std::move(self), task=std::move(task)]() mutable {
+            boost::asio::post(io_context_->get_executor(), [this, self=std::move(self), task=WithLogContext_(task)]() mutable {
                 ExecTask_(task, true, true);
+                if (TaskTrace::IsEnabled()) {
+                    TaskTrace::Record(TaskTrace::ET_RESUME, "Resuming Coroutine");
+                }
                 self.complete({});
             });
         }, token, io_context_->get_executor());
     }
 
+    using on_expired_t = std::function<void ()>;
+
+    /*! Post a task that is only worth running before a deadline
+
+        Works like Post, except that if the task has not started when
+        the deadline is passed, it's dropped without being executed. This
+        lets an overloaded pipeline skip work for callers that have
+        already given up, in stead of delaying the fresh tasks behind it.
+
+        \param task Task to run
+        \param deadline Latest time for the task to start
+        \param onExpired Optional callback that is called in stead of
+            the task if the task is dropped. It's called from the
+            pipelines thread.
+    */
+    void PostWithDeadline(task_t task, TscClock::time_point deadline,
+                          on_expired_t onExpired = {});
+
+    /*! Returns the number of tasks dropped because their deadline passed */
+    std::uint64_t GetExpiredCount() const noexcept { return expired_tasks_; }
+
+    /*! What PostUnique() does if a task with the same key is pending */
+    enum UniqueMode {
+        UM_REPLACE, ///< The new task replaces the pending task
+        UM_DROP     ///< The new task is dropped
+    };
+
+    /*! Post a task, unless a task with the same key is already queued
+
+        Useful for tasks like "recompute X" or "flush Y", that may be
+        posted many times before the pipeline gets to them. At most one
+        task for each key is pending. When the task starts, it's no longer
+        pending, so a new post with the same key will be queued.
+
+        \param key Identifies the work. Keys are local to the pipeline.
+        \param task Task to run
+        \param mode What to do if a task with the same key is pending.
+        \return true if the task was queued, false if it was merged
+            with a pending task.
+    */
+    bool PostUnique(const std::string& key, task_t task, UniqueMode mode = UM_REPLACE);
+
+    /*! Post a task that runs when there have been no new posts with the same key
+        for milliSeconds milliseconds.
+
+        Each post replaces the pending task for the key, and restarts
+        the delay. Built on PostWithTimer(). Posts with the same key
+        share one pending timer, which is re-armed when it expires if
+        the task was posted again in the meantime.
+
+        \param key Identifies the work. Keys are local to the pipeline.
+        \param task Task to run
+        \param milliSeconds Delay after the last post
+    */
+    void PostDebounced(const std::string& key, task_t task, std::uint32_t milliSeconds);
+
     /*! Post a task with a future
      *
      * The caller is responsible for setting the value upon successful
@@ -131,8 +222,11 @@ public:
             ([this, milliSeconds, &task](auto& self) mutable {
                 auto timer = std::make_shared<boost::asio::deadline_timer>(*io_context_);
                 timer->expires_from_now(boost::posix_time::milliseconds(milliSeconds));
-                timer->async_wait([this, timer, task=std::move(task), self=std::move(self)](boost::system::error_code ec) mutable {
+                timer->async_wait([this, timer, task=WithLogContext_(task), self=std::move(self)](boost::system::error_code ec) mutable {
                     OnTimer_({}, task, ec);
+                    if (TaskTrace::IsEnabled()) {
+                        TaskTrace::Record(TaskTrace::ET_RESUME, "Resuming Coroutine");
+                    }
                     self.complete(ec);
                 });
             }, token, io_context_->get_executor());
@@ -143,6 +237,9 @@ public:
         boost::asio::async_result<decltype (handler)> result (handler);
         PostWithTimer({[this, task, handler]() mutable {
                            ExecTask_(task, true);
+                           if (TaskTrace::IsEnabled()) {
+                               TaskTrace::Record(TaskTrace::ET_RESUME, "Resuming Coroutine");
+                           }
                            handler(boost::system::error_code{});
                        }, "Resuming Coroutine"}, milliSeconds);
 
@@ -187,15 +284,124 @@ public:
 
     const std::string& GetName() const noexcept { return name_; }
 
+    /*! The task the pipeline is executing right now */
+    struct CurrentTask {
+        /*! The name of the task, or nullptr if the pipeline is idle */
+        const char *name = nullptr;
+
+        /*! When the task started */
+        TscClock::time_point started;
+    };
+
+    /*! Get the task the pipeline is executing right now
+
+        This can be called from any thread, and is used by Watchdog
+        to find tasks that block the pipeline. If a task runs other
+        tasks (like Dispatch() does), the outermost task is returned.
+    */
+    CurrentTask GetCurrentTask() const noexcept;
+
+    /*! Get the longest time a single task has been running
+
+        \sa ResetMaxTaskDuration()
+    */
+    std::chrono::nanoseconds GetMaxTaskDuration() const noexcept;
+
+    /*! Start measuring the max task duration from now */
+    void ResetMaxTaskDuration() noexcept {
+        max_task_ticks_.store(0, std::memory_order_relaxed);
+    }
+
+    /*! Returns the native handle for the pipelines thread */
+    std::thread::native_handle_type GetNativeHandle() { return thread_->native_handle(); }
+
+    /*! Start or stop collecting statistics for the tasks we execute
+
+        When enabled, the pipeline counts the tasks, and measures the wall time
+        and the threads CPU time for each task, grouped by the tasks name.
+        The name-pointer is used as the key, so tasks with names from
+        different string literals with the same text are counted separately
+        until the statistics are merged by Threadpool::GetTaskStats().
+
+        Tasks that run inside other tasks (like the task passed to
+        PostSynchronously()) are counted on their own, and their time is also
+        included in the outer task.
+    */
+    void EnableTaskStats(bool enable = true) noexcept {
+        task_stats_enabled_.store(enable, std::memory_order_relaxed);
+    }
+
+    /*! Get the statistics collected since EnableTaskStats() or ResetTaskStats()
+
+        The statistics belongs to the pipelines thread, so unless we are
+        called from that thread, this method waits for the pipeline to
+        process its queue up to this point.
+    */
+    task_stats_t GetTaskStats();
+
+    /*! Clear the statistics */
+    void ResetTaskStats();
+
 private:
+    struct TaskCounters {
+        std::uint64_t count = 0;
+        std::uint64_t ticks = 0;
+        std::uint64_t max_ticks = 0;
+        std::uint64_t cpu_ns = 0;
+    };
+    using task_counters_t = std::unordered_map<const char *, TaskCounters>;
+
+    struct Debounced {
+        task_t task;
+        TscClock::time_point deadline;
+        // The timer that will look at the task. Other timers ignore it.
+        std::uint64_t timer_id = 0;
+        TscClock::time_point timer_due;
+    };
+
+    void RunUnique_(const std::string& key);
+    void RunDebounced_(const std::string& key, std::uint64_t timerId);
+    void ArmDebounceTimer_(const std::string& key, Debounced& pending,
+                           TscClock::time_point now);
+
+    /*! Run a task from PostUnique() or PostDebounced() with the log
+        context it was posted with, in stead of the context of the
+        wrapper that runs it.
+    */
+    static void RunWithOwnLogContext_(const task_t& task);
+
+    /*! Keeps track of the current task while it's running */
+    class TaskScope_;
+
     using my_sync_t = std::promise<void>;
     void Run(my_sync_t& sync, int pinTo);
     void ExecTask_(const task_t& task, bool counting, bool autoCatch = true);
+    void ExecTaskWithDeadline_(const task_t& task, TscClock::time_point deadline,
+                               const on_expired_t& onExpired);
     void OnTimer_(
         const timer_t& timer,
         const task_t& task,
         const boost::system::error_code& ec);
     void AddingTask();
+    void AddTaskStats_(const char *name, std::uint64_t startTicks,
+                       std::uint64_t startCpuTime);
+
+    /*! Returns the task, wrapped so that it runs with the log::LogContext
+        of the calling thread, if that context is active.
+    */
+    static task_t WithLogContext_(task_t task);
+
+    /*! If tracing is enabled, records that the task is queued, and returns
+        the task wrapped so that it records when it's dequeued.
+    */
+    static task_t TraceQueued_(task_t task, TaskTrace::EventType type);
+
+    /*! Run fn on the pipelines thread and wait for it to complete.
+
+        If the pipeline is closing, we wait for the thread to finish
+        and call fn from the current thread.
+    */
+    void WithTaskCounters_(const std::function<void ()>& fn);
 
     std::unique_ptr<io_context_t> io_context_;
     std::unique_ptr<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> work_guard_;
@@ -208,6 +414,17 @@ private:
     std::mutex close_mutex_;
     std::atomic<bool> closing_;
     std::int64_t tasks_run_ = 0;
+    std::atomic<std::uint64_t> expired_tasks_ {0};
+    std::atomic<bool> task_stats_enabled_ {false};
+    task_counters_t task_counters_; // Only used by the pipelines thread
+    std::atomic<const char *> current_task_ {nullptr};
+    std::atomic<std::uint64_t> current_task_start_ {0};
+    std::atomic<std::uint64_t> max_task_ticks_ {0};
+    unsigned task_depth_ = 0; // Only used by the pipelines thread
+    std::mutex unique_mutex_;
+    std::unordered_map<std::string, task_t> unique_tasks_;
+    std::unordered_map<std::string, Debounced> debounced_tasks_;
+    std::uint64_t debounce_timer_ids_ = 0; // Protected by unique_mutex_
     int id_; // Thread number in threadpool, starting at 0. -1 if not in threadpool;
 };
 
@@ -215,5 +432,6 @@ private:
 
 std::ostream& operator << (std::ostream& o, const war::task_t& task);
 std::ostream& operator << (std::ostream& o, const war::Pipeline& pipeline);
+std::ostream& operator << (std::ostream& o, const war::TaskStats& stats);
 
 #endif //WAR_PIPELINE_H
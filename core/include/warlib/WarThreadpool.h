@@ -46,6 +46,18 @@ namespace war {
         void PostWithTimer(const task_t &task, const std::uint32_t milliSeconds);
         void PostWithTimer(task_t &&task, const std::uint32_t milliSeconds);
 
+        /*! Post a task that is dropped if it has not started before the deadline.
+
+            See Pipeline::PostWithDeadline()
+        */
+        void PostWithDeadline(task_t task, TscClock::time_point deadline,
+                              Pipeline::on_expired_t onExpired = {});
+
+        /*! Returns the number of tasks dropped by all the pipelines
+            because their deadline passed.
+        */
+        std::uint64_t GetExpiredCount() const noexcept;
+
         /*! Get a pipeline
 
             This method currently uses a round-robin approach for balancing.
@@ -56,6 +68,18 @@ namespace war {
         std::size_t GetNumThreads() const noexcept { return capacity_; }
         Pipeline& GetPipeline(std::size_t id) { return *pool_.at(id); }
 
+        /*! Start or stop collecting task statistics in all the pipelines.
+
+            See Pipeline::EnableTaskStats()
+        */
+        void EnableTaskStats(bool enable = true);
+
+        /*! Get the task statistics from all the pipelines, merged by task name */
+        task_stats_t GetTaskStats();
+
+        /*! Clear the task statistics in all the pipelines */
+        void ResetTaskStats();
+
     private:
         void JoinAll();
 
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <warlib/WarPipeline.h>
+#include <warlib/WarLog.h>
+#include <warlib/mpsc_queue.h>
+
+namespace war {
+
+/*! Collects items from any thread, and hands them in batches to a handler
+
+    Items are added lock-free to a BoundedMpscQueue. The items are
+    flushed to the handler, which runs on the owning Pipeline, when
+    batchSize items are pending, or maxDelay after an item was added to
+    an empty batcher, whichever comes first.
+
+    The handler receives the batch as an rvalue. If it moves the vector
+    away, a new one is allocated for the next batch. If not, the vector
+    is cleared and re-used, so the memory is recycled between flushes.
+
+    The destructor flushes the pending items on the pipeline, and waits
+    for it, so the handler is never called after the Batcher is gone.
+    Don't destroy a Batcher from a task on another pipeline that the
+    Batcher's pipeline may be waiting for.
+
+    T must be default-constructible and move-assignable.
+*/
+template <typename T>
+class Batcher
+{
+public:
+    using batch_t = std::vector<T>;
+    using handler_t = std::function<void (batch_t&& batch)>;
+
+    /*! Constructor
+
+        \param pipeline Pipeline where the handler runs
+        \param handler Called with each batch
+        \param batchSize Max items in a batch, and the number of pending
+            items that triggers a flush.
+        \param maxDelay Max time an item waits for a flush
+        \param capacity Max number of pending items. Rounded up to a
+            power of two.
+    */
+    Batcher(Pipeline& pipeline,
+            handler_t handler,
+            const std::size_t batchSize = 64,
+            const std::chrono::milliseconds maxDelay = std::chrono::milliseconds(10),
+            const std::size_t capacity = 4096)
+    : state_{std::make_shared<State>(pipeline, std::move(handler), batchSize,
+                                     maxDelay, capacity)}
+    {
+    }
+
+    ~Batcher() {
+        State::Close(state_);
+    }
+
+    Batcher(const Batcher&) = delete;
+    Batcher& operator = (const Batcher&) = delete;
+
+    /*! Add an item
+
+        \return false if the batcher is full. The item is not added.
+    */
+    bool Add(T item) {
+        return State::Add(state_, std::move(item));
+    }
+
+    /*! Flush the pending items now */
+    void Flush() {
+        State::PostFlush(state_);
+    }
+
+    /*! Returns the number of items that are not yet handed to the handler */
+    std::size_t GetPending() const noexcept { return state_->pending_; }
+
+private:
+    class State
+    {
+    public:
+        State(Pipeline& pipeline, handler_t&& handler, const std::size_t batchSize,
+              const std::chrono::milliseconds maxDelay, const std::size_t capacity)
+        : pipeline_{pipeline}, handler_{std::move(handler)}
+        , batch_size_{std::max<std::size_t>(batchSize, 1)}
+        , max_delay_{static_cast<std::uint32_t>(maxDelay.count())}
+        , queue_{std::max(capacity, batch_size_)}
+        {
+            batch_.reserve(batch_size_);
+        }
+
+        static bool Add(const std::shared_ptr<State>& self, T&& item) {
+            if (!self->queue_.Push(std::move(item))) {
+                return false;
+            }
+
+            if ((++self->pending_ >= self->batch_size_)
+                && !self->flush_posted_.exchange(true)) {
+                PostFlush(self);
+            }
+
+            // Pairs with the fence in the timer task, so that either we
+            // see that the timer has fired, or the timer sees our item.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!self->timer_armed_.load(std::memory_order_relaxed)
+                && !self->timer_armed_.exchange(true)) {
+                self->pipeline_.PostWithTimer({[self] {
+                    self->timer_armed_ = false;
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    self->Flush_();
+                }, "Batcher timer"}, self->max_delay_);
+            }
+            return true;
+        }
+
+        /*! Deliver the pending items, and stop calling the handler */
+        static void Close(const std::shared_ptr<State>& self) noexcept {
+            if (self->pipeline_.IsPipelineThread()) {
+                self->Close_();
+                return;
+            }
+
+            try {
+                // If the pipeline drops the task, the promise is destroyed with it
+                auto done = std::make_shared<std::promise<void>>();
+                auto future = done->get_future();
+                task_t task{[self, done = std::move(done)] {
+                    self->Close_();
+                    done->set_value();
+                }, "Batcher close"};
+                try {
+                    self->pipeline_.Post(task);
+                } catch(const Pipeline::ExceptionCapacityExceeded&) {
+                    // Timers don't count against the pipelines capacity
+                    self->pipeline_.PostWithTimer(task, 1);
+                }
+                task = {nullptr, nullptr};
+                future.wait();
+            } WAR_CATCH_ALL_E;
+
+            self->closed_ = true;
+        }
+
+        static void PostFlush(const std::shared_ptr<State>& self) {
+            self->flush_posted_ = true;
+            try {
+                self->pipeline_.Post({[self] {
+                    self->flush_posted_ = false;
+                    self->Flush_();
+                }, "Batcher flush"});
+            } catch(const Pipeline::ExceptionCapacityExceeded&) {
+                // The timer will flush the items
+                self->flush_posted_ = false;
+            }
+        }
+
+        std::atomic<std::size_t> pending_{0};
+
+    private:
+        void Close_() {
+            Flush_();
+            closed_ = true;
+        }
+
+        void Flush_() {
+            if (closed_) {
+                return;
+            }
+
+            T item;
+            while(queue_.Pop(item)) {
+                batch_.push_back(std::move(item));
+                if (batch_.size() >= batch_size_) {
+                    Deliver();
+                }
+            }
+            if (!batch_.empty()) {
+                Deliver();
+            }
+        }
+
+        void Deliver() {
+            const auto count = batch_.size();
+            try {
+                handler_(std::move(batch_));
+            } WAR_CATCH_ALL_E_RL(10);
+
+            // Re-use the vector, unless the handler took it
+            batch_.clear();
+            batch_.reserve(batch_size_);
+            pending_ -= count;
+        }
+
+        Pipeline& pipeline_;
+        const handler_t handler_;
+        const std::size_t batch_size_;
+        const std::uint32_t max_delay_;
+        BoundedMpscQueue<T> queue_;
+        batch_t batch_; // Only used by the pipelines thread
+        std::atomic<bool> flush_posted_{false};
+        std::atomic<bool> timer_armed_{false};
+        std::atomic<bool> closed_{false};
+    };
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <warlib/WarPipeline.h>
+#include <warlib/WarLog.h>
+#include <warlib/mpsc_queue.h>
+
+namespace war {
+
+/*! Bounded channel that moves items of type T to a receiving Pipeline
+
+    Sending an item to another pipeline with Post() costs a task_t
+    (a std::function and usually an allocation) for each item. A channel
+    moves the items themselves through a lock-free BoundedMpscQueue,
+    and wakes the receiver once for each burst of items, so it can drain
+    them in a batch.
+
+    Items can be received in two ways, on the receiving pipeline's thread:
+    - SetReceiver() installs a handler that is called with each batch.
+      The vector is re-used between batches.
+    - async_receive() completes with the next batch. It works with the
+      asio completion tokens, like a yield_context.
+
+    Senders get backpressure when the channel is full:
+    - TrySend() returns false.
+    - Send() blocks the calling thread until there is room. Never call
+      it from the receiving pipeline.
+    - async_send() completes when the item is in the channel.
+
+    After Close(), sends fail, and async_receive() completes with
+    boost::asio::error::eof when the channel is empty.
+
+    The channel's state is kept alive by the tasks it has scheduled, so
+    the receiving pipeline must outlive the channel.
+
+    T must be default-constructible and move-assignable.
+*/
+template <typename T>
+class Channel
+{
+public:
+    using batch_t = std::vector<T>;
+    using receiver_t = std::function<void (batch_t& batch)>;
+
+    /*! Constructor
+
+        \param receiver Pipeline where the items are received
+        \param capacity Max number of items in the channel. Rounded up
+            to a power of two.
+        \param maxBatch Max number of items in a batch
+    */
+    Channel(Pipeline& receiver, const std::size_t capacity = 1024,
+            const std::size_t maxBatch = 64)
+    : state_{std::make_shared<State>(receiver, capacity, maxBatch)}
+    {
+    }
+
+    ~Channel() noexcept {
+        Close();
+    }
+
+    Channel(const Channel&) = delete;
+    Channel& operator = (const Channel&) = delete;
+
+    /*! Send an item if there is room for it
+
+        \return false if the channel is full or closed. The item is
+            only moved from if it was sent.
+    */
+    bool TrySend(T&& item) {
+        return state_->TrySend(std::move(item));
+    }
+
+    /*! Send an item, and wait for room if the channel is full
+
+        \return false if the channel is closed
+    */
+    bool Send(T item) {
+        return state_->Send(std::move(item));
+    }
+
+    /*! Send an item asynchronously
+
+        Completes with boost::system::error_code when the item is in
+        the channel, or with boost::asio::error::operation_aborted
+        if the channel is closed.
+    */
+    template <typename Token>
+    auto async_send(T item, Token&& token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code)>
+            ([state = state_, item = std::move(item)](auto& self) mutable {
+                // This lambda is moved along with self, so take what we need first
+                auto st = std::move(state);
+                auto value = std::move(item);
+                auto op = std::make_shared<std::decay_t<decltype(self)>>(std::move(self));
+                st->AsyncSend(std::move(value), [op](boost::system::error_code ec) {
+                    auto ex = op->get_executor();
+                    boost::asio::post(ex, [op, ec]() {
+                        op->complete(ec);
+                    });
+                });
+            }, token, state_->GetExecutor());
+    }
+
+    /*! Receive the next batch of items asynchronously
+
+        Completes with (boost::system::error_code, batch_t) when there
+        are items in the channel, or with boost::asio::error::eof if the
+        channel is closed and empty. Only one receive can be pending,
+        and it can not be combined with SetReceiver().
+    */
+    template <typename Token>
+    auto async_receive(Token&& token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code, batch_t)>
+            ([state = state_](auto& self) mutable {
+                auto st = std::move(state);
+                auto op = std::make_shared<std::decay_t<decltype(self)>>(std::move(self));
+                st->AsyncReceive([op](boost::system::error_code ec, batch_t batch) {
+                    auto ex = op->get_executor();
+                    boost::asio::post(ex, [op, ec, batch = std::move(batch)]() mutable {
+                        op->complete(ec, std::move(batch));
+                    });
+                });
+            }, token, state_->GetExecutor());
+    }
+
+    /*! Call handler on the receiving pipeline with each batch of items */
+    void SetReceiver(receiver_t handler) {
+        state_->SetReceiver(std::move(handler));
+    }
+
+    /*! Close the channel
+
+        Waiting senders are released, and a pending receive completes
+        with eof when the channel is empty. Close() does not throw, also
+        when the receiving pipeline is full.
+    */
+    void Close() noexcept {
+        state_->Close();
+    }
+
+    bool IsClosed() const noexcept { return state_->closed_; }
+
+private:
+    class State : public std::enable_shared_from_this<State>
+    {
+    public:
+        using send_done_t = std::function<void (boost::system::error_code ec)>;
+        using receive_done_t = std::function<void (boost::system::error_code ec, batch_t batch)>;
+
+        State(Pipeline& pipeline, const std::size_t capacity, const std::size_t maxBatch)
+        : pipeline_{pipeline}, queue_{capacity}
+        , max_batch_{std::max<std::size_t>(maxBatch, 1)}
+        {
+        }
+
+        auto GetExecutor() { return pipeline_.GetIoService().get_executor(); }
+
+        bool TrySend(T&& item) {
+            if (closed_ || !queue_.Push(std::move(item))) {
+                return false;
+            }
+            Wake();
+            return true;
+        }
+
+        bool Send(T&& item) {
+            while(!closed_) {
+                if (TrySend(std::move(item))) {
+                    return true;
+                }
+
+                // The receiver notifies under the lock after it has made room,
+                // so if the queue is still full here, we will be notified.
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (queue_.Push(std::move(item))) {
+                    lock.unlock();
+                    Wake();
+                    return true;
+                }
+                if (closed_) {
+                    break;
+                }
+                room_.wait(lock);
+            }
+            return false;
+        }
+
+        void AsyncSend(T&& item, send_done_t done) {
+            if (!closed_) {
+                if (TrySend(std::move(item))) {
+                    done({});
+                    return;
+                }
+
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (queue_.Push(std::move(item))) {
+                    lock.unlock();
+                    Wake();
+                    done({});
+                    return;
+                }
+                if (!closed_) {
+                    senders_.push_back({std::move(item), std::move(done)});
+                    return;
+                }
+            }
+            done(boost::asio::error::operation_aborted);
+        }
+
+        void AsyncReceive(receive_done_t done) {
+            OnPipeline([self = this->shared_from_this(), done = std::move(done)]() mutable {
+                self->Receive_(std::move(done));
+            });
+        }
+
+        void SetReceiver(receiver_t handler) {
+            OnPipeline([self = this->shared_from_this(), handler = std::move(handler)]() mutable {
+                self->receiver_ = std::move(handler);
+                self->Resume_();
+            });
+        }
+
+        void Close() noexcept {
+            if (closed_.exchange(true)) {
+                return;
+            }
+
+            decltype(senders_) senders;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                senders.swap(senders_);
+                room_.notify_all();
+            }
+
+            try {
+                for(auto& sender : senders) {
+                    sender.done(boost::asio::error::operation_aborted);
+                }
+
+                if (pipeline_.IsClosing()) {
+                    return;
+                }
+                OnPipeline([self = this->shared_from_this()] {
+                    if (self->pending_receive_ && self->queue_.IsEmpty()) {
+                        auto done = std::move(self->pending_receive_);
+                        self->pending_receive_ = nullptr;
+                        done(boost::asio::error::eof, {});
+                    }
+                });
+            } WAR_CATCH_ALL_E;
+        }
+
+        std::atomic<bool> closed_{false};
+
+    private:
+        struct Sender {
+            T item;
+            send_done_t done;
+        };
+
+        /*! Run fn on the receiving pipeline
+
+            It runs at once if we are on the pipeline. If not, it is
+            posted, also when the pipeline's queue is full.
+        */
+        template <typename Fn>
+        void OnPipeline(Fn&& fn) {
+            task_t task{std::forward<Fn>(fn), "Channel"};
+            if (pipeline_.IsPipelineThread()) {
+                pipeline_.Dispatch(std::move(task));
+                return;
+            }
+            Schedule(task);
+        }
+
+        /*! Post task to the receiving pipeline, even if its queue is full */
+        void Schedule(const task_t& task) {
+            try {
+                pipeline_.Post(task);
+            } catch(const Pipeline::ExceptionCapacityExceeded&) {
+                // Timers don't count against the pipelines capacity
+                pipeline_.PostWithTimer(task, 1);
+            }
+        }
+
+        /*! Make sure that the receiver is scheduled to drain the queue */
+        void Wake() {
+            // Pairs with the fence in Drain_(), so that either we see
+            // that the receiver is not scheduled, or it sees our item.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (wakeup_posted_.load(std::memory_order_relaxed)
+                || wakeup_posted_.exchange(true)) {
+                return;
+            }
+
+            Schedule({[self = this->shared_from_this()] {
+                self->Drain_();
+            }, "Channel receive"});
+        }
+
+        // The methods below run on the receiving pipeline
+
+        /*! Called when a receiver is ready for more items */
+        void Resume_() {
+            wakeup_posted_ = false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!queue_.IsEmpty()) {
+                Drain_();
+            }
+        }
+
+        void Drain_() {
+            if (!receiver_ && !pending_receive_) {
+                // Keep wakeup_posted_ set, so that the senders don't post
+                // more tasks until Resume_() is called.
+                return;
+            }
+
+            wakeup_posted_ = false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (receiver_) {
+                if (PopBatch_(batch_)) {
+                    try {
+                        receiver_(batch_);
+                    } WAR_CATCH_ALL_E_RL(10);
+                    batch_.clear();
+                }
+            } else {
+                batch_t batch;
+                if (PopBatch_(batch)) {
+                    auto done = std::move(pending_receive_);
+                    pending_receive_ = nullptr;
+                    done({}, std::move(batch));
+                }
+            }
+
+            // Let other tasks run before the next batch
+            if (!queue_.IsEmpty()) {
+                Wake();
+            }
+        }
+
+        void Receive_(receive_done_t done) {
+            if (pending_receive_ || receiver_) {
+                done(boost::asio::error::in_progress, {});
+                return;
+            }
+
+            batch_t batch;
+            if (PopBatch_(batch)) {
+                done({}, std::move(batch));
+                return;
+            }
+            if (closed_) {
+                done(boost::asio::error::eof, {});
+                return;
+            }
+            pending_receive_ = std::move(done);
+            Resume_();
+        }
+
+        /*! Move up to max_batch_ items to batch, and let waiting senders in */
+        bool PopBatch_(batch_t& batch) {
+            T item;
+            while((batch.size() < max_batch_) && queue_.Pop(item)) {
+                batch.push_back(std::move(item));
+            }
+            if (batch.empty()) {
+                return false;
+            }
+
+            std::vector<send_done_t> released;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                while(!senders_.empty() && queue_.Push(std::move(senders_.front().item))) {
+                    released.push_back(std::move(senders_.front().done));
+                    senders_.pop_front();
+                }
+                room_.notify_all();
+            }
+            for(auto& done : released) {
+                done({});
+            }
+            return true;
+        }
+
+        Pipeline& pipeline_;
+        BoundedMpscQueue<T> queue_;
+        const std::size_t max_batch_;
+        std::atomic<bool> wakeup_posted_{false};
+
+        std::mutex mutex_;
+        std::condition_variable room_;
+        std::deque<Sender> senders_;
+
+        // Only used by the receiving pipeline
+        receiver_t receiver_;
+        receive_done_t pending_receive_;
+        batch_t batch_;
+    };
+
+    std::shared_ptr<State> state_;
+};
+
+} // namespace
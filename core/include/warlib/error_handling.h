@@ -148,6 +148,22 @@ catch(const war::ExceptionBase& ex) { \
     LOG_ERROR_FN << "Caught UNKNOWN exception! [" << typeid(std::current_exception()).name() << "]"; \
 }
 
+/*! Like WAR_CATCH_ALL_E, but log at most perSecond messages each second
+
+    Use this where the same exception may be caught over and over again,
+    so that an exception-storm does not turn into a log-storm.
+*/
+#define WAR_CATCH_ALL_E_RL(perSecond) \
+catch(const war::ExceptionBase& ex) { \
+    LOG_ERROR_FN_RL(perSecond) << "Caught exception [" << typeid(ex).name() << "]: " << ex; \
+} catch(const boost::exception& ex) { \
+    LOG_ERROR_FN_RL(perSecond) << "Caught boost exception [" << typeid(ex).name() << "]: " << ex; \
+} catch(const std::exception& ex) { \
+    LOG_ERROR_FN_RL(perSecond) << "Caught standad exception [" << typeid(ex).name() << "]: " << ex; \
+} catch(...) { \
+    LOG_ERROR_FN_RL(perSecond) << "Caught UNKNOWN exception! [" << typeid(std::current_exception()).name() << "]"; \
+}
+
 #define WAR_CATCH_ALL_EF(func) \
 catch(const war::ExceptionBase& ex) { \
     LOG_ERROR_FN << "Caught exception [" << typeid(ex).name() << "]: " << ex; \
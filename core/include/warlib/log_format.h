@@ -0,0 +1,291 @@
+#pragma once
+
+/* Format-string logging.
+ *
+ * This is an alternative to the streaming log macros. The format-string use
+ * "{}" as placeholder for the arguments ("{{" and "}}" for literal braces).
+ * The number of placeholders is checked against the number of arguments at
+ * compile time, and the arguments are written directly to the message buffer
+ * without involving iostreams (except for types that only have an
+ * ostream operator).
+ *
+ *   LOG_INFO_FMT("Connection from {} took {} ms", Esc(address), elapsed);
+ *
+ * The level and filter is checked just like with the streaming macros, so
+ * the arguments are not evaluated unless the message is relevant.
+ *
+ * Normally included from WarLog.h
+ */
+
+#include <cstdio>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <type_traits>
+#include <boost/utility/string_ref.hpp>
+
+#define __WAR_LOG_FMT_FIRST(first, ...) first
+#define __WAR_LOG_FMT_STRING(...) __WAR_LOG_FMT_FIRST(__VA_ARGS__, 0)
+#define __WAR_LOG_FMT_NUM_ARGS(...) (sizeof(war::log::FormatArgCounter(__VA_ARGS__)) - 2)
+
+#ifdef WAR_LOG_CALLSITE_STATS
+#   define __WAR_LOG_FMT_SUBMIT(level, filter, ...) war::log::SubmitFormatted(__WAR_LOG_STATS_SITE(level), level, filter, __VA_ARGS__)
+#else
+#   define __WAR_LOG_FMT_SUBMIT(level, filter, ...) war::log::SubmitFormatted(level, filter, __VA_ARGS__)
+#endif
+
+#define __WAR_LOG_FMT(level, filter, ...) \
+    do { \
+        static_assert(war::log::CountFormatArgs(__WAR_LOG_FMT_STRING(__VA_ARGS__)) \
+                      == static_cast<int>(__WAR_LOG_FMT_NUM_ARGS(__VA_ARGS__)), \
+                      "The format-string does not match the number of arguments"); \
+        if (war::log::LogEngine::IsRelevant(level, filter)) { \
+            __WAR_LOG_FMT_SUBMIT(level, filter, __VA_ARGS__); \
+        } \
+    } while(0)
+
+#define LOG_FATAL_FMT(...) __WAR_LOG_FMT(war::log::LL_FATAL, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_FATAL_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_FATAL, filter, __VA_ARGS__)
+#define LOG_ERROR_FMT(...) __WAR_LOG_FMT(war::log::LL_ERROR, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_ERROR_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_ERROR, filter, __VA_ARGS__)
+#define LOG_WARN_FMT(...) __WAR_LOG_FMT(war::log::LL_WARNING, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_WARN_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_WARNING, filter, __VA_ARGS__)
+#define LOG_INFO_FMT(...) __WAR_LOG_FMT(war::log::LL_INFO, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_INFO_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_INFO, filter, __VA_ARGS__)
+#define LOG_NOTICE_FMT(...) __WAR_LOG_FMT(war::log::LL_NOTICE, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_NOTICE_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_NOTICE, filter, __VA_ARGS__)
+#define LOG_DEBUG_FMT(...) __WAR_LOG_FMT(war::log::LL_DEBUG, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_DEBUG_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_DEBUG, filter, __VA_ARGS__)
+#define LOG_TRACE1_FMT(...) __WAR_LOG_FMT(war::log::LL_TRACE1, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_TRACE1_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_TRACE1, filter, __VA_ARGS__)
+#define LOG_TRACE2_FMT(...) __WAR_LOG_FMT(war::log::LL_TRACE2, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_TRACE2_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_TRACE2, filter, __VA_ARGS__)
+#define LOG_TRACE3_FMT(...) __WAR_LOG_FMT(war::log::LL_TRACE3, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_TRACE3_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_TRACE3, filter, __VA_ARGS__)
+#define LOG_TRACE4_FMT(...) __WAR_LOG_FMT(war::log::LL_TRACE4, war::log::LA_GENERAL, __VA_ARGS__)
+#define LOG_TRACE4_F_FMT(filter, ...) __WAR_LOG_FMT(war::log::LL_TRACE4, filter, __VA_ARGS__)
+
+namespace war {
+namespace log {
+
+/*! Count the "{}" placeholders in a format-string at compile time
+
+    \return The number of placeholders, or -1 if the braces are not
+        matched ("{{" and "}}" are literal braces).
+*/
+constexpr int CountFormatArgs(const char *fmt) noexcept {
+    int count = 0;
+    for(; *fmt; ++fmt) {
+        if (*fmt == '{') {
+            if (fmt[1] == '{') {
+                ++fmt;
+            } else if (fmt[1] == '}') {
+                ++fmt;
+                ++count;
+            } else {
+                return -1;
+            }
+        } else if (*fmt == '}') {
+            if (fmt[1] != '}') {
+                return -1;
+            }
+            ++fmt;
+        }
+    }
+    return count;
+}
+
+/*! Only used in unevaluated context, to count macro arguments */
+template <typename... T>
+char (&FormatArgCounter(T&&...))[sizeof...(T) + 1];
+
+/* Formatters for the types we know. The output is the same as
+ * the default output from std::ostream.
+ */
+
+inline void AppendFormatted(std::string& out, const char *v) {
+    out += v ? v : "(null)";
+}
+
+inline void AppendFormatted(std::string& out, const std::string& v) {
+    out += v;
+}
+
+inline void AppendFormatted(std::string& out, const boost::string_ref& v) {
+    out.append(v.data(), v.size());
+}
+
+inline void AppendFormatted(std::string& out, const char v) {
+    out += v;
+}
+
+inline void AppendFormatted(std::string& out, const signed char v) {
+    out += static_cast<char>(v);
+}
+
+inline void AppendFormatted(std::string& out, const unsigned char v) {
+    out += static_cast<char>(v);
+}
+
+inline void AppendFormatted(std::string& out, const bool v) {
+    out += v ? '1' : '0';
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value>::type
+AppendFormatted(std::string& out, const T v) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    using unsigned_t = typename std::make_unsigned<T>::type;
+    const bool negative = v < 0;
+    // Negate as unsigned, so that we can handle the minimum value
+    unsigned_t u = negative ? (unsigned_t(0) - static_cast<unsigned_t>(v))
+                            : static_cast<unsigned_t>(v);
+    do {
+        *--p = static_cast<char>('0' + (u % 10));
+        u /= 10;
+    } while(u);
+    if (negative) {
+        *--p = '-';
+    }
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+inline void AppendFormatted(std::string& out, const double v) {
+    char buf[32];
+    const int len = std::snprintf(buf, sizeof(buf), "%g", v);
+    out.append(buf, static_cast<std::size_t>(len));
+}
+
+inline void AppendFormatted(std::string& out, const long double v) {
+    char buf[48];
+    const int len = std::snprintf(buf, sizeof(buf), "%Lg", v);
+    out.append(buf, static_cast<std::size_t>(len));
+}
+
+inline void AppendFormatted(std::string& out, const void *v) {
+    if (!v) {
+        out += '0';
+        return;
+    }
+    static const char digits[] = "0123456789abcdef";
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    auto u = reinterpret_cast<std::uintptr_t>(v);
+    do {
+        *--p = digits[u & 0xf];
+        u >>= 4;
+    } while(u);
+    *--p = 'x';
+    *--p = '0';
+    out.append(p, buf + sizeof(buf) - p);
+}
+
+inline void AppendFormatted(std::string& out, const Esc& v) {
+    out += '\"';
+    AppendFormatted(out, v.GetVal());
+    out += '\"';
+}
+
+inline void AppendFormatted(std::string& out, const LogLevel v) {
+    out += LogEventHandler::GetLevelName(v);
+}
+
+namespace impl {
+
+template <int N> struct Priority : Priority<N - 1> {};
+template <> struct Priority<0> {};
+
+template <typename T>
+auto AppendArg(std::string& out, const T& v, Priority<1>)
+    -> decltype(AppendFormatted(out, v)) {
+    AppendFormatted(out, v);
+}
+
+// Fall back to the ostream operator for other types
+template <typename T>
+void AppendArg(std::string& out, const T& v, Priority<0>) {
+    std::ostringstream o;
+    o << v;
+    out += o.str();
+}
+
+/*! Append the literal text in fmt until the next placeholder or the end.
+
+    \return Pointer to the character after the placeholder, or nullptr at the end.
+*/
+inline const char *AppendLiteral(std::string& out, const char *fmt) {
+    while(*fmt) {
+        const char c = *fmt++;
+        if (c == '{') {
+            if (*fmt == '}') {
+                return fmt + 1;
+            }
+            ++fmt; // "{{"
+        } else if (c == '}') {
+            ++fmt; // "}}"
+        }
+        out += c;
+    }
+    return nullptr;
+}
+
+inline void Format(std::string& out, const char *fmt) {
+    if (fmt) {
+        AppendLiteral(out, fmt);
+    }
+}
+
+template <typename T, typename... ArgsT>
+void Format(std::string& out, const char *fmt, const T& arg, const ArgsT&... args) {
+    fmt = AppendLiteral(out, fmt);
+    WAR_ASSERT(fmt);
+    AppendArg(out, arg, Priority<1>{});
+    Format(out, fmt, args...);
+}
+
+} // impl
+
+/*! Format a message into a string */
+template <typename... ArgsT>
+std::string Format(const char *fmt, const ArgsT&... args) {
+    std::string out;
+    out.reserve(128);
+    impl::Format(out, fmt, args...);
+    return out;
+}
+
+/*! Format a message and submit it to the log. Used by the LOG_xxx_FMT macros */
+template <typename... ArgsT>
+void SubmitFormatted(const LogLevel level, const filter_t filter,
+                     const char *fmt, const ArgsT&... args) noexcept {
+    try {
+        LogEngine::Submit(level, filter, Format(fmt, args...));
+    } catch(...) {
+        // Fatal. We can not continue.
+        std::cerr << "Failed to format log event" << std::endl;
+        std::terminate();
+    }
+}
+
+/*! Like SubmitFormatted(), but accounts for the message in the call-site's statistics.
+    Used by the LOG_xxx_FMT macros when WAR_LOG_CALLSITE_STATS is defined.
+*/
+template <typename... ArgsT>
+void SubmitFormatted(LogCallSite& site, const LogLevel level, const filter_t filter,
+                     const char *fmt, const ArgsT&... args) noexcept {
+    try {
+        const auto start = TscClock::Ticks();
+        auto message = Format(fmt, args...);
+        site.Add(message.size(), TscClock::Ticks() - start);
+        LogEngine::Submit(level, filter, std::move(message));
+    } catch(...) {
+        // Fatal. We can not continue.
+        std::cerr << "Failed to format log event" << std::endl;
+        std::terminate();
+    }
+}
+
+} // log
+} // war
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <warlib/WarLog.h>
+
+namespace war {
+namespace log {
+
+/*! Selects the records to extract from a log-file with QueryLogFile() */
+struct LogQuery
+{
+    using time_point_t = std::chrono::system_clock::time_point;
+
+    /// First time to include
+    time_point_t from_ = time_point_t::min();
+
+    /// Last time to include
+    time_point_t to_ = time_point_t::max();
+
+    /// Include records with this level, or a more severe level
+    LogLevel level_ = LL_TRACE4;
+
+    /// Include records with any of these categories. Empty means all.
+    std::vector<std::string> categories_;
+};
+
+/*! Extract records from a log-file written by LogToFile or LogToJsonFile
+
+    If the log-file has an index (see LogToFile::EnableIndex()), it is
+    used to seek to the start of the time-range, and the scan stops when
+    the index show that the rest of the file is after the range. Without
+    the index, the whole file is scanned.
+
+    The format (text or JSON lines) is detected per line. Lines in text-logs
+    that don't start with a timestamp (continuation lines from multi-line
+    messages) are included with the record before them.
+
+    Categories are recorded exactly in JSON logs. In text logs, they are
+    taken from the upper-case "NAME|NAME " prefix of the message, and
+    records without that prefix are in the GENERAL category.
+
+    \return The number of records written to out.
+    \exception Exception if the log-file cannot be opened.
+*/
+std::uint64_t QueryLogFile(const std::string& path,
+                           const LogQuery& query,
+                           std::ostream& out);
+
+/*! Read the index for a log-file
+
+    \return (time, offset) pairs, in the order they were written.
+        Empty if there is no index.
+*/
+std::vector<std::pair<LogQuery::time_point_t, std::uint64_t>>
+ReadLogIndex(const std::string& path);
+
+} // log
+} // war
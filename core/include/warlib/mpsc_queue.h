@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace war {
+
+/*! Bounded, lock-free queue for many producers and one consumer
+
+    This is Dmitry Vyukov's bounded queue. Each cell has a sequence
+    number that tells the producers and the consumer if the cell is free
+    or holds a value, so producers only contend on the enqueue
+    position, and never wait for each other.
+
+    Push() can be called from any thread. Pop() and IsEmpty() must only
+    be called by one thread at the time (normally the thread of the
+    Pipeline that owns the consumer side).
+
+    T must be default-constructible and move-assignable.
+*/
+template <typename T>
+class BoundedMpscQueue
+{
+public:
+    /*! Constructor
+
+        \param capacity Max number of items. Rounded up to a power of two.
+    */
+    explicit BoundedMpscQueue(const std::size_t capacity)
+    : cells_(RoundUp(capacity)), mask_{cells_.size() - 1}
+    {
+        for(std::size_t i = 0; i < cells_.size(); ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedMpscQueue(const BoundedMpscQueue&) = delete;
+    BoundedMpscQueue& operator = (const BoundedMpscQueue&) = delete;
+
+    /*! Add an item
+
+        \return false if the queue is full. The item is only moved
+            from if it was added.
+    */
+    bool Push(T&& item) {
+        auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell *cell = nullptr;
+        for(;;) {
+            cell = &cells_[pos & mask_];
+            const auto seq = cell->sequence.load(std::memory_order_acquire);
+            const auto diff = static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // Full
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(item);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*! Remove the oldest item. Consumer only.
+
+        \return false if the queue is empty
+    */
+    bool Pop(T& item) {
+        auto& cell = cells_[dequeue_pos_ & mask_];
+        if (cell.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) {
+            return false;
+        }
+        item = std::move(cell.data);
+        cell.data = T{};
+        cell.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+        ++dequeue_pos_;
+        return true;
+    }
+
+    /*! Returns true if there is nothing to Pop(). Consumer only. */
+    bool IsEmpty() const noexcept {
+        return cells_[dequeue_pos_ & mask_].sequence.load(std::memory_order_acquire)
+            != dequeue_pos_ + 1;
+    }
+
+    std::size_t GetCapacity() const noexcept { return cells_.size(); }
+
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence{0};
+        T data;
+    };
+
+    static std::size_t RoundUp(const std::size_t value) {
+        std::size_t size = 2;
+        while(size < value) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    std::vector<Cell> cells_;
+    const std::size_t mask_;
+    std::atomic<std::size_t> enqueue_pos_{0};
+    std::size_t dequeue_pos_ = 0; // Only used by the consumer
+};
+
+} // namespace
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <warlib/WarThreadpool.h>
+
+namespace war {
+
+/*! Runs tasks on a Pipeline or Threadpool at a limited rate
+
+    The rate is controlled by a token bucket. Each task uses one token.
+    Tokens are added at a fixed rate, up to a max (the burst). When there
+    are no tokens, tasks are queued, and released by a timer on the
+    pipeline (in stead of sleeping) when new tokens are available.
+
+    This is useful to cap the rate of background work, like outbound API
+    calls or disk compactions, so it doesn't saturate shared resources
+    during peaks.
+
+    Scheduled timers keep the internal state alive, so queued tasks are
+    still released after the executor is destroyed. The Pipeline or
+    Threadpool must outlive the queued tasks.
+*/
+class RateLimitedExecutor
+{
+public:
+    /*! Thrown from Post() if the queue is full */
+    struct ExceptionCapacityExceeded : public ExceptionBase {};
+
+    struct Stats {
+        /*! Tasks waiting for a token right now */
+        std::size_t queue_depth = 0;
+
+        /*! Tasks that have been released to the pipeline */
+        std::uint64_t released = 0;
+
+        /*! Released tasks that had to wait for a token */
+        std::uint64_t delayed = 0;
+
+        /*! Total time the released tasks waited for tokens */
+        std::chrono::nanoseconds total_wait {0};
+
+        /*! Longest time a task waited for a token */
+        std::chrono::nanoseconds max_wait {0};
+
+        /*! Times a task got a token, but was put back in the queue
+            because the pipeline was full
+        */
+        std::uint64_t requeued = 0;
+    };
+
+    /*! Constructor
+
+        \param pipeline Pipeline that run the tasks and the timers
+        \param rate Tasks per second
+        \param burst Max number of tasks that can run without delay
+            after a quiet period. Must be at least 1.
+        \param capacity Max number of queued tasks
+        \exception ExceptionOutOfRange if rate or burst is out of range
+    */
+    RateLimitedExecutor(Pipeline& pipeline, double rate, double burst = 1,
+                        std::size_t capacity = 1024);
+
+    /*! Constructor
+
+        The tasks are posted to the thread-pool. The timers run on
+        one of the pools pipelines.
+    */
+    RateLimitedExecutor(Threadpool& pool, double rate, double burst = 1,
+                        std::size_t capacity = 1024);
+
+    /*! Post a task
+
+        The task is posted to the pipeline immediately if there is a
+        token available. If not, it's queued until there is. Queued
+        tasks that get a token while the pipeline is full are put back
+        at the head of the queue, and tried again a little later.
+
+        \exception ExceptionCapacityExceeded if the queue is full
+        \exception Pipeline::ExceptionCapacityExceeded if the task could
+            run at once, but the pipeline is full. The token is not used.
+    */
+    void Post(task_t task);
+
+    /*! Returns the number of tasks waiting for a token */
+    std::size_t GetQueueDepth() const;
+
+    Stats GetStats() const;
+
+private:
+    class State;
+    std::shared_ptr<State> state_;
+};
+
+} // namespace
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+#include <warlib/basics.h>
+
+namespace war {
+
+/*! Records task scheduling events for a timeline view
+
+    When tracing is started, Pipeline records when tasks are queued,
+    when they start and end, when timers are armed and fire, and when
+    coroutines are resumed. The events go to a fixed-size ring-buffer
+    that belongs to the thread that records them, so recording is
+    lock-free (the buffer is allocated the first time a thread records
+    an event). When a thread exits, its buffer and events are kept
+    until another thread needs a buffer, so the number of buffers is
+    limited by the number of threads that record at the same time.
+
+    WriteChromeTrace() exports the events as Chrome trace-event JSON,
+    which can be opened in chrome://tracing or https://ui.perfetto.dev.
+    A queued task is connected to its execution with a flow-arrow, so
+    it's easy to see where the time went between Post() and the task
+    running on a Pool-worker_N thread.
+
+    The export can be done while tracing is active. Events that are
+    overwritten while they are copied are skipped.
+*/
+class TaskTrace
+{
+public:
+    enum EventType : std::uint8_t {
+        ET_BEGIN,       ///< A task starts executing
+        ET_END,         ///< A task is finished
+        ET_ENQUEUE,     ///< A task is posted. Starts a flow.
+        ET_DEQUEUE,     ///< A posted task starts. Ends a flow.
+        ET_TIMER_ARM,   ///< A task is posted with a timer. Starts a flow.
+        ET_TIMER_FIRE,  ///< A timer expired
+        ET_RESUME       ///< A coroutine is resumed
+    };
+
+    struct Event {
+        std::uint64_t ticks = 0; // TscClock
+        const char *name = nullptr;
+        std::uint64_t id = 0; // Flow id
+        EventType type = ET_BEGIN;
+    };
+
+    /*! Start recording events
+
+        \param eventsPerThread Size of the ring-buffer for each
+            thread. Only the last eventsPerThread events from a thread
+            are kept. The size is applied to buffers that are given
+            to threads after this call.
+    */
+    static void Start(std::size_t eventsPerThread = 32 * 1024);
+
+    /*! Stop recording events. The recorded events are kept. */
+    static void Stop() noexcept;
+
+    /*! Returns true if events are being recorded */
+    static bool IsEnabled() noexcept {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    /*! Forget all the recorded events.
+
+        Should only be called when tracing is stopped.
+    */
+    static void Clear() noexcept;
+
+    /*! Record an event for the current thread
+
+        The name must be a string that stays valid until the
+        events are exported, like a task_t name.
+    */
+    static void Record(EventType type, const char *name, std::uint64_t id = 0) noexcept;
+
+    /*! Returns a unique id to connect an ET_ENQUEUE or ET_TIMER_ARM with a ET_DEQUEUE */
+    static std::uint64_t NewId() noexcept {
+        return ++last_id_;
+    }
+
+    /*! Write the recorded events as Chrome trace-event JSON
+
+        \param out Stream to write to
+        \param window Only write events from this long ago until now.
+            If 0, all the recorded events are written.
+        \return Number of events written
+    */
+    static std::size_t WriteChromeTrace(std::ostream& out,
+                                        std::chrono::milliseconds window = {});
+
+    /*! Returns the number of ring-buffers that are allocated */
+    static std::size_t GetBufferCount();
+
+private:
+    class Buffer;
+    struct Registry;
+    static Buffer *GetBuffer() noexcept;
+    static Registry& GetRegistry();
+
+    static std::atomic<bool> enabled_;
+    static std::atomic<std::uint64_t> last_id_;
+};
+
+} // namespace
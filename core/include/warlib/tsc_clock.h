@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <warlib/basics.h>
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#   define WAR_WITH_TSC 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#   include <x86intrin.h>
+#   define WAR_WITH_TSC 1
+#endif
+
+namespace war {
+
+/*! Cheap monotonic clock, based on the CPU's time-stamp counter
+
+    Reading the time-stamp counter takes a few nanoseconds, compared
+    to a vDSO call for the std::chrono clocks. The raw ticks are
+    stored where timestamps are taken in hot paths (log events, task
+    statistics), and converted to time only when they are used.
+
+    The counter is only used if the CPU reports an invariant TSC
+    (constant rate, and not stopped in sleep-states). If not, or on
+    other architectures, the ticks are nanoseconds from
+    std::chrono::steady_clock.
+
+    The tick rate is calibrated against steady_clock, which takes
+    about 5 milliseconds. Call Calibrate() at startup, so that this
+    does not happen lazily the first time ticks are converted (possibly
+    on a latency-sensitive thread). The LogEngine does it when it is
+    constructed. Conversion to
+    wall time use an anchor (ticks, system_clock time) that is updated
+    every second when conversions are made, so that adjustments of the
+    system clock are picked up.
+
+    The class meets the requirements for a std::chrono clock, so it
+    can be used in stead of steady_clock.
+*/
+class TscClock
+{
+public:
+    using rep = std::int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<TscClock>;
+    static constexpr bool is_steady = true;
+
+    /*! Returns the raw ticks */
+    static std::uint64_t Ticks() noexcept {
+#ifdef WAR_WITH_TSC
+        if (LIKELY(mode_.load(std::memory_order_relaxed) == M_TSC)) {
+            return __rdtsc();
+        }
+#endif
+        return SlowTicks();
+    }
+
+    /*! Returns the current time */
+    static time_point now() noexcept {
+        return ToTimePoint(Ticks());
+    }
+
+    /*! Convert ticks to a time_point for this clock */
+    static time_point ToTimePoint(const std::uint64_t ticks) noexcept {
+        return time_point(ToDuration(ticks));
+    }
+
+    /*! Convert ticks to the time since the clocks epoch */
+    static duration ToDuration(const std::uint64_t ticks) noexcept;
+
+    /*! Convert ticks to wall time */
+    static std::chrono::system_clock::time_point ToSystemTime(const std::uint64_t ticks) noexcept;
+
+    /*! A frozen conversion from ticks to wall time
+
+        Converting with it only does arithmetic, so it can be used
+        where the clock's own conversion can not, like in a signal
+        handler.
+    */
+    struct WallTimeSnapshot {
+        std::uint64_t ticks = 0;
+        std::int64_t system_ns = 0;
+        double ns_per_tick = 1.0;
+
+        std::chrono::system_clock::time_point ToSystemTime(const std::uint64_t when) const noexcept {
+            const auto ns = system_ns + static_cast<std::int64_t>(
+                static_cast<double>(static_cast<std::int64_t>(when - ticks)) * ns_per_tick);
+            return std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                    std::chrono::nanoseconds(ns)));
+        }
+    };
+
+    /*! Returns the current conversion from ticks to wall time
+
+        Calibrates the clock if that is not already done.
+    */
+    static WallTimeSnapshot GetWallTimeSnapshot() noexcept;
+
+    /*! Move snapshot to the clock's latest wall time anchor
+
+        Only reads atomics, and does not wait for anything, so it is
+        async-signal-safe. If the anchor is being updated at the
+        moment, snapshot is left as it is.
+    */
+    static void UpdateWallTimeSnapshot(WallTimeSnapshot& snapshot) noexcept;
+
+    /*! Convert wall time to ticks. Mostly useful for testing. */
+    static std::uint64_t FromSystemTime(const std::chrono::system_clock::time_point when) noexcept;
+
+    /*! Calibrate the tick rate now, if it is not already done
+
+        Blocks the calling thread for about 5 milliseconds the first
+        time it is called. Later calls return immediately.
+    */
+    static void Calibrate() noexcept;
+
+    /*! Returns true if the CPU's time-stamp counter is used */
+    static bool IsUsingTsc() noexcept;
+
+    /*! Returns the number of ticks per nanosecond */
+    static double GetTicksPerNanosecond() noexcept;
+
+private:
+    enum Mode { M_UNKNOWN, M_TSC, M_STEADY };
+
+    static std::uint64_t SlowTicks() noexcept;
+
+    static std::atomic<int> mode_;
+};
+
+} // namespace
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <warlib/WarThreadpool.h>
+
+namespace war {
+
+/*! Detects tasks that block a Pipeline
+
+    A task that blocks (a synchronous DNS lookup, slow disk I/O)
+    freezes everything else that is assigned to its pipeline. The
+    watchdog runs a thread that wakes up at a regular interval and
+    looks at the task each watched pipeline is executing (see
+    Pipeline::GetCurrentTask()). If a task has run longer than the
+    threshold, it's reported once to the handler. The default handler
+    logs a warning.
+
+    Optionally (Linux with glibc only), the watchdog captures a stack
+    trace from the blocked thread, by sending it a signal. The signal
+    handler is installed when the first watchdog that wants stack traces
+    with that signal is constructed. Use Config::stack_trace_signal to
+    pick a signal that the application does not use for anything else.
+
+    The pipelines must outlive the watchdog, or be removed with Unwatch().
+*/
+class Watchdog
+{
+public:
+    struct Config {
+        /*! Report tasks that run longer than this */
+        std::chrono::milliseconds threshold = std::chrono::seconds(1);
+
+        /*! How often we look at the pipelines */
+        std::chrono::milliseconds interval = std::chrono::milliseconds(100);
+
+        /*! Capture a stack trace from the blocked thread */
+        bool stack_trace = false;
+
+        /*! Signal used to capture stack traces. 0 means SIGRTMIN + 4. */
+        int stack_trace_signal = 0;
+    };
+
+    struct Report {
+        const Pipeline *pipeline = nullptr;
+
+        /*! The name of the task */
+        const char *task = nullptr;
+
+        /*! How long the task had been running when we detected it */
+        std::chrono::nanoseconds duration {0};
+
+        /*! Stack frames from the blocked thread, if requested and available */
+        std::vector<std::string> stack;
+    };
+
+    using handler_t = std::function<void (const Report& report)>;
+
+    /*! Start the watchdog thread with the default configuration */
+    Watchdog();
+
+    /*! Start the watchdog thread
+
+        \param config Configuration
+        \param handler Called from the watchdog thread for each blocked
+            task. If empty, the task is logged. The handler must not
+            call Watch() or Unwatch().
+    */
+    Watchdog(const Config& config, handler_t handler = {});
+    ~Watchdog();
+
+    Watchdog(const Watchdog&) = delete;
+    Watchdog& operator = (const Watchdog&) = delete;
+
+    /*! Start watching a pipeline */
+    void Watch(Pipeline& pipeline);
+
+    /*! Start watching all the pipelines in a thread-pool */
+    void Watch(Threadpool& pool);
+
+    /*! Stop watching a pipeline */
+    void Unwatch(Pipeline& pipeline);
+
+    /*! Returns the number of blocked tasks we have reported */
+    std::uint64_t GetReportCount() const noexcept { return reports_; }
+
+    /*! Log a report. This is the default handler. */
+    static void LogReport(const Report& report);
+
+private:
+    struct Watched {
+        Pipeline *pipeline = nullptr;
+        TscClock::time_point reported; // Start-time of the last reported task
+    };
+
+    void Run();
+    void Check();
+
+    const Config config_;
+    const handler_t handler_;
+    std::vector<Watched> pipelines_;
+    std::mutex lock_;
+    std::condition_variable wakeup_;
+    bool done_ = false;
+    std::atomic<std::uint64_t> reports_ {0};
+    std::unique_ptr<std::thread> thread_;
+};
+
+} // namespace
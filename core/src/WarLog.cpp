@@ -3,6 +3,30 @@
 #include <cstring>
 #include <iomanip>
 #include <thread>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <csignal>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#   include <emmintrin.h>
+#   define WAR_LOG_WITH_SSE2 1
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#   include <immintrin.h>
+#   define WAR_LOG_WITH_AVX2 1
+#endif
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+#ifdef WIN32
+#   include <io.h>
+#else
+#   include <unistd.h>
+#endif
 
 #include <warlib/WarLog.h>
 #include <warlib/impl.h>
@@ -24,42 +48,293 @@ std::ostream& operator << (std::ostream& out, const war::log::Esc& esc)
     return out << '\"' << esc.GetVal() << '\"';
 }
 
+std::ostream& operator << (std::ostream& out, const war::log::Field& field)
+{
+    auto fields = static_cast<war::log::Field::fields_t *>(
+        out.pword(war::log::Field::GetStreamIndex()));
+    if (fields) {
+        fields->push_back(field);
+        return out;
+    }
+    return field.Write(out);
+}
+
 
 namespace war { namespace log {
 
+namespace {
+
+    /* Candidates for special treatment in WriteMessage() are control
+     * characters, DEL and (only if the locale says so) bytes above 0x7f.
+     * The exact decision is made by a table lookup, so the functions
+     * below only have to find the candidates fast.
+     */
+
+    inline bool IsCandidate(const unsigned char ch, const bool highBytes) noexcept
+    {
+        return (ch < 0x20) || (ch == 0x7f) || (highBytes && (ch > 0x7f));
+    }
+
+    const char *FindCandidateScalar(const char *p, const char *end,
+                                    const bool highBytes) noexcept
+    {
+        for(; p != end; ++p) {
+            if (IsCandidate(static_cast<unsigned char>(*p), highBytes)) {
+                return p;
+            }
+        }
+        return end;
+    }
+
+#if defined(WAR_LOG_WITH_SSE2) || defined(WAR_LOG_WITH_AVX2)
+    inline unsigned CountTrailingZeros(const unsigned bits) noexcept
+    {
+#ifdef _MSC_VER
+        unsigned long index = 0;
+        _BitScanForward(&index, bits);
+        return static_cast<unsigned>(index);
+#else
+        return static_cast<unsigned>(__builtin_ctz(bits));
+#endif
+    }
+#endif
+
+#ifdef WAR_LOG_WITH_SSE2
+    const char *FindCandidateSse2(const char *p, const char *end,
+                                  const bool highBytes) noexcept
+    {
+        const __m128i max_ctl = _mm_set1_epi8(0x1f);
+        const __m128i del = _mm_set1_epi8(0x7f);
+
+        for(; (end - p) >= 16; p += 16) {
+            const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+            // chars <= 0x1f (unsigned) or chars == 0x7f
+            const __m128i match = _mm_or_si128(
+                _mm_cmpeq_epi8(_mm_min_epu8(chars, max_ctl), chars),
+                _mm_cmpeq_epi8(chars, del));
+            unsigned bits = static_cast<unsigned>(_mm_movemask_epi8(match));
+            if (highBytes) {
+                bits |= static_cast<unsigned>(_mm_movemask_epi8(chars));
+            }
+            if (bits) {
+                return p + CountTrailingZeros(bits);
+            }
+        }
+
+        return FindCandidateScalar(p, end, highBytes);
+    }
+#endif
+
+#ifdef WAR_LOG_WITH_AVX2
+    __attribute__((target("avx2")))
+    const char *FindCandidateAvx2(const char *p, const char *end,
+                                  const bool highBytes) noexcept
+    {
+        const __m256i max_ctl = _mm256_set1_epi8(0x1f);
+        const __m256i del = _mm256_set1_epi8(0x7f);
+
+        for(; (end - p) >= 32; p += 32) {
+            const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+            const __m256i match = _mm256_or_si256(
+                _mm256_cmpeq_epi8(_mm256_min_epu8(chars, max_ctl), chars),
+                _mm256_cmpeq_epi8(chars, del));
+            unsigned bits = static_cast<unsigned>(_mm256_movemask_epi8(match));
+            if (highBytes) {
+                bits |= static_cast<unsigned>(_mm256_movemask_epi8(chars));
+            }
+            if (bits) {
+                return p + CountTrailingZeros(bits);
+            }
+        }
+
+        return FindCandidateSse2(p, end, highBytes);
+    }
+#endif
+
+    const char *(*SelectFindCandidate())(const char *, const char *, bool)
+    {
+#ifdef WAR_LOG_WITH_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return FindCandidateAvx2;
+        }
+#endif
+#ifdef WAR_LOG_WITH_SSE2
+        return FindCandidateSse2;
+#else
+        return FindCandidateScalar;
+#endif
+    }
+
+} // anonymous namespace
+
 
     //////////////////////////////////// LogEngine /////////////////////////////////////
 
+namespace {
+
+    /* Hazard pointer for the handler set a thread is using. The engine
+     * does not free a replaced set while any thread has it here.
+     */
+    struct HandlersHazard
+    {
+        HandlersHazard();
+        ~HandlersHazard();
+
+        std::atomic<const void *> ptr_ {nullptr};
+        unsigned depth_ = 0;
+    };
+
+    struct HazardRegistry
+    {
+        std::mutex lock_;
+        std::vector<HandlersHazard *> hazards_;
+
+        static HazardRegistry& Get() {
+            static HazardRegistry registry;
+            return registry;
+        }
+    };
+
+    HandlersHazard::HandlersHazard()
+    {
+        auto& registry = HazardRegistry::Get();
+        std::lock_guard<std::mutex> lock(registry.lock_);
+        registry.hazards_.push_back(this);
+    }
+
+    HandlersHazard::~HandlersHazard()
+    {
+        auto& registry = HazardRegistry::Get();
+        std::lock_guard<std::mutex> lock(registry.lock_);
+        registry.hazards_.erase(std::find(registry.hazards_.begin(),
+                                          registry.hazards_.end(), this));
+    }
+
+    HandlersHazard& GetHandlersHazard()
+    {
+        thread_local HandlersHazard hazard;
+        return hazard;
+    }
+
+} // anonymous namespace
+
+    class LogEngine::PinnedHandlers
+    {
+    public:
+        PinnedHandlers(const LogEngine& engine)
+        : hazard_{GetHandlersHazard()}
+        {
+            if (hazard_.depth_++) {
+                // A handler is logging. Use the set that is already pinned.
+                handlers_ = static_cast<const handlers_t *>(
+                    hazard_.ptr_.load(std::memory_order_relaxed));
+                return;
+            }
+
+            // Once we have announced the set, and it is still the
+            // current one, Reclaim() will see our hazard.
+            handlers_ = engine.handlers_.load(std::memory_order_acquire);
+            for(;;) {
+                hazard_.ptr_.store(handlers_, std::memory_order_seq_cst);
+                const auto current = engine.handlers_.load(std::memory_order_seq_cst);
+                if (current == handlers_) {
+                    break;
+                }
+                handlers_ = current;
+            }
+        }
+
+        ~PinnedHandlers() {
+            if (--hazard_.depth_ == 0) {
+                hazard_.ptr_.store(nullptr, std::memory_order_release);
+            }
+        }
+
+        PinnedHandlers(const PinnedHandlers&) = delete;
+        PinnedHandlers& operator = (const PinnedHandlers&) = delete;
+
+        const handlers_t& operator * () const noexcept { return *handlers_; }
+
+    private:
+        HandlersHazard& hazard_;
+        const handlers_t *handlers_ = nullptr;
+    };
+
+
     LogEngine *LogEngine::instance_;
-    LogLevel LogEngine::current_level_;
-    filter_t LogEngine::current_filter_;
+    std::atomic<filter_t> LogEngine::relevant_[LL_NUM_LEVELS];
+    std::mutex LogEngine::categories_lock_;
+    std::atomic<const char *> LogEngine::category_names_[LA_NUM_CATEGORIES] = {
+        {"GENERAL"}, {"SECURITY"}, {"TRANSFER"}, {"AUTH"}, {"IO"},
+        {"NETWORK"}, {"THREADS"}, {"IPC"}, {"STATS"}, {"FUNCTION_CALL"}
+    };
+    int LogEngine::category_levels_[LA_NUM_CATEGORIES] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+    };
 
     LogEngine::LogEngine()
     {
         WAR_ASSERT(0 == instance_);
+        // Don't let the first log message pay for the calibration
+        TscClock::Calibrate();
+        Publish(std::unique_ptr<handlers_t>(new handlers_t));
         instance_ = this;
     }
 
     LogEngine::~LogEngine()
     {
         WAR_ASSERT(instance_ == this);
+
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(flusher_lock_);
+                flusher_done_ = true;
+            }
+            flusher_cond_.notify_one();
+            flusher_.join();
+        }
+
+        for(const auto& h : *handlers_.load()) {
+            h->Flush();
+        }
+
+        delete handlers_.exchange(nullptr);
+        retired_.clear();
+
         instance_ = 0;
-        current_level_ = LL_FATAL;
-        current_filter_ = 0;
+        for(auto& relevant : relevant_) {
+            relevant = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(categories_lock_);
+        for(auto& level : category_levels_) {
+            level = -1;
+        }
     }
 
-    void LogEngine::DoSubmit ( Log& log ) noexcept
+    void LogEngine::DoSubmit ( const LogLevel level, const filter_t filter,
+                               std::string&& message,
+                               Field::fields_t&& fields ) noexcept
     {
         try {
             const LogEventHandler::SubmitInfo si = {
-                log.GetLevel(),
-                log.GetFilter(),
-                std::move(log.Get().str()),
-                std::chrono::system_clock::now() };
+                level,
+                filter,
+                std::move(message),
+                TscClock::Ticks(),
+                std::this_thread::get_id(),
+                std::move(fields),
+                ThreadIdentity::GetCurrent() };
 
-            WAR_LOCK;
-            for(LogEventHandler::ptr_t &h: handlers_) {
-                if (si.level_ <= h->GetLevel()) {
+            // A message that is relevant for the threads LogContext go to all the handlers
+            const bool in_context = UNLIKELY(LogContext::IsAnyActive())
+                && LogContext::GetCurrent().IsRelevant(level, filter);
+
+            const PinnedHandlers handlers(*this);
+            for(const LogEventHandler::ptr_t &h: *handlers) {
+                if (in_context || h->IsRelevant(si.level_, si.filter_)) {
                     h->Submit(si);
                 }
             }
@@ -74,7 +349,9 @@ namespace war { namespace log {
     {
         {
             WAR_LOCK;
-            handlers_.push_back (handler);
+            std::unique_ptr<handlers_t> handlers(new handlers_t(*handlers_.load()));
+            handlers->push_back (handler);
+            Publish(std::move(handlers));
         }
 
         LOG_DEBUG << "Added log-handler \"" << handler->GetName() << "\".";
@@ -82,6 +359,56 @@ namespace war { namespace log {
         UpdateLevelAndFilter();
     }
 
+    void LogEngine::RemoveHandler (const LogEventHandler::ptr_t& handler)
+    {
+        {
+            WAR_LOCK;
+            std::unique_ptr<handlers_t> handlers(new handlers_t(*handlers_.load()));
+            const auto it = std::find(handlers->begin(), handlers->end(), handler);
+            if (it == handlers->end()) {
+                return;
+            }
+            handlers->erase(it);
+            Publish(std::move(handlers));
+        }
+
+        UpdateLevelAndFilter();
+
+        LOG_DEBUG << "Removed log-handler \"" << handler->GetName() << "\".";
+    }
+
+    void LogEngine::Publish(std::unique_ptr<handlers_t>&& handlers)
+    {
+        // seq_cst pairs with the hazard check in PinnedHandlers
+        std::unique_ptr<const handlers_t> old(
+            handlers_.exchange(handlers.release(), std::memory_order_seq_cst));
+        if (old) {
+            retired_.push_back(std::move(old));
+            Reclaim();
+        }
+    }
+
+    void LogEngine::Reclaim()
+    {
+        std::vector<const void *> pinned;
+        {
+            auto& registry = HazardRegistry::Get();
+            std::lock_guard<std::mutex> lock(registry.lock_);
+            for(const auto hazard : registry.hazards_) {
+                if (const auto ptr = hazard->ptr_.load(std::memory_order_seq_cst)) {
+                    pinned.push_back(ptr);
+                }
+            }
+        }
+
+        // Removed handlers are destroyed here, if nobody else has them
+        retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+            [&pinned](const std::unique_ptr<const handlers_t>& handlers) {
+                return std::find(pinned.begin(), pinned.end(), handlers.get())
+                    == pinned.end();
+            }), retired_.end());
+    }
+
     void LogEngine::UpdateLevelAndFilter()
     {
         LogLevel level = LL_FATAL;
@@ -89,185 +416,769 @@ namespace war { namespace log {
 
         {
             WAR_LOCK;
-            for (const auto & h: handlers_) {
-                if ( h->GetLevel() > level )
-                    level = h->GetLevel();
-
-                filter |= h->GetFilter();
+            filter_t relevant[LL_NUM_LEVELS] = {};
+            for (const auto & h: *handlers_.load()) {
+                h->UpdateRelevance();
+                for(int ll = LL_FATAL; ll < LL_NUM_LEVELS; ++ll) {
+                    relevant[ll] |= h->relevant_[ll];
+                }
             }
 
-            current_level_ = level;
-            current_filter_ = filter;
+            // Threads that log may see a mix of the old and new values
+            // for a short while. That is harmless, as each handler
+            // checks the level and filter itself.
+            for(int ll = LL_FATAL; ll < LL_NUM_LEVELS; ++ll) {
+                relevant_[ll] = relevant[ll];
+                if (relevant[ll]) {
+                    level = static_cast<LogLevel>(ll);
+                }
+                filter |= relevant[ll];
+            }
         }
 
+        UpdateFlusher();
+
         std::ostringstream filters;
-        LogEventHandler::WriteFilter(filters, current_filter_, 0);
-        LOG_DEBUG << "Log-level is now " << current_level_ << " and filter is "
-            << filters.str() << '(' << current_filter_ << ')';
+        LogEventHandler::WriteFilter(filters, filter, 0);
+        LOG_DEBUG << "Log-level is now " << level << " and filter is "
+            << filters.str() << '(' << filter << ')';
     }
 
-    LogLevel LogEngine::GetLevelFromName(const std::string& name) noexcept
+    void LogEngine::UpdateFlusher()
     {
-        for(int ll = LL_FATAL; ll <= LL_TRACE4; ++ll) {
-            if (name == LogEventHandler::GetLevelName((LogLevel)ll))
-                return static_cast<LogLevel>(ll);
+        // Check the handlers at least twice per (shortest) interval
+        std::chrono::milliseconds tick(0);
+        {
+            WAR_LOCK;
+            for (const auto & h: *handlers_.load()) {
+                const auto interval = h->GetFlushInterval();
+                if (interval.count() && (!tick.count() || (interval < tick))) {
+                    tick = interval;
+                }
+            }
         }
+        tick = std::max(tick / 2, std::chrono::milliseconds(tick.count() ? 1 : 0));
 
-        std::ostringstream msg;
-        msg << "No such log-level: " << "\""  << name << "\"";
-        WAR_THROW(msg.str());
-    }
-
+        if (!tick.count()) {
+            // If the thread is running, it's kept, as the interval may be
+            // changed back. It does nothing when the handlers have no interval.
+            return;
+        }
 
-    //////////////////////////////////// LogEventHandler /////////////////////////////////////
+        std::lock_guard<std::mutex> lock(flusher_lock_);
+        flush_tick_ = tick;
+        if (!flusher_.joinable()) {
+            flusher_ = std::thread(&LogEngine::RunFlusher, this);
+        } else {
+            flusher_cond_.notify_one();
+        }
+    }
 
+    void LogEngine::RunFlusher() noexcept
+    {
+        debug::SetThreadName("log-flusher");
+        ThreadIdentity::SetName("log-flusher");
 
+        std::unique_lock<std::mutex> lock(flusher_lock_);
+        while(!flusher_done_) {
+            flusher_cond_.wait_for(lock, flush_tick_);
+            if (flusher_done_) {
+                break;
+            }
 
-    void LogEventHandler::WriteLevel(std::ostream& out,
-                                     const SubmitInfo &si) const noexcept
-    {
-        out << si.level_;
+            lock.unlock();
+            const auto now = std::chrono::steady_clock::now();
+            const PinnedHandlers handlers(*this);
+            for(const auto& h : *handlers) {
+                h->FlushIfDue(now);
+            }
+            lock.lock();
+        }
     }
 
-    void LogEventHandler::WriteFilter(std::ostream& out,
-                                      const SubmitInfo &si) const noexcept
+    void LogEngine::CalculateRelevance(const LogLevel level,
+                                       const filter_t filter,
+                                       filter_t (&relevant)[LL_NUM_LEVELS]) noexcept
     {
-        WriteFilter(out, si.filter_);
-    }
+        std::lock_guard<std::mutex> lock(categories_lock_);
 
-    void LogEventHandler::WriteFilter(std::ostream& out, const filter_t filter,
-                                      const filter_t hide) noexcept
-    {
-        bool virgin = true;
-#define ADD(name) if ((filter & (LA_ ## name & ~hide)) == LA_ ## name) \
-        { \
-            if (!virgin) { \
-                out << "|"; \
-            } \
-            out << #name; \
-            virgin=false; \
-        }
-        ADD(GENERAL)
-        ADD(SECURITY)
-        ADD(TRANSFER)
-        ADD(AUTH)
-        ADD(IO)
-        ADD(NETWORK)
-        ADD(THREADS)
-        ADD(IPC)
-        ADD(STATS)
-        ADD(FUNCTION_CALL)
-#undef ADD
-        if (!virgin) {
-            out << ' ';
+        filter_t with_level = 0;
+        filter_t at_level[LL_NUM_LEVELS] = {};
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            const int cl = category_levels_[bit];
+            if (cl >= 0) {
+                const filter_t category = static_cast<filter_t>(1) << bit;
+                with_level |= category;
+                for(int ll = LL_FATAL; ll <= cl; ++ll) {
+                    at_level[ll] |= category;
+                }
+            }
+        }
+
+        for(int ll = LL_FATAL; ll < LL_NUM_LEVELS; ++ll) {
+            relevant[ll] = ((ll <= level) ? (filter & ~with_level) : 0)
+                | (filter & at_level[ll]);
         }
     }
 
-    void LogEventHandler::WriteTimestamp(std::ostream& out,
-                                         const SubmitInfo &si) const noexcept
+    filter_t LogEngine::RegisterCategory(const std::string& name)
     {
-        std::tm my_tm{};
-        time_t when = std::chrono::system_clock::to_time_t(si.time_);
-        auto when_rounded = std::chrono::system_clock::from_time_t( when );
-        if (when_rounded > si.time_) {
-            --when;
-            when_rounded -= std::chrono::seconds(1);
+        std::lock_guard<std::mutex> lock(categories_lock_);
+
+        int free_bit = -1;
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            const char *existing = category_names_[bit];
+            if (!existing) {
+                if (free_bit < 0) {
+                    free_bit = bit;
+                }
+            } else if (name == existing) {
+                WAR_THROW_T(ExceptionAlreadyExist, "Log category \"" + name + "\" already exists");
+            }
         }
-        int milliseconds = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>
-            (si.time_ - when_rounded).count();
 
-        if (war_localtime(when, my_tm)) {
-        // No support for put_time in g++ 4.8
+        if (free_bit < 0) {
+            WAR_THROW("No room for more log categories");
+        }
 
-            out << std::setfill('0') << std::setw(4) << (my_tm.tm_year + 1900)
-                << '-' << std::setw(2) << (my_tm.tm_mon + 1)
-                << '-' << std::setw(2) << my_tm.tm_mday
-                << ' ' << std::setw(2) << my_tm.tm_hour
-                << ':' << std::setw(2) << my_tm.tm_min
-                << '.' << std::setw(3) << std::setfill('0') << milliseconds;
+        // The name is never freed, as other threads may use it at any time
+        category_names_[free_bit] = (new std::string(name))->c_str();
+        return static_cast<filter_t>(1) << free_bit;
+    }
 
-//          out << std::put_time(&my_tm, "%Y-%m-%d %H:%M:%S.")
-//              << std::setw(3) << std::setfill('0') << milliseconds;
-        }
-        else {
-            out << "0000-00-00 00:00:00.000";
+    filter_t LogEngine::GetCategoryFromName(const std::string& name)
+    {
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            const char *existing = category_names_[bit];
+            if (existing && (name == existing)) {
+                return static_cast<filter_t>(1) << bit;
+            }
         }
+
+        WAR_THROW("No such log-category: \"" + name + "\"");
     }
 
-    void LogEventHandler::WriteMessage(std::ostream& out,
-                                       const SubmitInfo &si) const noexcept
+    const char *LogEngine::GetCategoryName(const filter_t category) noexcept
     {
-        std::string::const_iterator ch = si.buf_.begin();
-        const std::string::const_iterator end = si.buf_.end();
-        for(; ch != end; ++ch) {
-            const char c = *ch;
-            if ('\r' == c)
-                continue;
-            if ('\n' == c) {
-                if (++ch == end)
-                    break; // end of buffer. Do nothing.
-                --ch;
-                out << std::endl << "  ";
-            } else if (std::iscntrl(c, locale_) && !std::isspace(c, locale_)) {
-                // Output '%xx' URL style encoding for control characters
-                const std::ios::fmtflags saved = out.flags();
-                out << '%' << std::setw(2) << std::setfill('0') << std::hex << ((unsigned int)c);
-                out.flags(saved);
-            } else {
-                out << c;
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            if (category == (static_cast<filter_t>(1) << bit)) {
+                return category_names_[bit];
             }
         }
+        return nullptr;
     }
 
-    const char *LogEventHandler::GetLevelName(const LogLevel level) noexcept
+    void LogEngine::SetCategoryLevel(const filter_t categories, const LogLevel level)
     {
-        static const char *names[] = { "FATAL", "ERROR", "WARN", "INFO",
-            "NOTICE", "DEBUG", "TRACE1", "TRACE2", "TRACE3", "TRACE4" };
+        {
+            std::lock_guard<std::mutex> lock(categories_lock_);
+            for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+                if (categories & (static_cast<filter_t>(1) << bit)) {
+                    category_levels_[bit] = level;
+                }
+            }
+        }
 
-        WAR_ASSERT(level >= war::log::LL_FATAL);
-        WAR_ASSERT(level <= war::log::LL_TRACE4);
+        UpdateLevelAndFilter();
+    }
 
-        const char *name = names[level];
+    void LogEngine::ClearCategoryLevel(const filter_t categories)
+    {
+        {
+            std::lock_guard<std::mutex> lock(categories_lock_);
+            for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+                if (categories & (static_cast<filter_t>(1) << bit)) {
+                    category_levels_[bit] = -1;
+                }
+            }
+        }
 
-        return name;
+        UpdateLevelAndFilter();
     }
 
-    void LogEventHandler::WriteDefaulInfo(std::ostream& out,
-                                          const SubmitInfo &si) const noexcept
+    LogLevel LogEngine::GetLevelFromName(const std::string& name) noexcept
     {
-        WriteTimestamp(out, si);
-        out << ' ' << std::this_thread::get_id() << ' ';
-        WriteLevel(out, si);
-        out << ": ";
-        WriteFilter(out, si);
-        WriteMessage(out, si);
-        out << std::endl;
+        for(int ll = LL_FATAL; ll <= LL_TRACE4; ++ll) {
+            if (name == LogEventHandler::GetLevelName((LogLevel)ll))
+                return static_cast<LogLevel>(ll);
+        }
+
+        std::ostringstream msg;
+        msg << "No such log-level: " << "\""  << name << "\"";
+        WAR_THROW(msg.str());
     }
 
-    //////////////////////////////////// LogToFile /////////////////////////////////////
 
-    LogToFile::LogToFile(const path_t& path,
-        const bool truncateFileOnOpen,
-        const std::string& name, const LogLevel level,
-        const filter_t filter)
-        : LogEventHandler(name, level, filter), path_(path)
-    {
-        std::ios_base::openmode mode = std::ios_base::out | std::ios_base::app;
-        if (truncateFileOnOpen && boost::filesystem::is_regular_file(path))
-            mode = std::ios_base::out | std::ios_base::trunc;
+    //////////////////////////////////// ThreadIdentity /////////////////////////////////////
 
-        out_.open(path.c_str(), mode);
-        if (!out_.is_open()) {
-            WAR_EXCEPTION("Failed to open log-file for append")
-                << boost::errinfo_file_name(path_.c_str())
-                << boost::errinfo_errno(errno);
-            WAR_EXCEPTION_THROW;
-        }
+namespace {
+    std::atomic<std::uint32_t> next_thread_identity {1};
 
-        out_.sync_with_stdio(false);
+    ThreadIdentity& GetThreadIdentity() noexcept
+    {
+        static thread_local ThreadIdentity identity;
+        return identity;
     }
+}
 
-    LogToFile::LogEventHandler::ptr_t LogToFile::Create(const path_t& path,
+    const ThreadIdentity& ThreadIdentity::GetCurrent() noexcept
+    {
+        ThreadIdentity& identity = GetThreadIdentity();
+        if (UNLIKELY(identity.IsEmpty())) {
+            identity.Format({});
+        }
+        return identity;
+    }
+
+    void ThreadIdentity::SetName(const boost::string_ref& name) noexcept
+    {
+        GetThreadIdentity().Format(name);
+    }
+
+    void ThreadIdentity::Format(const boost::string_ref& name) noexcept
+    {
+        if (!id_) {
+            id_ = next_thread_identity++;
+        }
+
+        char id[12];
+        char *p = id + sizeof(id);
+        std::uint32_t value = id_;
+        do {
+            *--p = static_cast<char>('0' + (value % 10));
+            value /= 10;
+        } while(value);
+        *--p = '#';
+        const std::size_t id_len = static_cast<std::size_t>(id + sizeof(id) - p);
+
+        const std::size_t name_len = std::min(name.size(), max_length - id_len);
+        if (name_len) {
+            std::memcpy(text_, name.data(), name_len);
+        }
+        std::memcpy(text_ + name_len, p, id_len);
+        size_ = static_cast<std::uint8_t>(name_len + id_len);
+        text_[size_] = 0;
+    }
+
+
+    //////////////////////////////////// LogCallSite /////////////////////////////////////
+
+    std::atomic<LogCallSite *> LogCallSite::sites_ {nullptr};
+
+    LogCallSite::LogCallSite(const char *file, const int line,
+                             const LogLevel level) noexcept
+        : file_(file), line_(line), level_(level)
+    {
+        // The sites are never removed, so a simple push is safe
+        next_ = sites_.load(std::memory_order_relaxed);
+        while(!sites_.compare_exchange_weak(next_, this,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed))
+            ;
+    }
+
+    LogCallSite::Stats LogCallSite::GetStats() const noexcept
+    {
+        Stats stats;
+        stats.file = file_;
+        stats.line = line_;
+        stats.level = level_;
+        stats.count = count_.load(std::memory_order_relaxed);
+        stats.bytes = bytes_.load(std::memory_order_relaxed);
+        stats.format_time = TscClock::ToDuration(ticks_.load(std::memory_order_relaxed))
+            - TscClock::ToDuration(0);
+        return stats;
+    }
+
+    std::vector<LogCallSite::Stats> LogCallSite::GetAll()
+    {
+        std::vector<Stats> all;
+        for(auto site = sites_.load(std::memory_order_acquire); site; site = site->next_) {
+            all.push_back(site->GetStats());
+        }
+
+        std::sort(all.begin(), all.end(), [](const Stats& left, const Stats& right) {
+            return left.bytes > right.bytes;
+        });
+
+        return all;
+    }
+
+    void LogCallSite::Dump(std::ostream& out, const std::size_t max)
+    {
+        const auto all = GetAll();
+
+        out << std::setfill(' ')
+            << std::setw(12) << "messages" << ' '
+            << std::setw(14) << "bytes" << ' '
+            << std::setw(10) << "bytes/msg" << ' '
+            << std::setw(12) << "format-us" << ' '
+            << std::setw(8) << "ns/msg" << ' '
+            << std::setw(6) << "level" << "  call-site\n";
+
+        std::size_t rows = 0;
+        for(const auto& site : all) {
+            if (max && (++rows > max)) {
+                break;
+            }
+
+            const auto ns = site.format_time.count();
+            out << std::setw(12) << site.count << ' '
+                << std::setw(14) << site.bytes << ' '
+                << std::setw(10) << (site.count ? site.bytes / site.count : 0) << ' '
+                << std::setw(12) << (ns / 1000) << ' '
+                << std::setw(8) << (site.count ? ns / static_cast<std::int64_t>(site.count) : 0) << ' '
+                << std::setw(6) << LogEventHandler::GetLevelName(site.level) << "  "
+                << site.file << ':' << site.line << '\n';
+        }
+    }
+
+    void LogCallSite::Reset() noexcept
+    {
+        for(auto site = sites_.load(std::memory_order_acquire); site; site = site->next_) {
+            site->count_.store(0, std::memory_order_relaxed);
+            site->bytes_.store(0, std::memory_order_relaxed);
+            site->ticks_.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    //////////////////////////////////// LogContext /////////////////////////////////////
+
+    std::atomic<int> LogContext::active_count_ {0};
+
+namespace {
+    thread_local LogContext current_log_context;
+}
+
+    const LogContext& LogContext::GetCurrent() noexcept
+    {
+        return current_log_context;
+    }
+
+    void LogContext::SetCurrent(const LogContext& context) noexcept
+    {
+        if (context.active_ != current_log_context.active_) {
+            if (context.active_) {
+                ++active_count_;
+            } else {
+                --active_count_;
+            }
+        }
+        current_log_context = context;
+    }
+
+
+    //////////////////////////////////// LogEventHandler /////////////////////////////////////
+
+    LogEventHandler::LogEventHandler(const std::string& name,
+                                     const LogLevel level,
+                                     const filter_t filter)
+        : name_ (name), level_ (level), filter_ (filter)
+    {
+        UpdateRelevance();
+
+        for(int i = 0; i < 256; ++i) {
+            const char c = static_cast<char>(i);
+            special_[i] = ('\r' == c) || ('\n' == c)
+                || (std::iscntrl(c, locale_) && !std::isspace(c, locale_));
+            if (special_[i]) {
+                WAR_ASSERT(IsCandidate(static_cast<unsigned char>(i), true));
+                if (i > 0x7f) {
+                    high_special_ = true;
+                }
+            }
+        }
+
+        static const find_special_t find_candidate = SelectFindCandidate();
+        find_special_ = find_candidate;
+    }
+
+    void LogEventHandler::UpdateRelevance() noexcept
+    {
+        filter_t relevant[LL_NUM_LEVELS];
+        LogEngine::CalculateRelevance(GetLevel(), GetFilter(), relevant);
+        for(int ll = LL_FATAL; ll < LL_NUM_LEVELS; ++ll) {
+            relevant_[ll] = relevant[ll];
+        }
+    }
+
+    void LogEventHandler::SetLevel(const LogLevel level)
+    {
+        level_ = level;
+        UpdateRelevance();
+        if (LogEngine::HasInstance()) {
+            LogEngine::GetInstance().UpdateLevelAndFilter();
+        }
+    }
+
+    void LogEventHandler::SetFilter(const filter_t filter)
+    {
+        filter_ = filter;
+        UpdateRelevance();
+        if (LogEngine::HasInstance()) {
+            LogEngine::GetInstance().UpdateLevelAndFilter();
+        }
+    }
+
+    void LogEventHandler::SetFlushPolicy(const FlushPolicy& policy)
+    {
+        flush_records_ = policy.records_;
+        flush_interval_ = policy.interval_.count();
+        flush_level_ = policy.level_;
+        if (LogEngine::HasInstance()) {
+            LogEngine::GetInstance().UpdateLevelAndFilter();
+        }
+    }
+
+    FlushPolicy LogEventHandler::GetFlushPolicy() const noexcept
+    {
+        return {flush_records_.load(), std::chrono::milliseconds(flush_interval_.load()),
+                flush_level_.load()};
+    }
+
+    bool LogEventHandler::ShouldFlush(const SubmitInfo &si) noexcept
+    {
+        const unsigned pending = pending_.fetch_add(1, std::memory_order_relaxed) + 1;
+        const unsigned records = flush_records_.load(std::memory_order_relaxed);
+
+        if ((si.level_ <= flush_level_.load(std::memory_order_relaxed))
+            || (records && (pending >= records))) {
+            Flushed();
+            return true;
+        }
+
+        if ((pending == 1) && flush_interval_.load(std::memory_order_relaxed)) {
+            first_pending_.store(std::chrono::steady_clock::now().time_since_epoch().count(),
+                                 std::memory_order_relaxed);
+        }
+
+        return false;
+    }
+
+    void LogEventHandler::FlushIfDue(const std::chrono::steady_clock::time_point now) noexcept
+    {
+        const std::chrono::milliseconds interval(flush_interval_.load(std::memory_order_relaxed));
+        if (!interval.count() || !pending_.load(std::memory_order_relaxed)) {
+            return;
+        }
+
+        const std::chrono::steady_clock::time_point first(std::chrono::steady_clock::duration(
+            first_pending_.load(std::memory_order_relaxed)));
+        if ((now - first) >= interval) {
+            Flush();
+        }
+    }
+
+
+    void LogEventHandler::WriteLevel(std::ostream& out,
+                                     const SubmitInfo &si) const noexcept
+    {
+        out << si.level_;
+    }
+
+    void LogEventHandler::WriteFilter(std::ostream& out,
+                                      const SubmitInfo &si) const noexcept
+    {
+        WriteFilter(out, si.filter_);
+    }
+
+    void LogEventHandler::WriteFilter(std::ostream& out, const filter_t filter,
+                                      const filter_t hide) noexcept
+    {
+        bool virgin = true;
+        const filter_t visible = filter & ~hide;
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            const filter_t category = static_cast<filter_t>(1) << bit;
+            if (visible & category) {
+                const char *name = LogEngine::category_names_[bit].load(std::memory_order_relaxed);
+                if (!name) {
+                    continue;
+                }
+                if (!virgin) {
+                    out << "|";
+                }
+                out << name;
+                virgin=false;
+            }
+        }
+        if (!virgin) {
+            out << ' ';
+        }
+    }
+
+    void LogEventHandler::WriteTimestamp(std::ostream& out,
+                                         const SubmitInfo &si) const noexcept
+    {
+        std::tm my_tm{};
+        const auto time = si.GetTime();
+        time_t when = std::chrono::system_clock::to_time_t(time);
+        auto when_rounded = std::chrono::system_clock::from_time_t(when);
+        if (when_rounded > time) {
+            --when;
+            when_rounded -= std::chrono::seconds(1);
+        }
+        int milliseconds = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>
+            (time - when_rounded).count();
+
+        if (war_localtime(when, my_tm)) {
+        // No support for put_time in g++ 4.8
+
+            out << std::setfill('0') << std::setw(4) << (my_tm.tm_year + 1900)
+                << '-' << std::setw(2) << (my_tm.tm_mon + 1)
+                << '-' << std::setw(2) << my_tm.tm_mday
+                << ' ' << std::setw(2) << my_tm.tm_hour
+                << ':' << std::setw(2) << my_tm.tm_min
+                << ':' << std::setw(2) << my_tm.tm_sec
+                << '.' << std::setw(3) << std::setfill('0') << milliseconds;
+
+//          out << std::put_time(&my_tm, "%Y-%m-%d %H:%M:%S.")
+//              << std::setw(3) << std::setfill('0') << milliseconds;
+        }
+        else {
+            out << "0000-00-00 00:00:00.000";
+        }
+    }
+
+    void LogEventHandler::WriteMessage(std::ostream& out,
+                                       const SubmitInfo &si) const noexcept
+    {
+        const char *p = si.buf_.data();
+        const char * const end = p + si.buf_.size();
+        while(p != end) {
+            // Find the next character that needs special treatment
+            const char *special = find_special_(p, end, high_special_);
+            while((special != end) && !special_[static_cast<unsigned char>(*special)]) {
+                special = find_special_(special + 1, end, high_special_);
+            }
+
+            if (special != p) {
+                out.write(p, special - p);
+            }
+
+            if (special == end) {
+                break;
+            }
+
+            const char c = *special;
+            p = special + 1;
+
+            if ('\r' == c)
+                continue;
+            if ('\n' == c) {
+                if (p == end)
+                    break; // end of buffer. Do nothing.
+                out << '\n' << "  ";
+            } else {
+                // Output '%xx' URL style encoding for control characters
+                const std::ios::fmtflags saved = out.flags();
+                out << '%' << std::setw(2) << std::setfill('0') << std::hex << ((unsigned int)c);
+                out.flags(saved);
+            }
+        }
+    }
+
+    const char *LogEventHandler::GetLevelName(const LogLevel level) noexcept
+    {
+        static const char *names[] = { "FATAL", "ERROR", "WARN", "INFO",
+            "NOTICE", "DEBUG", "TRACE1", "TRACE2", "TRACE3", "TRACE4" };
+
+        WAR_ASSERT(level >= war::log::LL_FATAL);
+        WAR_ASSERT(level <= war::log::LL_TRACE4);
+
+        const char *name = names[level];
+
+        return name;
+    }
+
+    void LogEventHandler::WriteDefaulInfo(std::ostream& out,
+                                          const SubmitInfo &si) const noexcept
+    {
+        WriteTimestamp(out, si);
+        out << ' ';
+        if (si.identity_.IsEmpty()) {
+            out << si.thread_;
+        } else {
+            out.write(si.identity_.GetText().data(), si.identity_.GetText().size());
+        }
+        out << ' ';
+        WriteLevel(out, si);
+        out << ": ";
+        WriteFilter(out, si);
+        WriteMessage(out, si);
+        WriteFields(out, si);
+        out << '\n';
+    }
+
+    void LogEventHandler::WriteFields(std::ostream& out,
+                                      const SubmitInfo &si) const noexcept
+    {
+        for(const auto& field : si.fields_) {
+            out << ' ';
+            field.Write(out);
+        }
+    }
+
+    //////////////////////////////////// LogToStream /////////////////////////////////////
+
+    void LogToStream::Submit(const SubmitInfo& info) noexcept
+    {
+        WAR_LOCK;
+        WriteDefaulInfo(out_, info);
+        if (ShouldFlush(info)) {
+            out_.flush();
+        }
+    }
+
+    void LogToStream::Flush() noexcept
+    {
+        WAR_LOCK;
+        out_.flush();
+        Flushed();
+    }
+
+    //////////////////////////////////// LogToFile /////////////////////////////////////
+
+    LogToFile::FileBuffer::FileBuffer()
+        : buffer_(new char[buffer_size])
+    {
+        setp(buffer_.get(), buffer_.get() + buffer_size);
+    }
+
+    LogToFile::FileBuffer::~FileBuffer()
+    {
+        WriteBuffer();
+    }
+
+    bool LogToFile::FileBuffer::Open(const path_t& path,
+                                     const std::ios_base::openmode mode)
+    {
+        // We do the buffering. Must be set before the file is opened.
+        file_.pubsetbuf(nullptr, 0);
+
+        if (!file_.open(path.c_str(), mode)) {
+            return false;
+        }
+
+        if (mode & std::ios_base::app) {
+            boost::system::error_code ec;
+            const auto size = boost::filesystem::file_size(path, ec);
+            written_ = ec ? 0 : static_cast<std::uint64_t>(size);
+        }
+
+        return true;
+    }
+
+    bool LogToFile::FileBuffer::WriteBuffer() noexcept
+    {
+        const auto len = pptr() - pbase();
+        if (len == 0) {
+            return true;
+        }
+
+        const auto bytes = file_.sputn(pbase(), len);
+        setp(buffer_.get(), buffer_.get() + buffer_size);
+        if (bytes > 0) {
+            written_ += static_cast<std::uint64_t>(bytes);
+        }
+        return bytes == len;
+    }
+
+    int LogToFile::FileBuffer::overflow(int ch)
+    {
+        if (!WriteBuffer()) {
+            return traits_type::eof();
+        }
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(ch);
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int LogToFile::FileBuffer::sync()
+    {
+        return WriteBuffer() ? 0 : -1;
+    }
+
+    LogToFile::LogToFile(const path_t& path,
+        const bool truncateFileOnOpen,
+        const std::string& name, const LogLevel level,
+        const filter_t filter)
+        : LogEventHandler(name, level, filter), path_(path)
+        , truncate_(truncateFileOnOpen && boost::filesystem::is_regular_file(path))
+        , out_(&buffer_)
+    {
+        std::ios_base::openmode mode = std::ios_base::out | std::ios_base::app;
+        if (truncate_)
+            mode = std::ios_base::out | std::ios_base::trunc;
+
+        if (!buffer_.Open(path, mode)) {
+            WAR_EXCEPTION("Failed to open log-file for append")
+                << boost::errinfo_file_name(path_.c_str())
+                << boost::errinfo_errno(errno);
+            WAR_EXCEPTION_THROW;
+        }
+    }
+
+    void LogToFile::EnableIndex(const std::size_t interval)
+    {
+        WAR_LOCK;
+        const auto index_path = path_ + ".idx";
+
+        // An index left behind by an old log-file (for example one that was
+        // rotated away) does not describe an empty log-file.
+        const bool fresh = truncate_ || (buffer_.GetOffset() == 0);
+        index_.open(index_path.c_str(), fresh
+            ? (std::ios_base::out | std::ios_base::trunc)
+            : (std::ios_base::out | std::ios_base::app));
+        if (!index_.is_open()) {
+            WAR_EXCEPTION("Failed to open log-index for append")
+                << boost::errinfo_file_name(index_path.c_str())
+                << boost::errinfo_errno(errno);
+            WAR_EXCEPTION_THROW;
+        }
+        index_interval_ = std::max<std::size_t>(interval, 1);
+    }
+
+    void LogToFile::UpdateIndex(const SubmitInfo& info) noexcept
+    {
+        if (!index_interval_) {
+            return;
+        }
+
+        const auto offset = buffer_.GetOffset();
+        if (have_indexed_ && ((offset - indexed_offset_) < index_interval_)) {
+            return;
+        }
+
+        const auto when = std::chrono::duration_cast<std::chrono::milliseconds>(
+            info.GetTime().time_since_epoch()).count();
+
+        // The entry is flushed right away. It's rare, and a reader
+        // can handle an entry that points beyond what's written.
+        index_ << when << ' ' << offset << std::endl;
+        indexed_offset_ = offset;
+        have_indexed_ = true;
+    }
+
+    void LogToFile::Submit(const SubmitInfo& info) noexcept
+    {
+        WAR_LOCK;
+        UpdateIndex(info);
+        WriteDefaulInfo(out_, info);
+        if (ShouldFlush(info)) {
+            out_.flush();
+        }
+    }
+
+    void LogToFile::Flush() noexcept
+    {
+        WAR_LOCK;
+        out_.flush();
+        Flushed();
+    }
+
+    LogToFile::LogEventHandler::ptr_t LogToFile::Create(const path_t& path,
         const bool truncateFileOnOpen,
         const std::string& name,
         const LogLevel level,
@@ -278,6 +1189,702 @@ namespace war { namespace log {
     }
 
 
+    //////////////////////////////////// LogToJsonFile /////////////////////////////////////
+
+    LogToJsonFile::LogToJsonFile(const path_t& path,
+        const bool truncateFileOnOpen,
+        const std::string& name, const LogLevel level,
+        const filter_t filter)
+        : LogToFile(path, truncateFileOnOpen, name, level, filter)
+    {
+    }
+
+    void LogToJsonFile::Submit(const SubmitInfo& info) noexcept
+    {
+        WAR_LOCK;
+        UpdateIndex(info);
+        WriteJson(out_, info);
+        out_ << '\n';
+        if (ShouldFlush(info)) {
+            out_.flush();
+        }
+    }
+
+    void LogToJsonFile::WriteJson(std::ostream& out, const SubmitInfo& si) noexcept
+    {
+        // Timestamp in UTC, with milliseconds
+        const auto time = si.GetTime();
+        time_t when = std::chrono::system_clock::to_time_t(time);
+        auto when_rounded = std::chrono::system_clock::from_time_t(when);
+        if (when_rounded > time) {
+            --when;
+            when_rounded -= std::chrono::seconds(1);
+        }
+        const int milliseconds = std::chrono::duration_cast<std::chrono::duration<int, std::milli>>
+            (time - when_rounded).count();
+
+        std::tm my_tm{};
+        // Room for the widest int values, so the output can't be truncated
+        char ts[96] = "1970-01-01T00:00:00.000Z";
+        if (war_gmtime(when, my_tm)) {
+            std::snprintf(ts, sizeof(ts), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                          my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
+                          my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, milliseconds);
+        }
+
+        out << "{\"ts\":\"" << ts << "\",\"level\":\"" << GetLevelName(si.level_)
+            << "\",\"filter\":[";
+
+        bool virgin = true;
+        for(int bit = 0; bit < LA_NUM_CATEGORIES; ++bit) {
+            const filter_t category = static_cast<filter_t>(1) << bit;
+            if (si.filter_ & category) {
+                const char *name = LogEngine::GetCategoryName(category);
+                if (!name) {
+                    continue;
+                }
+                if (!virgin) {
+                    out << ',';
+                }
+                out << '\"' << name << '\"';
+                virgin = false;
+            }
+        }
+
+        out << "],\"thread\":";
+        if (si.identity_.IsEmpty()) {
+            out << '"' << si.thread_ << '"';
+        } else {
+            WriteJsonString(out, si.identity_.GetText());
+        }
+        out << ",\"msg\":";
+        WriteJsonString(out, si.buf_);
+
+        if (!si.fields_.empty()) {
+            out << ",\"fields\":{";
+            virgin = true;
+            for(const auto& field : si.fields_) {
+                if (!virgin) {
+                    out << ',';
+                }
+                virgin = false;
+                WriteJsonString(out, field.GetKey());
+                out << ':';
+                switch(field.GetType()) {
+                case Field::FT_INT:
+                    out << field.GetInt();
+                    break;
+                case Field::FT_UINT:
+                    out << field.GetUint();
+                    break;
+                case Field::FT_DOUBLE:
+                    if (std::isfinite(field.GetDouble())) {
+                        char buf[32];
+                        std::snprintf(buf, sizeof(buf), "%.17g", field.GetDouble());
+                        out << buf;
+                    } else {
+                        // JSON has no representation for inf and nan
+                        out << "null";
+                    }
+                    break;
+                case Field::FT_BOOL:
+                    out << (field.GetBool() ? "true" : "false");
+                    break;
+                case Field::FT_STRING:
+                    WriteJsonString(out, field.GetString());
+                    break;
+                }
+            }
+            out << '}';
+        }
+
+        out << '}';
+    }
+
+    void LogToJsonFile::WriteJsonString(std::ostream& out,
+                                        const boost::string_ref& str) noexcept
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        out << '\"';
+        const char *p = str.data();
+        const char * const end = p + str.size();
+        const char *span = p;
+        for(; p != end; ++p) {
+            const unsigned char ch = static_cast<unsigned char>(*p);
+            if ((ch >= 0x20) && (ch != '"') && (ch != '\\')) {
+                continue;
+            }
+
+            if (span != p) {
+                out.write(span, p - span);
+            }
+            span = p + 1;
+
+            switch(ch) {
+            case '"':
+                out << "\\\"";
+                break;
+            case '\\':
+                out << "\\\\";
+                break;
+            case '\n':
+                out << "\\n";
+                break;
+            case '\r':
+                out << "\\r";
+                break;
+            case '\t':
+                out << "\\t";
+                break;
+            default:
+                out << "\\u00" << hex[ch >> 4] << hex[ch & 0xf];
+            }
+        }
+        if (span != end) {
+            out.write(span, end - span);
+        }
+        out << '\"';
+    }
+
+    LogEventHandler::ptr_t LogToJsonFile::Create(const path_t& path,
+        const bool truncateFileOnOpen,
+        const std::string& name,
+        const LogLevel level,
+        const filter_t filter)
+    {
+        return LogEventHandler::ptr_t(new LogToJsonFile(path, truncateFileOnOpen,
+                                                        name, level, filter));
+    }
+
+
+    //////////////////////////////////// LogFlightRecorder /////////////////////////////////////
+
+namespace {
+
+    std::atomic<std::uint64_t> next_flight_recorder_id {1};
+
+    /* Helpers for DumpFromSignal(). Only async-signal-safe
+     * functions can be used there, so no streams, no locale
+     * and no memory allocation.
+     */
+
+    void WriteToFd(const int fd, const char *data, std::size_t len) noexcept
+    {
+        while(len) {
+#ifdef WIN32
+            const int written = _write(fd, data, static_cast<unsigned>(len));
+#else
+            const ssize_t written = ::write(fd, data, len);
+#endif
+            if (written <= 0) {
+                if ((written < 0) && (errno == EINTR)) {
+                    continue;
+                }
+                return;
+            }
+            data += written;
+            len -= static_cast<std::size_t>(written);
+        }
+    }
+
+    void WriteToFd(const int fd, const char *str) noexcept
+    {
+        WriteToFd(fd, str, std::strlen(str));
+    }
+
+    void WriteToFd(const int fd, std::uint64_t value, const int minDigits = 1) noexcept
+    {
+        char buf[24];
+        char *p = buf + sizeof(buf);
+        int digits = 0;
+        do {
+            *--p = static_cast<char>('0' + (value % 10));
+            value /= 10;
+        } while((++digits < minDigits) || value);
+        WriteToFd(fd, p, static_cast<std::size_t>(buf + sizeof(buf) - p));
+    }
+
+    void WriteToFd(const int fd, const Field& field) noexcept
+    {
+        WriteToFd(fd, field.GetKey().data(), field.GetKey().size());
+        WriteToFd(fd, "=");
+        switch(field.GetType()) {
+        case Field::FT_INT:
+            if (field.GetInt() < 0) {
+                WriteToFd(fd, "-");
+                WriteToFd(fd, 0 - static_cast<std::uint64_t>(field.GetInt()));
+            } else {
+                WriteToFd(fd, static_cast<std::uint64_t>(field.GetInt()));
+            }
+            break;
+        case Field::FT_UINT:
+            WriteToFd(fd, field.GetUint());
+            break;
+        case Field::FT_DOUBLE: {
+            double value = field.GetDouble();
+            if (!(std::fabs(value) < 1e18)) {
+                WriteToFd(fd, "?");
+                break;
+            }
+            if (value < 0) {
+                WriteToFd(fd, "-");
+                value = -value;
+            }
+            const auto whole = static_cast<std::uint64_t>(value);
+            WriteToFd(fd, whole);
+            WriteToFd(fd, ".");
+            WriteToFd(fd, static_cast<std::uint64_t>((value - whole) * 1000000), 6);
+            } break;
+        case Field::FT_BOOL:
+            WriteToFd(fd, field.GetBool() ? "true" : "false");
+            break;
+        case Field::FT_STRING:
+            WriteToFd(fd, field.GetString().data(), field.GetString().size());
+            break;
+        }
+    }
+
+} // anonymous namespace
+
+    std::atomic<LogFlightRecorder *> LogFlightRecorder::crash_recorder_ {nullptr};
+
+    LogFlightRecorder::LogFlightRecorder(const std::size_t recordsPerThread,
+                                         LogEventHandler::ptr_t target,
+                                         const std::string& name,
+                                         const LogLevel level,
+                                         const filter_t filter)
+        : LogEventHandler(name, level, filter)
+        , records_per_thread_(std::max<std::size_t>(recordsPerThread, 1))
+        , target_(std::move(target)), id_(next_flight_recorder_id++)
+    {
+    }
+
+    LogFlightRecorder::~LogFlightRecorder()
+    {
+        LogFlightRecorder *self = this;
+        crash_recorder_.compare_exchange_strong(self, nullptr);
+
+        Ring *ring = rings_.load();
+        while(ring) {
+            Ring *next = ring->next_;
+            delete ring;
+            ring = next;
+        }
+    }
+
+    LogFlightRecorder::Ring& LogFlightRecorder::GetRing()
+    {
+        static thread_local std::uint64_t cached_id = 0;
+        static thread_local Ring *cached_ring = nullptr;
+
+        if (LIKELY(cached_id == id_)) {
+            return *cached_ring;
+        }
+
+        // The thread may have been used by this recorder before, if
+        // it logs to more than one recorder, or if the thread-id is
+        // reused by a new thread.
+        const auto me = std::this_thread::get_id();
+        Ring *ring = rings_.load(std::memory_order_acquire);
+        for(; ring; ring = ring->next_) {
+            if (ring->thread_ == me) {
+                break;
+            }
+        }
+
+        if (!ring) {
+            ring = new Ring(records_per_thread_);
+            Ring *head = rings_.load(std::memory_order_relaxed);
+            do {
+                ring->next_ = head;
+            } while(!rings_.compare_exchange_weak(head, ring,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+        }
+
+        cached_id = id_;
+        cached_ring = ring;
+        return *ring;
+    }
+
+    void LogFlightRecorder::Submit(const SubmitInfo& info) noexcept
+    {
+        Ring& ring = GetRing();
+
+        {
+            std::lock_guard<std::mutex> lock(ring.lock_);
+            const auto count = ring.count_.load(std::memory_order_relaxed);
+            Record& record = ring.records_[count % ring.records_.size()];
+            record.level_ = info.level_;
+            record.filter_ = info.filter_;
+            record.ticks_ = info.ticks_;
+            record.buf_.assign(info.buf_); // Reuse the buffer
+            record.fields_ = info.fields_;
+            record.identity_ = info.identity_;
+            ring.count_.store(count + 1, std::memory_order_release);
+        }
+
+        if (info.level_ == LL_FATAL) {
+            if (target_) {
+                Dump(*target_);
+            } else {
+                Dump(std::clog);
+            }
+        }
+    }
+
+    LogFlightRecorder::records_t
+    LogFlightRecorder::Collect(const std::string& prefix) const
+    {
+        records_t records;
+        for(const Ring *ring = rings_.load(std::memory_order_acquire);
+            ring; ring = ring->next_) {
+
+            std::lock_guard<std::mutex> lock(ring->lock_);
+            const std::uint64_t count = ring->count_.load(std::memory_order_relaxed);
+            const std::uint64_t capacity = ring->records_.size();
+            for(auto i = (count > capacity) ? (count - capacity) : 0; i < count; ++i) {
+                const Record& r = ring->records_[i % capacity];
+                records.emplace_back(new SubmitInfo{r.level_, r.filter_,
+                    prefix + r.buf_, r.ticks_, ring->thread_, r.fields_, r.identity_});
+            }
+        }
+
+        std::stable_sort(records.begin(), records.end(), [](const auto& left,
+                                                            const auto& right) {
+            return left->ticks_ < right->ticks_;
+        });
+
+        return records;
+    }
+
+    void LogFlightRecorder::Dump(std::ostream& out) const
+    {
+        for(const auto& si : Collect({})) {
+            WriteDefaulInfo(out, *si);
+        }
+    }
+
+    void LogFlightRecorder::Dump(LogEventHandler& target) const
+    {
+        for(const auto& si : Collect("[flight-recorder] ")) {
+            target.Submit(*si);
+        }
+    }
+
+    std::size_t LogFlightRecorder::GetCount() const noexcept
+    {
+        std::size_t records = 0;
+        for(const Ring *ring = rings_.load(std::memory_order_acquire);
+            ring; ring = ring->next_) {
+            records += static_cast<std::size_t>(std::min<std::uint64_t>(
+                ring->count_.load(std::memory_order_relaxed), ring->records_.size()));
+        }
+        return records;
+    }
+
+    void LogFlightRecorder::InstallCrashHandler(const int fd)
+    {
+        // Calibrates the clock, which is not safe to do in the signal handler
+        crash_clock_ = TscClock::GetWallTimeSnapshot();
+        crash_fd_ = fd;
+        crash_recorder_ = this;
+
+        static const int signals[] = {
+            SIGSEGV, SIGILL, SIGFPE, SIGABRT,
+#ifndef WIN32
+            SIGBUS
+#endif
+        };
+
+        for(const int sig : signals) {
+#ifdef WIN32
+            std::signal(sig, OnCrash);
+#else
+            struct sigaction sa = {};
+            sa.sa_handler = OnCrash;
+            sigemptyset(&sa.sa_mask);
+            // Restore the default action, so that we can re-raise the signal
+            sa.sa_flags = SA_RESETHAND;
+            if (sigaction(sig, &sa, nullptr) != 0) {
+                WAR_EXCEPTION("Failed to install crash handler")
+                    << boost::errinfo_errno(errno);
+                WAR_EXCEPTION_THROW;
+            }
+#endif
+        }
+    }
+
+    void LogFlightRecorder::OnCrash(int signal)
+    {
+        const int saved_errno = errno;
+        LogFlightRecorder *recorder = crash_recorder_.exchange(nullptr);
+        if (recorder) {
+            recorder->DumpFromSignal(recorder->crash_fd_);
+        }
+        errno = saved_errno;
+
+        // The default action is restored, so this will terminate the
+        // application (and produce a core-dump, if enabled).
+        std::raise(signal);
+    }
+
+    void LogFlightRecorder::DumpFromSignal(const int fd) const noexcept
+    {
+        WriteToFd(fd, "\n*** Crashed. Dumping the flight recorder ***\n");
+
+        // Use the newest wall time anchor, if it can be read without waiting
+        auto clock = crash_clock_;
+        TscClock::UpdateWallTimeSnapshot(clock);
+
+        int thread = 0;
+        for(const Ring *ring = rings_.load(std::memory_order_acquire);
+            ring; ring = ring->next_) {
+
+            WriteToFd(fd, "--- Thread #");
+            WriteToFd(fd, ++thread);
+            WriteToFd(fd, " ---\n");
+
+            const std::uint64_t count = ring->count_.load(std::memory_order_acquire);
+            const std::uint64_t capacity = ring->records_.size();
+            for(auto i = (count > capacity) ? (count - capacity) : 0; i < count; ++i) {
+                const Record& r = ring->records_[i % capacity];
+                const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    clock.ToSystemTime(r.ticks_).time_since_epoch()).count();
+                WriteToFd(fd, static_cast<std::uint64_t>(ms / 1000));
+                WriteToFd(fd, ".");
+                WriteToFd(fd, static_cast<std::uint64_t>(ms % 1000), 3);
+                WriteToFd(fd, " ");
+                WriteToFd(fd, r.identity_.GetText().data(), r.identity_.GetText().size());
+                WriteToFd(fd, " ");
+                WriteToFd(fd, GetLevelName(r.level_));
+                WriteToFd(fd, ": ");
+                WriteToFd(fd, r.buf_.data(), r.buf_.size());
+                for(const auto& field : r.fields_) {
+                    WriteToFd(fd, " ");
+                    WriteToFd(fd, field);
+                }
+                WriteToFd(fd, "\n");
+            }
+        }
+
+        WriteToFd(fd, "*** End of flight recorder ***\n");
+    }
+
+    LogEventHandler::ptr_t LogFlightRecorder::Create(const std::size_t recordsPerThread,
+                                                     LogEventHandler::ptr_t target,
+                                                     const std::string& name,
+                                                     const LogLevel level,
+                                                     const filter_t filter)
+    {
+        return LogEventHandler::ptr_t(new LogFlightRecorder(recordsPerThread,
+                                                            std::move(target),
+                                                            name, level, filter));
+    }
+
+
+    //////////////////////////////////// Field /////////////////////////////////////
+
+    int Field::GetStreamIndex() noexcept
+    {
+        static const int index = std::ios_base::xalloc();
+        return index;
+    }
+
+    std::ostream& Field::Write(std::ostream& out) const
+    {
+        out << key_ << '=';
+
+        switch(type_) {
+        case FT_INT:
+            return out << int_;
+        case FT_UINT:
+            return out << uint_;
+        case FT_DOUBLE:
+            return out << double_;
+        case FT_BOOL:
+            return out << (bool_ ? "true" : "false");
+        case FT_STRING:
+            break;
+        }
+
+        const bool quote = str_.empty()
+            || std::any_of(str_.begin(), str_.end(), [](const char ch) {
+                return (static_cast<unsigned char>(ch) <= ' ') || (ch == '"')
+                    || (ch == '=') || (ch == 0x7f);
+            });
+
+        if (!quote) {
+            return out << str_;
+        }
+
+        out << '"';
+        for(const char ch : str_) {
+            const unsigned char uch = static_cast<unsigned char>(ch);
+            if ((ch == '"') || (ch == '\\')) {
+                out << '\\' << ch;
+            } else if ((uch < ' ') || (uch == 0x7f)) {
+                const std::ios::fmtflags saved = out.flags();
+                out << '%' << std::setw(2) << std::setfill('0') << std::hex << (unsigned int)uch;
+                out.flags(saved);
+            } else {
+                out << ch;
+            }
+        }
+        return out << '"';
+    }
+
+
+    //////////////////////////////////// RateLimiter /////////////////////////////////////
+
+    thread_local std::uint32_t Log::suppressed_;
+
+    bool RateLimiter::StartNewPeriod(const std::uint32_t now,
+                                     const std::uint32_t perSecond,
+                                     std::uint32_t& suppressed) noexcept
+    {
+        std::uint64_t state = state_.load(std::memory_order_relaxed);
+        // Only move forward. Another thread may have started a newer period.
+        while(static_cast<std::uint32_t>(state >> 32) < now) {
+            const std::uint64_t next = (static_cast<std::uint64_t>(now) << 32) | 1;
+            if (state_.compare_exchange_weak(state, next, std::memory_order_relaxed)) {
+                Log::suppressed_ = suppressed;
+                suppressed = 0;
+                return true;
+            }
+        }
+
+        // Another thread started the period
+        return Allow(perSecond, suppressed);
+    }
+
+    //////////////////////////////////// LogQueue /////////////////////////////////////
+
+    LogQueue::LogQueue(LogEventHandler::ptr_t handler,
+                       const std::size_t capacity,
+                       const OverflowPolicy policy,
+                       const unsigned sampleRate)
+        : LogEventHandler(handler->GetName(), handler->GetLevel(),
+                          handler->GetFilter())
+        , handler_(handler), capacity_(std::max<std::size_t>(capacity, 1))
+        , policy_(policy), sample_rate_(std::max(sampleRate, 1u))
+    {
+        queue_.reserve(capacity_);
+        thread_ = std::thread(&LogQueue::Run, this);
+    }
+
+    LogQueue::~LogQueue()
+    {
+        {
+            WAR_LOCK;
+            done_ = true;
+        }
+        have_data_.notify_one();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    void LogQueue::Submit(const SubmitInfo& info) noexcept
+    {
+        std::unique_lock<std::mutex> lock(lock_);
+
+        if (policy_ == OP_BLOCK) {
+            have_room_.wait(lock, [this] { return queue_.size() < capacity_; });
+        } else if (queue_.size() >= capacity_) {
+            ++dropped_;
+            return;
+        } else if ((policy_ == OP_SAMPLE) && (queue_.size() >= (capacity_ / 2))) {
+            if ((sample_counter_++ % sample_rate_) != 0) {
+                ++dropped_;
+                return;
+            }
+        }
+
+        queue_.push_back(info);
+        ++queued_;
+        const bool was_empty = (queue_.size() == 1);
+        lock.unlock();
+
+        if (was_empty) {
+            have_data_.notify_one();
+        }
+    }
+
+    void LogQueue::Flush() noexcept
+    {
+        handler_->Flush();
+    }
+
+    void LogQueue::FlushIfDue(const std::chrono::steady_clock::time_point now) noexcept
+    {
+        handler_->FlushIfDue(now);
+    }
+
+    std::chrono::milliseconds LogQueue::GetFlushInterval() const noexcept
+    {
+        return handler_->GetFlushInterval();
+    }
+
+    LogQueue::Stats LogQueue::GetStats() const noexcept
+    {
+        Stats stats;
+        stats.queued_ = queued_;
+        stats.written_ = written_;
+        stats.dropped_ = dropped_;
+        return stats;
+    }
+
+    std::size_t LogQueue::GetCount() const noexcept
+    {
+        WAR_LOCK;
+        return queue_.size();
+    }
+
+    void LogQueue::Run() noexcept
+    {
+        std::string name = "log-" + GetName();
+        name.resize(std::min<std::size_t>(name.size(), 15));
+        debug::SetThreadName(name);
+        ThreadIdentity::SetName(name);
+
+        // We swap the buffers, so that we write the records without
+        // holding the lock, and recycle the buffer for the next batch.
+        queue_t batch;
+        batch.reserve(capacity_);
+
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                have_data_.wait(lock, [this] { return done_ || !queue_.empty(); });
+                if (queue_.empty()) {
+                    WAR_ASSERT(done_);
+                    return;
+                }
+                batch.swap(queue_);
+                sample_counter_ = 0;
+            }
+            have_room_.notify_all();
+
+            for(const auto& si : batch) {
+                handler_->Submit(si);
+                ++written_;
+            }
+            batch.clear();
+        }
+    }
+
+    LogEventHandler::ptr_t LogQueue::Create(LogEventHandler::ptr_t handler,
+                                            const std::size_t capacity,
+                                            const OverflowPolicy policy,
+                                            const unsigned sampleRate)
+    {
+        return LogEventHandler::ptr_t(new LogQueue(handler, capacity,
+                                                   policy, sampleRate));
+    }
+
+
     //////////////////////////////////// Errno /////////////////////////////////////
 
     std::ostream& Errno::Explain(std::ostream& out) const
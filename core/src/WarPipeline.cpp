@@ -1,5 +1,7 @@
 
 
+#include <algorithm>
+#include <ctime>
 #include <string>
 #include <boost/asio.hpp>
 
@@ -11,6 +13,7 @@
 #include <warlib/WarPipeline.h>
 #include <warlib/WarLog.h>
 #include <warlib/debug_helper.h>
+#include <warlib/tsc_clock.h>
 
 #ifndef WIN32
 #   include <pthread.h>
@@ -20,6 +23,51 @@ using namespace std;
 using namespace war;
 using namespace std::string_literals;
 
+namespace {
+
+/*! CPU time used by the current thread, in nanoseconds */
+uint64_t GetThreadCpuTime() noexcept
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    timespec ts {};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL)
+            + static_cast<uint64_t>(ts.tv_nsec);
+    }
+#endif
+    return 0;
+}
+
+/*! Records the start and end of a task when tracing is enabled */
+class TraceTaskScope
+{
+public:
+    explicit TraceTaskScope(const char *name) noexcept
+    : enabled_{TaskTrace::IsEnabled()}
+    {
+        if (UNLIKELY(enabled_)) {
+            TaskTrace::Record(TaskTrace::ET_BEGIN, name);
+        }
+    }
+
+    ~TraceTaskScope()
+    {
+        if (UNLIKELY(enabled_)) {
+            TaskTrace::Record(TaskTrace::ET_END, nullptr);
+        }
+    }
+
+private:
+    const bool enabled_;
+};
+
+chrono::nanoseconds TicksToNanoseconds(const uint64_t ticks) noexcept
+{
+    return TscClock::ToDuration(ticks) - TscClock::ToDuration(0);
+}
+
+} // anonymous namespace
+
 std::ostream& operator << (std::ostream& o, const war::task_t& task)
 {
     return o << log::Esc(task.second);
@@ -31,6 +79,49 @@ std::ostream& operator << (std::ostream& o, const war::Pipeline& pipeline)
         << " #" << pipeline.GetId() << '}';
 }
 
+std::ostream& operator << (std::ostream& o, const war::TaskStats& stats)
+{
+    using namespace std::chrono;
+    return o << "{ task: " << log::Esc(stats.name ? stats.name : "")
+        << ", count: " << stats.count
+        << ", wall: " << duration_cast<microseconds>(stats.wall_time).count() << "us"
+        << ", max: " << duration_cast<microseconds>(stats.max_wall_time).count() << "us"
+        << ", cpu: " << duration_cast<microseconds>(stats.cpu_time).count() << "us }";
+}
+
+class war::Pipeline::TaskScope_
+{
+public:
+    TaskScope_(Pipeline& pipeline, const char *name) noexcept
+    : pipeline_{pipeline}, outermost_{pipeline.task_depth_++ == 0}
+    {
+        if (outermost_) {
+            start_ = TscClock::Ticks();
+            pipeline_.current_task_start_.store(start_, memory_order_relaxed);
+            pipeline_.current_task_.store(name ? name : "", memory_order_release);
+        }
+    }
+
+    ~TaskScope_()
+    {
+        --pipeline_.task_depth_;
+        if (outermost_) {
+            const auto end = TscClock::Ticks();
+            const auto ticks = (end > start_) ? end - start_ : 0;
+            if (ticks > pipeline_.max_task_ticks_.load(memory_order_relaxed)) {
+                pipeline_.max_task_ticks_.store(ticks, memory_order_relaxed);
+            }
+            // Last, so that whoever sees that the task is done also sees its duration
+            pipeline_.current_task_.store(nullptr, memory_order_release);
+        }
+    }
+
+private:
+    Pipeline& pipeline_;
+    const bool outermost_;
+    uint64_t start_ = 0;
+};
+
 war::Pipeline::Pipeline(const string &name,
                         int id,
                         const std::size_t capacity,
@@ -82,6 +173,7 @@ void war::Pipeline::Run(my_sync_t & sync, const int pinTo)
 
     try {
         debug::SetThreadName(name_);
+        log::ThreadIdentity::SetName(name_);
         work_guard_ = make_unique<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>>(boost::asio::make_work_guard(*io_context_));
     }
     catch (...) {
@@ -119,7 +211,10 @@ void war::Pipeline::Post(task_t &&task)
         << task;
 
     AddingTask();
-    boost::asio::post(*io_context_, bind(&war::Pipeline::ExecTask_, this, task, true, true));
+    boost::asio::post(*io_context_, bind(&war::Pipeline::ExecTask_, this,
+                                         TraceQueued_(WithLogContext_(std::move(task)),
+                                                      TaskTrace::ET_ENQUEUE),
+                                         true, true));
 }
 
 void war::Pipeline::Post(const task_t &task)
@@ -128,6 +223,139 @@ void war::Pipeline::Post(const task_t &task)
     Post(task_t(task));
 }
 
+void war::Pipeline::PostWithDeadline(task_t task,
+                                     const TscClock::time_point deadline,
+                                     on_expired_t onExpired)
+{
+    WAR_LOG_FUNCTION;
+
+    if (closing_) {
+        LOG_WARN_FN << "The pipeline " << log::Esc(name_)
+            << " is closing. Task dismissed: " << task;
+        return;
+    }
+
+    LOG_TRACE3_F_FN(log::LA_THREADS) << "Posting task with deadline on Pipeline "
+        << task;
+
+    AddingTask();
+    boost::asio::post(*io_context_, bind(&war::Pipeline::ExecTaskWithDeadline_, this,
+                                         TraceQueued_(WithLogContext_(std::move(task)),
+                                                      TaskTrace::ET_ENQUEUE),
+                                         deadline, std::move(onExpired)));
+}
+
+bool war::Pipeline::PostUnique(const string& key, task_t task, const UniqueMode mode)
+{
+    WAR_LOG_FUNCTION;
+
+    const auto name = task.second;
+    {
+        lock_guard<mutex> lock(unique_mutex_);
+        auto it = unique_tasks_.find(key);
+        if (it != unique_tasks_.end()) {
+            LOG_TRACE3_F_FN(log::LA_THREADS) << "Task " << task
+                << (mode == UM_REPLACE ? " replaces" : " is dropped in favor of")
+                << " pending task " << it->second << " with key " << log::Esc(key);
+            if (mode == UM_REPLACE) {
+                it->second = WithLogContext_(std::move(task));
+            }
+            return false;
+        }
+        unique_tasks_.emplace(key, WithLogContext_(std::move(task)));
+    }
+
+    try {
+        Post({[this, key] { RunUnique_(key); }, name});
+    } catch(...) {
+        lock_guard<mutex> lock(unique_mutex_);
+        unique_tasks_.erase(key);
+        throw;
+    }
+    return true;
+}
+
+void war::Pipeline::RunUnique_(const string& key)
+{
+    task_t task;
+    {
+        lock_guard<mutex> lock(unique_mutex_);
+        auto it = unique_tasks_.find(key);
+        if (it == unique_tasks_.end()) {
+            return;
+        }
+        task = std::move(it->second);
+        unique_tasks_.erase(it);
+    }
+    RunWithOwnLogContext_(task);
+}
+
+void war::Pipeline::PostDebounced(const string& key, task_t task,
+                                  const uint32_t milliSeconds)
+{
+    WAR_LOG_FUNCTION;
+
+    const auto now = TscClock::now();
+    lock_guard<mutex> lock(unique_mutex_);
+    auto& pending = debounced_tasks_[key];
+    pending.task = WithLogContext_(std::move(task));
+    pending.deadline = now + chrono::milliseconds(milliSeconds);
+
+    // Re-use the pending timer, unless the new deadline is before it
+    if (!pending.timer_id || (pending.deadline < pending.timer_due)) {
+        ArmDebounceTimer_(key, pending, now);
+    }
+}
+
+void war::Pipeline::ArmDebounceTimer_(const string& key, Debounced& pending,
+                                      const TscClock::time_point now)
+{
+    const auto delay = chrono::duration_cast<chrono::milliseconds>(
+        pending.deadline - now + chrono::milliseconds(1) - chrono::nanoseconds(1));
+    const auto id = ++debounce_timer_ids_;
+    pending.timer_id = id;
+    pending.timer_due = pending.deadline;
+    PostWithTimer({[this, key, id] {
+        RunDebounced_(key, id);
+    }, pending.task.second}, static_cast<uint32_t>(max<int64_t>(delay.count(), 1)));
+}
+
+void war::Pipeline::RunDebounced_(const string& key, const uint64_t timerId)
+{
+    task_t task;
+    {
+        lock_guard<mutex> lock(unique_mutex_);
+        auto it = debounced_tasks_.find(key);
+
+        // Another timer is responsible for the task
+        if ((it == debounced_tasks_.end()) || (it->second.timer_id != timerId)) {
+            return;
+        }
+
+        // Posted again after the timer was armed
+        const auto now = TscClock::now();
+        if (now < it->second.deadline) {
+            ArmDebounceTimer_(key, it->second, now);
+            return;
+        }
+
+        task = std::move(it->second.task);
+        debounced_tasks_.erase(it);
+    }
+    RunWithOwnLogContext_(task);
+}
+
+void war::Pipeline::RunWithOwnLogContext_(const task_t& task)
+{
+    if (UNLIKELY(log::LogContext::GetCurrent().IsActive())) {
+        // The context came from the thread that posted the wrapper
+        log::ScopedLogContext scope{log::LogContext{}};
+        task.first();
+        return;
+    }
+    task.first();
+}
+
 void war::Pipeline::PostSynchronously(const task_t& task) {
 
     std::promise<void> promise;
@@ -198,7 +426,9 @@ void war::Pipeline::PostWithTimer(task_t &&task,
     timer_t timer(new boost::asio::deadline_timer(*io_context_));
     timer->expires_from_now(boost::posix_time::milliseconds(milliSeconds));
     timer->async_wait(bind(&war::Pipeline::OnTimer_, this, timer,
-                           std::move(task), placeholders::_1));
+                           TraceQueued_(WithLogContext_(std::move(task)),
+                                        TaskTrace::ET_TIMER_ARM),
+                           placeholders::_1));
 }
 
 void war::Pipeline::Close()
@@ -229,6 +459,9 @@ void war::Pipeline::OnTimer_(const timer_t& /*timer*/, const task_t &task, const
 {
     WAR_LOG_FUNCTION;
     if (!ec) {
+        if (TaskTrace::IsEnabled()) {
+            TaskTrace::Record(TaskTrace::ET_TIMER_FIRE, task.second);
+        }
         ExecTask_(task, false);
     }
     else {
@@ -245,10 +478,40 @@ void war::Pipeline::AddingTask()
     }
 }
 
+war::task_t war::Pipeline::WithLogContext_(task_t task)
+{
+    const auto& context = log::LogContext::GetCurrent();
+    if (LIKELY(!context.IsActive())) {
+        return task;
+    }
+
+    return {[context, fn = std::move(task.first)]() {
+        log::ScopedLogContext scope(context);
+        fn();
+    }, task.second};
+}
+
+war::task_t war::Pipeline::TraceQueued_(task_t task, const TaskTrace::EventType type)
+{
+    if (LIKELY(!TaskTrace::IsEnabled())) {
+        return task;
+    }
+
+    const auto id = TaskTrace::NewId();
+    TaskTrace::Record(type, task.second, id);
+    return {[id, fn = std::move(task.first)]() {
+        TaskTrace::Record(TaskTrace::ET_DEQUEUE, nullptr, id);
+        fn();
+    }, task.second};
+}
+
 void war::Pipeline::ExecTask_(const task_t& task, bool counting, bool autoCatch)
 {
     WAR_LOG_FUNCTION;
 
+    // Don't let a task leave its log context behind for the next task
+    const log::ScopedLogContext log_context(log::LogContext::GetCurrent());
+
     if (counting) {
         --count_;
     }
@@ -260,22 +523,157 @@ void war::Pipeline::ExecTask_(const task_t& task, bool counting, bool autoCatch)
     }
     LOG_TRACE3_F_FN(log::LA_THREADS) << "Executing task " << task;
 
+    const TaskScope_ scope(*this, task.second);
+    const TraceTaskScope trace(task.second);
+    const bool with_stats = UNLIKELY(task_stats_enabled_.load(std::memory_order_relaxed));
+    const uint64_t start_ticks = with_stats ? TscClock::Ticks() : 0;
+    const uint64_t start_cpu_time = with_stats ? GetThreadCpuTime() : 0;
+
     if (autoCatch) {
         try {
             task.first();
             ++tasks_run_;
         }
-        WAR_CATCH_ALL_E;
+        WAR_CATCH_ALL_E_RL(10);
     } else {
         task.first();
         ++tasks_run_;
     }
+
+    if (with_stats) {
+        AddTaskStats_(task.second, start_ticks, start_cpu_time);
+    }
     LOG_TRACE3_F_FN(log::LA_THREADS) << "Finished executing task " << task;
 }
 
+void war::Pipeline::ExecTaskWithDeadline_(const task_t& task,
+                                          const TscClock::time_point deadline,
+                                          const on_expired_t& onExpired)
+{
+    WAR_LOG_FUNCTION;
+
+    if (LIKELY(closing_ || (TscClock::now() <= deadline))) {
+        ExecTask_(task, true, true);
+        return;
+    }
+
+    --count_;
+    ++expired_tasks_;
+    LOG_TRACE1_F_FN(log::LA_THREADS) << "Dropping task " << task
+        << ". The deadline passed "
+        << chrono::duration_cast<chrono::microseconds>(TscClock::now() - deadline).count()
+        << " microseconds ago.";
+
+    if (onExpired) {
+        try {
+            onExpired();
+        }
+        WAR_CATCH_ALL_E_RL(10);
+    }
+}
+
 void  war::Pipeline::WaitUntilClosed() const
 {
     LOG_TRACE1_FN << "Waiting for waiter_" << " on Pipeline " << log::Esc(name_);
     lock_guard<std::mutex> lock { waiter_ };
     LOG_TRACE1_FN << "Done waiting for waiter_" << " on Pipeline " << log::Esc(name_);
 }
+
+war::Pipeline::CurrentTask war::Pipeline::GetCurrentTask() const noexcept
+{
+    // If a new task starts while we read, we may get the name of the
+    // previous task with the start-time of the new one. That can make
+    // a task appear younger than it is, but never older.
+    CurrentTask current;
+    current.name = current_task_.load(memory_order_acquire);
+    if (current.name) {
+        current.started = TscClock::ToTimePoint(
+            current_task_start_.load(memory_order_relaxed));
+    }
+    return current;
+}
+
+chrono::nanoseconds war::Pipeline::GetMaxTaskDuration() const noexcept
+{
+    return TicksToNanoseconds(max_task_ticks_.load(memory_order_relaxed));
+}
+
+void war::Pipeline::AddTaskStats_(const char *name,
+                                  const uint64_t startTicks,
+                                  const uint64_t startCpuTime)
+{
+    const auto end_ticks = TscClock::Ticks();
+    const auto end_cpu_time = GetThreadCpuTime();
+    const auto ticks = (end_ticks > startTicks) ? end_ticks - startTicks : 0;
+
+    auto& counters = task_counters_[name];
+    ++counters.count;
+    counters.ticks += ticks;
+    counters.max_ticks = max(counters.max_ticks, ticks);
+    if (end_cpu_time > startCpuTime) {
+        counters.cpu_ns += end_cpu_time - startCpuTime;
+    }
+}
+
+void war::Pipeline::WithTaskCounters_(const std::function<void ()>& fn)
+{
+    if (IsPipelineThread()) {
+        fn();
+        return;
+    }
+
+    if (!closing_) {
+        auto done = make_shared<promise<void>>();
+        auto future = done->get_future();
+        boost::asio::post(*io_context_, [fn, done] {
+            fn();
+            done->set_value();
+        });
+
+        // If the pipeline is closed before our task gets to run,
+        // it will never run.
+        while(future.wait_for(chrono::milliseconds(10)) != future_status::ready) {
+            if (closed_) {
+                break;
+            }
+        }
+        if (future.wait_for(chrono::seconds(0)) == future_status::ready) {
+            return;
+        }
+    }
+
+    WaitUntilClosed();
+    fn();
+}
+
+task_stats_t war::Pipeline::GetTaskStats()
+{
+    WAR_LOG_FUNCTION;
+
+    task_stats_t stats;
+    WithTaskCounters_([this, &stats] {
+        stats.reserve(task_counters_.size());
+        for(const auto& it : task_counters_) {
+            TaskStats ts;
+            ts.name = it.first;
+            ts.count = it.second.count;
+            ts.wall_time = TicksToNanoseconds(it.second.ticks);
+            ts.max_wall_time = TicksToNanoseconds(it.second.max_ticks);
+            ts.cpu_time = chrono::nanoseconds(it.second.cpu_ns);
+            stats.push_back(ts);
+        }
+    });
+
+    sort(stats.begin(), stats.end(), [](const auto& left, const auto& right) {
+        return left.wall_time > right.wall_time;
+    });
+    return stats;
+}
+
+void war::Pipeline::ResetTaskStats()
+{
+    WAR_LOG_FUNCTION;
+    WithTaskCounters_([this] {
+        task_counters_.clear();
+    });
+}
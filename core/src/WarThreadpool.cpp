@@ -1,5 +1,6 @@
 
 #include <algorithm>
+#include <map>
 #include <thread>
 
 #include <boost/asio.hpp>
@@ -65,6 +66,23 @@ void war::Threadpool::PostWithTimer(task_t &&task, const std::uint32_t milliSeco
     GetAnyPipeline().PostWithTimer(task, milliSeconds);
 }
 
+void war::Threadpool::PostWithDeadline(task_t task,
+                                       const TscClock::time_point deadline,
+                                       Pipeline::on_expired_t onExpired)
+{
+    WAR_LOG_FUNCTION;
+    GetAnyPipeline().PostWithDeadline(std::move(task), deadline, std::move(onExpired));
+}
+
+uint64_t war::Threadpool::GetExpiredCount() const noexcept
+{
+    uint64_t count = 0;
+    for(const auto & pipeline: pool_) {
+        count += pipeline->GetExpiredCount();
+    }
+    return count;
+}
+
 Pipeline& war::Threadpool::GetAnyPipeline()
 {
     WAR_LOG_FUNCTION;
@@ -90,6 +108,53 @@ void war::Threadpool::WaitUntilClosed()
     JoinAll();
 }
 
+void war::Threadpool::EnableTaskStats(const bool enable)
+{
+    WAR_LOG_FUNCTION;
+    for(auto & pipeline: pool_) {
+        pipeline->EnableTaskStats(enable);
+    }
+}
+
+task_stats_t war::Threadpool::GetTaskStats()
+{
+    WAR_LOG_FUNCTION;
+
+    // The pipelines use the name-pointers as keys. Here we merge
+    // on the names, as the same name may come from different literals.
+    map<string, TaskStats> merged;
+    for(auto & pipeline: pool_) {
+        for(const auto& stats : pipeline->GetTaskStats()) {
+            auto& m = merged[stats.name ? stats.name : ""];
+            if (!m.name) {
+                m.name = stats.name;
+            }
+            m.count += stats.count;
+            m.wall_time += stats.wall_time;
+            m.max_wall_time = max(m.max_wall_time, stats.max_wall_time);
+            m.cpu_time += stats.cpu_time;
+        }
+    }
+
+    task_stats_t stats;
+    stats.reserve(merged.size());
+    for(const auto& it : merged) {
+        stats.push_back(it.second);
+    }
+    sort(stats.begin(), stats.end(), [](const auto& left, const auto& right) {
+        return left.wall_time > right.wall_time;
+    });
+    return stats;
+}
+
+void war::Threadpool::ResetTaskStats()
+{
+    WAR_LOG_FUNCTION;
+    for(auto & pipeline: pool_) {
+        pipeline->ResetTaskStats();
+    }
+}
+
 void war::Threadpool::JoinAll()
 {
     WAR_LOG_FUNCTION;
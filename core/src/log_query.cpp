@@ -0,0 +1,326 @@
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+#include <boost/utility/string_ref.hpp>
+
+#include <warlib/log_query.h>
+#include <warlib/error_handling.h>
+#include <warlib/impl.h>
+
+namespace war {
+namespace log {
+
+namespace {
+
+using time_point_t = LogQuery::time_point_t;
+
+struct Record
+{
+    time_point_t when;
+    LogLevel level = LL_FATAL;
+    boost::string_ref filter;
+    bool is_json = false;
+};
+
+bool ParseDigits(const char *p, const int len, int& value)
+{
+    value = 0;
+    for(int i = 0; i < len; ++i) {
+        if ((p[i] < '0') || (p[i] > '9')) {
+            return false;
+        }
+        value = (value * 10) + (p[i] - '0');
+    }
+    return true;
+}
+
+/*! Parse "YYYY-MM-DD?HH:MM:SS.mmm", where ? is the separator */
+bool ParseTime(const char *p, const char separator, std::tm& tm, int& ms)
+{
+    int year = 0, mon = 0;
+    if (!ParseDigits(p, 4, year) || (p[4] != '-')
+        || !ParseDigits(p + 5, 2, mon) || (p[7] != '-')
+        || !ParseDigits(p + 8, 2, tm.tm_mday) || (p[10] != separator)
+        || !ParseDigits(p + 11, 2, tm.tm_hour) || (p[13] != ':')
+        || !ParseDigits(p + 14, 2, tm.tm_min) || (p[16] != ':')
+        || !ParseDigits(p + 17, 2, tm.tm_sec) || (p[19] != '.')
+        || !ParseDigits(p + 20, 3, ms)) {
+        return false;
+    }
+    tm.tm_year = year - 1900;
+    tm.tm_mon = mon - 1;
+    return true;
+}
+
+/*! Days since 1970-01-01 for a date in the proleptic Gregorian calendar */
+std::int64_t DaysFromCivil(int y, const int m, const int d)
+{
+    y -= m <= 2;
+    const std::int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int yoe = static_cast<int>(y - era * 400);
+    const int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*! Converts local time to time_point.
+
+    mktime() is expensive, so we only call it once per hour in the log.
+*/
+class LocalTime
+{
+public:
+    time_point_t Convert(const std::tm& tm, const int ms)
+    {
+        if ((tm.tm_hour != hour_.tm_hour) || (tm.tm_mday != hour_.tm_mday)
+            || (tm.tm_mon != hour_.tm_mon) || (tm.tm_year != hour_.tm_year)) {
+            hour_ = tm;
+            hour_.tm_min = 0;
+            hour_.tm_sec = 0;
+            hour_.tm_isdst = -1;
+            std::tm copy = hour_;
+            start_of_hour_ = std::mktime(&copy);
+        }
+        return std::chrono::system_clock::from_time_t(start_of_hour_)
+            + std::chrono::seconds((tm.tm_min * 60) + tm.tm_sec)
+            + std::chrono::milliseconds(ms);
+    }
+
+private:
+    std::tm hour_ = {};
+    std::time_t start_of_hour_ = 0;
+};
+
+bool ParseLevel(const boost::string_ref name, LogLevel& level)
+{
+    for(int ll = LL_FATAL; ll <= LL_TRACE4; ++ll) {
+        if (name == LogEventHandler::GetLevelName(static_cast<LogLevel>(ll))) {
+            level = static_cast<LogLevel>(ll);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*! Parse a line from LogToJsonFile
+
+    {"ts":"2026-10-19T08:00:00.123Z","level":"NOTICE","filter":["GENERAL"],...
+*/
+bool ParseJson(const boost::string_ref line, Record& rec)
+{
+    static const boost::string_ref ts_prefix = "{\"ts\":\"";
+    static const boost::string_ref level_prefix = "Z\",\"level\":\"";
+    static const boost::string_ref filter_prefix = "\",\"filter\":[";
+
+    if (!line.starts_with(ts_prefix) || (line.size() < ts_prefix.size() + 24)) {
+        return false;
+    }
+
+    std::tm tm = {};
+    int ms = 0;
+    const char *p = line.data() + ts_prefix.size();
+    if (!ParseTime(p, 'T', tm, ms)) {
+        return false;
+    }
+    const auto days = DaysFromCivil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+    rec.when = time_point_t(std::chrono::duration_cast<time_point_t::duration>(
+        std::chrono::hours(days * 24 + tm.tm_hour)
+        + std::chrono::minutes(tm.tm_min)
+        + std::chrono::seconds(tm.tm_sec)
+        + std::chrono::milliseconds(ms)));
+
+    auto rest = line.substr(ts_prefix.size() + 23);
+    if (!rest.starts_with(level_prefix)) {
+        return false;
+    }
+    rest.remove_prefix(level_prefix.size());
+    const auto end_of_level = rest.find('"');
+    if ((end_of_level == rest.npos)
+        || !ParseLevel(rest.substr(0, end_of_level), rec.level)) {
+        return false;
+    }
+    rest.remove_prefix(end_of_level);
+    if (!rest.starts_with(filter_prefix)) {
+        return false;
+    }
+    rest.remove_prefix(filter_prefix.size());
+    rec.filter = rest.substr(0, rest.find(']'));
+    rec.is_json = true;
+    return true;
+}
+
+/*! Parse a line from LogToFile
+
+    2026-10-19 10:00:00.123 <thread> NOTICE: NETWORK|IO Message
+*/
+bool ParseText(const boost::string_ref line, Record& rec, LocalTime& local)
+{
+    if (line.size() < 26) {
+        return false;
+    }
+
+    std::tm tm = {};
+    int ms = 0;
+    if (!ParseTime(line.data(), ' ', tm, ms) || (line[23] != ' ')) {
+        return false;
+    }
+
+    // The thread-identity may contain spaces, so look for the level
+    // in front of the first ": "
+    auto rest = line.substr(24);
+    auto end_of_level = rest.find(": ");
+    if (end_of_level == rest.npos) {
+        return false;
+    }
+    auto level = rest.substr(0, end_of_level);
+    const auto start_of_level = level.rfind(' ');
+    if (start_of_level != level.npos) {
+        level.remove_prefix(start_of_level + 1);
+    }
+    if (!ParseLevel(level, rec.level)) {
+        return false;
+    }
+
+    rest.remove_prefix(end_of_level + 2);
+    auto filter = rest.substr(0, rest.find(' '));
+    const bool is_filter = !filter.empty() && (filter.front() != '|')
+        && (filter.back() != '|')
+        && std::all_of(filter.begin(), filter.end(), [](const char ch) {
+            return ((ch >= 'A') && (ch <= 'Z')) || ((ch >= '0') && (ch <= '9'))
+                || (ch == '_') || (ch == '|');
+        });
+    rec.filter = is_filter ? filter : boost::string_ref();
+    rec.when = local.Convert(tm, ms);
+    rec.is_json = false;
+    return true;
+}
+
+bool HasCategory(const Record& rec, const std::string& category)
+{
+    if (!rec.is_json && rec.filter.empty()) {
+        return category == "GENERAL";
+    }
+
+    const char separator = rec.is_json ? ',' : '|';
+    auto filter = rec.filter;
+    while(!filter.empty()) {
+        const auto end = std::min(filter.find(separator), filter.size());
+        auto name = filter.substr(0, end);
+        if (rec.is_json && (name.size() >= 2)) {
+            name = name.substr(1, name.size() - 2);
+        }
+        if (name == category) {
+            return true;
+        }
+        filter.remove_prefix(std::min(end + 1, filter.size()));
+    }
+    return false;
+}
+
+bool IsSelected(const Record& rec, const LogQuery& query)
+{
+    if ((rec.when < query.from_) || (rec.when > query.to_)
+        || (rec.level > query.level_)) {
+        return false;
+    }
+
+    if (query.categories_.empty()) {
+        return true;
+    }
+
+    for(const auto& category : query.categories_) {
+        if (HasCategory(rec, category)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+std::vector<std::pair<LogQuery::time_point_t, std::uint64_t>>
+ReadLogIndex(const std::string& path)
+{
+    std::vector<std::pair<time_point_t, std::uint64_t>> index;
+    std::ifstream in(path + ".idx");
+    long long when = 0;
+    unsigned long long offset = 0;
+    while(in >> when >> offset) {
+        index.emplace_back(time_point_t(std::chrono::duration_cast<time_point_t::duration>(
+            std::chrono::milliseconds(when))), offset);
+    }
+    return index;
+}
+
+std::uint64_t QueryLogFile(const std::string& path,
+                           const LogQuery& query,
+                           std::ostream& out)
+{
+    std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+    if (!in.is_open()) {
+        WAR_EXCEPTION_TYPE(ExceptionNotFound, "Failed to open log-file")
+            << boost::errinfo_file_name(path.c_str())
+            << boost::errinfo_errno(errno);
+        WAR_EXCEPTION_THROW;
+    }
+
+    std::uint64_t start = 0;
+    std::uint64_t stop = std::numeric_limits<std::uint64_t>::max();
+
+    // Records from different threads may be slightly out of order in
+    // the log, so we start one index-entry earlier, and stop one
+    // entry later, than the time-stamps in the index suggest.
+    const auto index = ReadLogIndex(path);
+    if (!index.empty()) {
+        const auto first = std::find_if(index.begin(), index.end(),
+            [&](const auto& entry) { return entry.first >= query.from_; });
+        const auto skip = std::distance(index.begin(), first);
+        if (skip >= 2) {
+            start = index[skip - 2].second;
+        }
+
+        const auto last = std::find_if(first, index.end(),
+            [&](const auto& entry) { return entry.first > query.to_; });
+        const auto past = std::distance(index.begin(), last) + 1;
+        if (past < static_cast<std::ptrdiff_t>(index.size())) {
+            stop = index[past].second;
+        }
+    }
+
+    if (start) {
+        in.seekg(static_cast<std::streamoff>(start));
+    }
+
+    LocalTime local;
+    std::uint64_t offset = start;
+    std::uint64_t count = 0;
+    bool selected = false;
+    std::string line;
+    while((offset < stop) && std::getline(in, line)) {
+        offset += line.size() + 1;
+
+        Record rec;
+        if (ParseJson(line, rec) || ParseText(line, rec, local)) {
+            selected = IsSelected(rec, query);
+            if (selected) {
+                ++count;
+            }
+        }
+
+        // Continuation lines belong to the record before them
+        if (selected) {
+            out << line << '\n';
+        }
+    }
+
+    return count;
+}
+
+} // log
+} // war
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <iterator>
+
+#include <warlib/rate_limited_executor.h>
+#include <warlib/tsc_clock.h>
+#include <warlib/WarLog.h>
+
+using namespace std;
+
+namespace war {
+
+class RateLimitedExecutor::State : public enable_shared_from_this<State>
+{
+public:
+    using post_t = function<void (task_t&& task)>;
+
+    State(Pipeline& timerPipeline, post_t post, const double rate,
+          const double burst, const size_t capacity)
+    : timer_pipeline_{timerPipeline}, post_{move(post)}
+    , rate_{rate}, burst_{burst}, capacity_{capacity}
+    , tokens_{burst}, last_refill_{TscClock::now()}
+    {
+        if (!(rate > 0) || !(burst >= 1)) {
+            WAR_THROW_T(ExceptionOutOfRange, "The rate must be > 0 and burst >= 1");
+        }
+    }
+
+    void Post(task_t&& task)
+    {
+        bool run_now = false;
+        uint32_t delay = 0;
+        {
+            lock_guard<mutex> lock(mutex_);
+            const auto now = TscClock::now();
+            Refill(now);
+            if (queue_.empty() && (tokens_ >= 1)) {
+                tokens_ -= 1;
+                run_now = true;
+            } else {
+                if (queue_.size() >= capacity_) {
+                    WAR_THROW_T(ExceptionCapacityExceeded, "The rate-limited queue is full");
+                }
+                queue_.push_back({move(task), now});
+                delay = ArmTimer();
+            }
+        }
+
+        if (run_now) {
+            try {
+                post_(move(task));
+            } catch(...) {
+                // The task was not released, so give the token back
+                lock_guard<mutex> lock(mutex_);
+                tokens_ = min(burst_, tokens_ + 1);
+                throw;
+            }
+            lock_guard<mutex> lock(mutex_);
+            ++stats_.released;
+        } else if (delay) {
+            StartTimer(delay);
+        }
+    }
+
+    size_t GetQueueDepth() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return queue_.size();
+    }
+
+    Stats GetStats() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto stats = stats_;
+        stats.queue_depth = queue_.size();
+        return stats;
+    }
+
+private:
+    struct Queued {
+        task_t task;
+        TscClock::time_point queued;
+    };
+
+    void Refill(const TscClock::time_point now)
+    {
+        const chrono::duration<double> elapsed = now - last_refill_;
+        tokens_ = min(burst_, tokens_ + (elapsed.count() * rate_));
+        last_refill_ = now;
+    }
+
+    /*! Returns the delay in milliseconds if a new timer must be started,
+        or 0 if a timer is already armed.
+    */
+    uint32_t ArmTimer()
+    {
+        if (timer_armed_) {
+            return 0;
+        }
+        timer_armed_ = true;
+        const auto ms = ceil(((1.0 - tokens_) / rate_) * 1000.0);
+        return static_cast<uint32_t>(max(ms, 1.0));
+    }
+
+    void StartTimer(const uint32_t delay)
+    {
+        timer_pipeline_.PostWithTimer({[self = shared_from_this()] {
+            self->OnTimer();
+        }, "Rate limit timer"}, delay);
+    }
+
+    void OnTimer()
+    {
+        deque<Queued> ready;
+        uint32_t delay = 0;
+        {
+            lock_guard<mutex> lock(mutex_);
+            timer_armed_ = false;
+            Refill(TscClock::now());
+            while(!queue_.empty() && (tokens_ >= 1)) {
+                tokens_ -= 1;
+                ready.push_back(move(queue_.front()));
+                queue_.pop_front();
+            }
+            if (!queue_.empty()) {
+                delay = ArmTimer();
+            }
+        }
+
+        if (delay) {
+            StartTimer(delay);
+        }
+
+        const auto now = TscClock::now();
+        while(!ready.empty()) {
+            try {
+                post_(move(ready.front().task));
+            } catch(const Pipeline::ExceptionCapacityExceeded&) {
+                Requeue(ready);
+                return;
+            }
+
+            const auto wait = chrono::duration_cast<chrono::nanoseconds>(now - ready.front().queued);
+            ready.pop_front();
+
+            lock_guard<mutex> lock(mutex_);
+            ++stats_.released;
+            ++stats_.delayed;
+            stats_.total_wait += wait;
+            stats_.max_wait = max(stats_.max_wait, wait);
+        }
+    }
+
+    /*! Put tasks the pipeline had no room for back at the head of the
+        queue, with their tokens, and try again later.
+    */
+    void Requeue(deque<Queued>& ready)
+    {
+        uint32_t delay = 0;
+        {
+            lock_guard<mutex> lock(mutex_);
+            LOG_DEBUG_FN << "The pipeline is full. Re-queuing " << ready.size() << " tasks";
+            tokens_ = min(burst_, tokens_ + static_cast<double>(ready.size()));
+            stats_.requeued += ready.size();
+            queue_.insert(queue_.begin(), make_move_iterator(ready.begin()),
+                          make_move_iterator(ready.end()));
+            if (!timer_armed_) {
+                timer_armed_ = true;
+                delay = retry_delay_ms;
+            }
+        }
+
+        if (delay) {
+            StartTimer(delay);
+        }
+    }
+
+    // How long we wait before we try a full pipeline again
+    static constexpr uint32_t retry_delay_ms = 10;
+
+    Pipeline& timer_pipeline_;
+    const post_t post_;
+    const double rate_;
+    const double burst_;
+    const size_t capacity_;
+    mutable mutex mutex_;
+    double tokens_;
+    TscClock::time_point last_refill_;
+    deque<Queued> queue_;
+    bool timer_armed_ = false;
+    Stats stats_;
+};
+
+RateLimitedExecutor::RateLimitedExecutor(Pipeline& pipeline, const double rate,
+                                         const double burst, const size_t capacity)
+: state_{make_shared<State>(pipeline, [&pipeline](task_t&& task) {
+        pipeline.Post(move(task));
+    }, rate, burst, capacity)}
+{
+}
+
+RateLimitedExecutor::RateLimitedExecutor(Threadpool& pool, const double rate,
+                                         const double burst, const size_t capacity)
+: state_{make_shared<State>(pool.GetAnyPipeline(), [&pool](task_t&& task) {
+        pool.Post(move(task));
+    }, rate, burst, capacity)}
+{
+}
+
+void RateLimitedExecutor::Post(task_t task)
+{
+    WAR_LOG_FUNCTION;
+    state_->Post(move(task));
+}
+
+size_t RateLimitedExecutor::GetQueueDepth() const
+{
+    return state_->GetQueueDepth();
+}
+
+RateLimitedExecutor::Stats RateLimitedExecutor::GetStats() const
+{
+    return state_->GetStats();
+}
+
+} // namespace war
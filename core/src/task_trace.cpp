@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <warlib/task_trace.h>
+#include <warlib/tsc_clock.h>
+#include <warlib/WarLog.h>
+
+using namespace std;
+
+namespace war {
+
+/*! Ring-buffer with the events from one thread
+
+    Only the owning thread writes to it, and readers copy the events
+    without stopping the writer, like a seqlock: written_ is the
+    sequence. The fields of a slot are relaxed atomics, so that a
+    reader can read a slot while it's overwritten. Copy() finds and
+    drops the events that may have been overwritten.
+*/
+class TaskTrace::Buffer
+{
+public:
+    Buffer(const size_t size, const unsigned tid, string name)
+    : tid_{tid}
+    {
+        Reset(size, move(name));
+    }
+
+    void Add(const EventType type, const char *name, const uint64_t id) noexcept
+    {
+        const auto pos = written_.load(memory_order_relaxed);
+        // Don't let the writes to the slot be seen before the previous update of written_
+        atomic_thread_fence(memory_order_release);
+        auto& slot = events_[pos % size_];
+        slot.ticks.store(TscClock::Ticks(), memory_order_relaxed);
+        slot.name.store(name, memory_order_relaxed);
+        slot.id.store(id, memory_order_relaxed);
+        slot.type.store(type, memory_order_relaxed);
+        written_.store(pos + 1, memory_order_release);
+    }
+
+    /*! Copy the events that are still in the buffer, oldest first */
+    vector<Event> Copy() const
+    {
+        const uint64_t size = size_;
+        const auto end = written_.load(memory_order_acquire);
+        auto begin = (end > size) ? end - size : 0;
+
+        vector<Event> events;
+        events.reserve(end - begin);
+        for(auto pos = begin; pos < end; ++pos) {
+            const auto& slot = events_[pos % size];
+            Event ev;
+            ev.ticks = slot.ticks.load(memory_order_relaxed);
+            ev.name = slot.name.load(memory_order_relaxed);
+            ev.id = slot.id.load(memory_order_relaxed);
+            ev.type = slot.type.load(memory_order_relaxed);
+            events.push_back(ev);
+        }
+
+        // Skip the events that the thread may have overwritten
+        // while we copied them.
+        atomic_thread_fence(memory_order_acquire);
+        const auto after = written_.load(memory_order_relaxed);
+        const auto first_valid = (after + 1 > size) ? after + 1 - size : 0;
+        if (first_valid > begin) {
+            const auto skip = min<uint64_t>(first_valid - begin, events.size());
+            events.erase(events.begin(), events.begin() + static_cast<ptrdiff_t>(skip));
+        }
+        return events;
+    }
+
+    void Clear() noexcept { written_.store(0, memory_order_release); }
+
+    /*! Prepare the buffer for a new thread. Nobody else may use it. */
+    void Reset(const size_t size, string name)
+    {
+        if (size != size_) {
+            events_.reset(new Slot[size]);
+            size_ = size;
+        }
+        name_ = move(name);
+        Clear();
+    }
+
+    unsigned GetTid() const noexcept { return tid_; }
+    const string& GetName() const noexcept { return name_; }
+
+private:
+    struct Slot {
+        atomic<uint64_t> ticks{0};
+        atomic<const char *> name{nullptr};
+        atomic<uint64_t> id{0};
+        atomic<EventType> type{ET_BEGIN};
+    };
+
+    unique_ptr<Slot[]> events_;
+    size_t size_ = 0;
+    atomic<uint64_t> written_{0};
+    const unsigned tid_;
+    string name_;
+};
+
+/*! All the buffers. Buffers from threads that have exited are kept
+    (with their events) in free, until another thread needs one.
+*/
+struct TaskTrace::Registry
+{
+    mutex lock;
+    vector<unique_ptr<Buffer>> buffers;
+    vector<Buffer *> free;
+    size_t events_per_thread = 32 * 1024;
+};
+
+namespace {
+
+/*! Chrome wants the times in micro-seconds */
+void WriteMicroseconds(ostream& out, const chrono::nanoseconds duration)
+{
+    const auto ns = duration.count();
+    const auto frac = ns % 1000;
+    out << ns / 1000 << '.' << (frac < 100 ? "0" : "") << (frac < 10 ? "0" : "") << frac;
+}
+
+class Writer
+{
+public:
+    explicit Writer(ostream& out) : out_{out} {}
+
+    /*! Write the fields that all events have, and leave the object open */
+    ostream& Begin(const char phase, const char *name, const char *category,
+                   const uint64_t ticks, const unsigned tid)
+    {
+        out_ << (count_++ ? ",\n" : "\n") << "{\"ph\":\"" << phase << "\",\"name\":";
+        log::LogToJsonFile::WriteJsonString(out_, name ? name : "");
+        out_ << ",\"cat\":\"" << category << "\",\"pid\":1,\"tid\":" << tid << ",\"ts\":";
+        WriteMicroseconds(out_, TscClock::ToDuration(ticks));
+        ++events_;
+        return out_;
+    }
+
+    void Metadata(const char *name, const unsigned tid, const string& value)
+    {
+        out_ << (count_++ ? ",\n" : "\n") << "{\"ph\":\"M\",\"name\":\"" << name
+            << "\",\"pid\":1,\"tid\":" << tid << ",\"args\":{\"name\":";
+        log::LogToJsonFile::WriteJsonString(out_, value);
+        out_ << "}}";
+    }
+
+    ostream& Out() noexcept { return out_; }
+
+    size_t GetEvents() const noexcept { return events_; }
+
+private:
+    ostream& out_;
+    size_t count_ = 0;
+    size_t events_ = 0;
+};
+
+void WriteEvents(Writer& writer, const unsigned tid,
+                 const vector<TaskTrace::Event>& events)
+{
+    // Tasks are written as complete events, so that a task that began
+    // before the window (or was overwritten) doesn't confuse the viewer.
+    // Tasks can run inside other tasks (Dispatch), so we use a stack.
+    vector<const TaskTrace::Event *> running;
+
+    for(const auto& ev : events) {
+        switch(ev.type) {
+        case TaskTrace::ET_BEGIN:
+            running.push_back(&ev);
+            break;
+        case TaskTrace::ET_END:
+            if (!running.empty()) {
+                const auto begin = running.back();
+                running.pop_back();
+                writer.Begin('X', begin->name, "task", begin->ticks, tid) << ",\"dur\":";
+                WriteMicroseconds(writer.Out(), TscClock::ToDuration(ev.ticks)
+                    - TscClock::ToDuration(begin->ticks));
+                writer.Out() << '}';
+            }
+            break;
+        case TaskTrace::ET_ENQUEUE:
+        case TaskTrace::ET_TIMER_ARM:
+            // The flow needs a slice to start from
+            writer.Begin('X', ev.name,
+                         ev.type == TaskTrace::ET_ENQUEUE ? "enqueue" : "timer",
+                         ev.ticks, tid) << ",\"dur\":0}";
+            writer.Begin('s', "flow", "flow", ev.ticks, tid) << ",\"id\":" << ev.id << '}';
+            break;
+        case TaskTrace::ET_DEQUEUE:
+            writer.Begin('f', "flow", "flow", ev.ticks, tid) << ",\"id\":" << ev.id
+                << ",\"bp\":\"e\"}";
+            break;
+        case TaskTrace::ET_TIMER_FIRE:
+            writer.Begin('i', ev.name, "timer", ev.ticks, tid) << ",\"s\":\"t\"}";
+            break;
+        case TaskTrace::ET_RESUME:
+            writer.Begin('i', ev.name, "coroutine", ev.ticks, tid) << ",\"s\":\"t\"}";
+            break;
+        }
+    }
+
+    // Tasks that are still running
+    for(const auto begin : running) {
+        writer.Begin('B', begin->name, "task", begin->ticks, tid) << '}';
+    }
+}
+
+} // anonymous namespace
+
+atomic<bool> TaskTrace::enabled_{false};
+atomic<uint64_t> TaskTrace::last_id_{0};
+
+void TaskTrace::Start(const size_t eventsPerThread)
+{
+    auto& registry = GetRegistry();
+    {
+        lock_guard<mutex> lock(registry.lock);
+        registry.events_per_thread = max<size_t>(eventsPerThread, 16);
+    }
+    enabled_.store(true, memory_order_relaxed);
+}
+
+void TaskTrace::Stop() noexcept
+{
+    enabled_.store(false, memory_order_relaxed);
+}
+
+void TaskTrace::Clear() noexcept
+{
+    auto& registry = GetRegistry();
+    lock_guard<mutex> lock(registry.lock);
+    for(auto& buffer : registry.buffers) {
+        buffer->Clear();
+    }
+}
+
+void TaskTrace::Record(const EventType type, const char *name, const uint64_t id) noexcept
+{
+    if (auto buffer = GetBuffer()) {
+        buffer->Add(type, name, id);
+    }
+}
+
+TaskTrace::Registry& TaskTrace::GetRegistry()
+{
+    static Registry registry;
+    return registry;
+}
+
+TaskTrace::Buffer *TaskTrace::GetBuffer() noexcept
+{
+    // Gives the buffer back to the registry when the thread exits
+    struct Lease {
+        Buffer *buffer = nullptr;
+
+        ~Lease() {
+            if (buffer) {
+                auto& registry = GetRegistry();
+                lock_guard<mutex> lock(registry.lock);
+                registry.free.push_back(buffer);
+            }
+        }
+    };
+
+    static thread_local Lease lease;
+    if (LIKELY(lease.buffer != nullptr)) {
+        return lease.buffer;
+    }
+
+    try {
+        const auto& identity = log::ThreadIdentity::GetCurrent();
+        auto name = identity.IsEmpty() ? string("Thread") : identity.GetText().to_string();
+
+        auto& registry = GetRegistry();
+        lock_guard<mutex> lock(registry.lock);
+        if (!registry.free.empty()) {
+            auto buffer = registry.free.back();
+            buffer->Reset(registry.events_per_thread, move(name));
+            registry.free.pop_back();
+            lease.buffer = buffer;
+        } else {
+            registry.buffers.push_back(make_unique<Buffer>(
+                registry.events_per_thread,
+                static_cast<unsigned>(registry.buffers.size() + 1),
+                move(name)));
+            lease.buffer = registry.buffers.back().get();
+        }
+    } catch(const std::exception&) {
+        return nullptr;
+    }
+    return lease.buffer;
+}
+
+size_t TaskTrace::GetBufferCount()
+{
+    auto& registry = GetRegistry();
+    lock_guard<mutex> lock(registry.lock);
+    return registry.buffers.size();
+}
+
+size_t TaskTrace::WriteChromeTrace(ostream& out, const chrono::milliseconds window)
+{
+    struct Copied {
+        unsigned tid;
+        string name;
+        vector<Event> events;
+    };
+
+    // A buffer can be given to a new thread when the lock is not held
+    vector<Copied> copies;
+    {
+        auto& registry = GetRegistry();
+        lock_guard<mutex> lock(registry.lock);
+        for(const auto& buffer : registry.buffers) {
+            copies.push_back({buffer->GetTid(), buffer->GetName(), buffer->Copy()});
+        }
+    }
+
+    const auto now = TscClock::ToDuration(TscClock::Ticks());
+
+    Writer writer(out);
+    out << "{\"traceEvents\":[";
+    writer.Metadata("process_name", 0, "warlib");
+
+    for(auto& copy : copies) {
+        auto& events = copy.events;
+        if (window.count()) {
+            const auto first = find_if(events.begin(), events.end(), [&](const auto& ev) {
+                return TscClock::ToDuration(ev.ticks) >= (now - window);
+            });
+            events.erase(events.begin(), first);
+        }
+        if (events.empty()) {
+            continue;
+        }
+
+        writer.Metadata("thread_name", copy.tid, copy.name);
+        WriteEvents(writer, copy.tid, events);
+    }
+
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return writer.GetEvents();
+}
+
+} // namespace war
@@ -0,0 +1,259 @@
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   include <cpuid.h>
+#endif
+
+#include <warlib/tsc_clock.h>
+
+using namespace std;
+
+namespace war {
+
+namespace {
+
+    bool HasInvariantTsc() noexcept
+    {
+#if defined(_MSC_VER) && defined(WAR_WITH_TSC)
+        int regs[4] = {};
+        __cpuid(regs, 0x80000000);
+        if (static_cast<unsigned>(regs[0]) < 0x80000007u) {
+            return false;
+        }
+        __cpuid(regs, 0x80000007);
+        return (regs[3] & (1 << 8)) != 0;
+#elif defined(WAR_WITH_TSC)
+        unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+        if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007u) {
+            return false;
+        }
+        __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        return (edx & (1u << 8)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    int64_t SteadyNanoseconds() noexcept
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    int64_t SystemNanoseconds() noexcept
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    /* The tick rate, and the steady_clock time at the reference tick.
+     * Set once, so that the clock stays monotonic.
+     */
+    struct Calibration {
+        uint64_t ticks0 = 0;
+        int64_t steady0 = 0;
+        double ns_per_tick = 1.0;
+    };
+
+    /* Read the ticks and steady_clock at the same moment. If the thread
+     * is preempted between the reads, the 5 ms calibration can be off by
+     * a percent or so, so retry until the reads are close together.
+     */
+    void Sample(uint64_t& ticks, int64_t& steady_ns) noexcept
+    {
+        int64_t best = numeric_limits<int64_t>::max();
+        for(int i = 0; (i < 100) && (best > 1000); ++i) {
+            const auto before = SteadyNanoseconds();
+            const auto t = TscClock::Ticks();
+            const auto after = SteadyNanoseconds();
+            if ((after - before) < best) {
+                best = after - before;
+                ticks = t;
+                steady_ns = before + ((after - before) / 2);
+            }
+        }
+    }
+
+    const Calibration& GetCalibration() noexcept
+    {
+        static const Calibration calibration = [] {
+            Calibration c;
+            if (!TscClock::IsUsingTsc()) {
+                return c;
+            }
+
+            // Measure the rate over a few milliseconds
+            uint64_t start_ticks = 0, end_ticks = 0;
+            int64_t start_ns = 0, end_ns = 0;
+            Sample(start_ticks, start_ns);
+            do {
+                this_thread::yield();
+                Sample(end_ticks, end_ns);
+            } while((end_ns - start_ns) < 5000000);
+
+            c.ticks0 = start_ticks;
+            c.steady0 = start_ns;
+            c.ns_per_tick = static_cast<double>(end_ns - start_ns)
+                / static_cast<double>(end_ticks - start_ticks);
+            return c;
+        }();
+
+        return calibration;
+    }
+
+    /* The wall time at a tick. Updated regularly to follow adjustments
+     * of the system clock. Protected by a sequence-lock, so that the
+     * readers don't have to lock.
+     */
+    struct Anchor {
+        atomic<uint32_t> sequence {0};
+        atomic<uint64_t> ticks {0};
+        atomic<int64_t> system_ns {0};
+        mutex lock;
+    };
+
+    Anchor anchor;
+
+    constexpr int64_t anchor_refresh_ns = 1000000000;
+
+    void UpdateAnchor() noexcept
+    {
+        unique_lock<mutex> lock(anchor.lock, try_to_lock);
+        if (!lock.owns_lock()) {
+            return; // Someone else is doing it
+        }
+
+        const auto ticks = TscClock::Ticks();
+        const auto system_ns = SystemNanoseconds();
+
+        const auto seq = anchor.sequence.load(memory_order_relaxed);
+        anchor.sequence.store(seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        anchor.ticks.store(ticks, memory_order_relaxed);
+        anchor.system_ns.store(system_ns, memory_order_relaxed);
+        anchor.sequence.store(seq + 2, memory_order_release);
+    }
+
+    int64_t TicksToNanoseconds(const int64_t ticks) noexcept
+    {
+        return static_cast<int64_t>(static_cast<double>(ticks)
+            * GetCalibration().ns_per_tick);
+    }
+
+    /* Read the anchor. May give up if a writer is in progress (we may be
+     * called from a signal handler that interrupted the writer), and
+     * use whatever was read.
+     *
+     * Returns true if the values are consistent.
+     */
+    bool ReadAnchor(uint64_t& ticks, int64_t& system_ns) noexcept
+    {
+        for(int i = 0; i < 100; ++i) {
+            const auto seq = anchor.sequence.load(memory_order_acquire);
+            ticks = anchor.ticks.load(memory_order_relaxed);
+            system_ns = anchor.system_ns.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if (!(seq & 1) && (seq == anchor.sequence.load(memory_order_relaxed))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+} // anonymous namespace
+
+std::atomic<int> TscClock::mode_ {TscClock::M_UNKNOWN};
+
+uint64_t TscClock::SlowTicks() noexcept
+{
+    if (mode_.load(memory_order_relaxed) == M_UNKNOWN) {
+        mode_.store(HasInvariantTsc() ? M_TSC : M_STEADY, memory_order_relaxed);
+        return Ticks();
+    }
+
+    return static_cast<uint64_t>(SteadyNanoseconds());
+}
+
+TscClock::duration TscClock::ToDuration(const uint64_t ticks) noexcept
+{
+    if (!IsUsingTsc()) {
+        return duration(static_cast<rep>(ticks));
+    }
+
+    const auto& c = GetCalibration();
+    return duration(c.steady0 + TicksToNanoseconds(
+        static_cast<int64_t>(ticks - c.ticks0)));
+}
+
+chrono::system_clock::time_point TscClock::ToSystemTime(const uint64_t ticks) noexcept
+{
+    uint64_t anchor_ticks = 0;
+    int64_t anchor_ns = 0;
+    ReadAnchor(anchor_ticks, anchor_ns);
+
+    if (!anchor_ticks
+        || (TicksToNanoseconds(static_cast<int64_t>(Ticks() - anchor_ticks)) > anchor_refresh_ns)) {
+        UpdateAnchor();
+        ReadAnchor(anchor_ticks, anchor_ns);
+    }
+
+    const auto ns = anchor_ns + TicksToNanoseconds(static_cast<int64_t>(ticks - anchor_ticks));
+    return chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(
+        chrono::nanoseconds(ns)));
+}
+
+TscClock::WallTimeSnapshot TscClock::GetWallTimeSnapshot() noexcept
+{
+    // Make sure we have a fresh anchor
+    ToSystemTime(Ticks());
+
+    WallTimeSnapshot snapshot;
+    snapshot.ns_per_tick = GetCalibration().ns_per_tick;
+    ReadAnchor(snapshot.ticks, snapshot.system_ns);
+    return snapshot;
+}
+
+void TscClock::UpdateWallTimeSnapshot(WallTimeSnapshot& snapshot) noexcept
+{
+    uint64_t ticks = 0;
+    int64_t system_ns = 0;
+    if (ReadAnchor(ticks, system_ns) && ticks) {
+        snapshot.ticks = ticks;
+        snapshot.system_ns = system_ns;
+    }
+}
+
+uint64_t TscClock::FromSystemTime(const chrono::system_clock::time_point when) noexcept
+{
+    // Make sure we have an anchor
+    ToSystemTime(Ticks());
+
+    uint64_t anchor_ticks = 0;
+    int64_t anchor_ns = 0;
+    ReadAnchor(anchor_ticks, anchor_ns);
+
+    const auto ns = chrono::duration_cast<chrono::nanoseconds>(when.time_since_epoch()).count();
+    return anchor_ticks + static_cast<uint64_t>(static_cast<int64_t>(
+        static_cast<double>(ns - anchor_ns) / GetCalibration().ns_per_tick));
+}
+
+void TscClock::Calibrate() noexcept
+{
+    GetCalibration();
+    UpdateAnchor();
+}
+
+bool TscClock::IsUsingTsc() noexcept
+{
+    Ticks(); // Make sure the mode is set
+    return mode_.load(memory_order_relaxed) == M_TSC;
+}
+
+double TscClock::GetTicksPerNanosecond() noexcept
+{
+    return 1.0 / GetCalibration().ns_per_tick;
+}
+
+} // namespace
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <atomic>
+#include <sstream>
+
+#if defined(__linux__) && defined(__GLIBC__)
+#   define WAR_WITH_STACK_TRACE 1
+#   include <csignal>
+#   include <cstdlib>
+#   include <execinfo.h>
+#   include <pthread.h>
+#endif
+
+#include <warlib/watchdog.h>
+#include <warlib/WarLog.h>
+
+using namespace std;
+
+namespace war {
+
+namespace {
+
+#ifdef WAR_WITH_STACK_TRACE
+
+/* One capture at the time. The watchdog thread sets the target thread
+ * and a new sequence number in requested_, and signals the thread. The
+ * signal handler claims the request by clearing requested_, writes the
+ * frames, and sets completed_ to the sequence number.
+ *
+ * If the watchdog gives up before the handler has claimed the request,
+ * it withdraws it, so that a late handler leaves frames_ alone.
+ */
+constexpr int max_frames = 64;
+void *frames_[max_frames];
+int num_frames_ = 0;
+atomic<pthread_t> target_;
+atomic<uint64_t> requested_ {0};
+atomic<uint64_t> completed_ {0};
+
+void OnStackTraceSignal(int)
+{
+    auto request = requested_.load(memory_order_acquire);
+    if (!request || !pthread_equal(pthread_self(), target_.load(memory_order_relaxed))
+        || !requested_.compare_exchange_strong(request, 0, memory_order_acq_rel)) {
+        return; // Not for us, or withdrawn
+    }
+
+    num_frames_ = backtrace(frames_, max_frames);
+    completed_.store(request, memory_order_release);
+}
+
+int GetStackTraceSignal(const Watchdog::Config& config) noexcept
+{
+    return config.stack_trace_signal ? config.stack_trace_signal : (SIGRTMIN + 4);
+}
+
+void InstallStackTraceHandler(const int signal)
+{
+    static mutex lock;
+    static vector<int> installed;
+
+    lock_guard<mutex> guard(lock);
+    if (find(installed.begin(), installed.end(), signal) != installed.end()) {
+        return;
+    }
+
+    // backtrace() may allocate memory the first time it's called,
+    // which we can't do in a signal handler.
+    void *dummy[1];
+    backtrace(dummy, 1);
+
+    struct sigaction sa = {};
+    sa.sa_handler = OnStackTraceSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(signal, &sa, nullptr) != 0) {
+        const log::Errno err;
+        LOG_WARN_FN << "Failed to install signal handler for signal "
+            << signal << ": " << err;
+        return;
+    }
+    installed.push_back(signal);
+}
+
+vector<string> CaptureStackTrace(Pipeline& pipeline, const int signal)
+{
+    // One capture at the time, as the frames are stored in a global buffer
+    static mutex lock;
+    static uint64_t sequence = 0;
+    lock_guard<mutex> guard(lock);
+
+    const auto request = ++sequence;
+    target_.store(pipeline.GetNativeHandle(), memory_order_relaxed);
+    requested_.store(request, memory_order_release);
+    if (pthread_kill(pipeline.GetNativeHandle(), signal) != 0) {
+        requested_.store(0, memory_order_relaxed);
+        return {};
+    }
+
+    bool done = false;
+    for(int i = 0; i < 100; ++i) {
+        if (completed_.load(memory_order_acquire) == request) {
+            done = true;
+            break;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+
+    if (!done) {
+        auto pending = request;
+        if (requested_.compare_exchange_strong(pending, 0, memory_order_acq_rel)) {
+            return {}; // Withdrawn before the handler got to it
+        }
+
+        // The handler is running. Let it finish before frames_ is re-used.
+        while(completed_.load(memory_order_acquire) != request) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+
+    if (num_frames_ <= 0) {
+        return {};
+    }
+
+    vector<string> stack;
+    if (auto symbols = backtrace_symbols(frames_, num_frames_)) {
+        // Skip the signal handler and the signal trampoline
+        for(int i = 2; i < num_frames_; ++i) {
+            stack.emplace_back(symbols[i]);
+        }
+        free(symbols);
+    }
+    return stack;
+}
+
+#else
+
+int GetStackTraceSignal(const Watchdog::Config&) noexcept
+{
+    return 0;
+}
+
+void InstallStackTraceHandler(const int)
+{
+    LOG_DEBUG_FN << "Stack traces are not supported on this platform";
+}
+
+vector<string> CaptureStackTrace(Pipeline&, const int)
+{
+    return {};
+}
+
+#endif
+
+} // anonymous namespace
+
+Watchdog::Watchdog()
+: Watchdog(Config{})
+{
+}
+
+Watchdog::Watchdog(const Config& config, handler_t handler)
+: config_(config), handler_{handler ? move(handler) : handler_t(LogReport)}
+{
+    if (config_.stack_trace) {
+        InstallStackTraceHandler(GetStackTraceSignal(config_));
+    }
+    thread_ = make_unique<thread>(&Watchdog::Run, this);
+}
+
+Watchdog::~Watchdog()
+{
+    {
+        lock_guard<mutex> lock(lock_);
+        done_ = true;
+    }
+    wakeup_.notify_all();
+    if (thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+}
+
+void Watchdog::Watch(Pipeline& pipeline)
+{
+    lock_guard<mutex> lock(lock_);
+    Watched w;
+    w.pipeline = &pipeline;
+    pipelines_.push_back(w);
+}
+
+void Watchdog::Watch(Threadpool& pool)
+{
+    for(size_t i = 0; i < pool.GetNumThreads(); ++i) {
+        Watch(pool.GetPipeline(i));
+    }
+}
+
+void Watchdog::Unwatch(Pipeline& pipeline)
+{
+    lock_guard<mutex> lock(lock_);
+    pipelines_.erase(remove_if(pipelines_.begin(), pipelines_.end(),
+                               [&](const auto& w) { return w.pipeline == &pipeline; }),
+                     pipelines_.end());
+}
+
+void Watchdog::LogReport(const Report& report)
+{
+    ostringstream stack;
+    for(const auto& frame : report.stack) {
+        stack << "\n    " << frame;
+    }
+
+    LOG_WARN_F(log::LA_THREADS) << "Task " << log::Esc(report.task)
+        << " on " << *report.pipeline << " has been running for "
+        << chrono::duration_cast<chrono::milliseconds>(report.duration).count()
+        << " milliseconds" << stack.str();
+}
+
+void Watchdog::Run()
+{
+    log::ThreadIdentity::SetName("Watchdog");
+    LOG_DEBUG_F_FN(log::LA_THREADS) << "Starting watchdog with threshold "
+        << config_.threshold.count() << " milliseconds";
+
+    unique_lock<mutex> lock(lock_);
+    while(!done_) {
+        wakeup_.wait_for(lock, config_.interval, [this] { return done_; });
+        if (!done_) {
+            Check();
+        }
+    }
+
+    LOG_DEBUG_F_FN(log::LA_THREADS) << "Ending watchdog";
+}
+
+void Watchdog::Check()
+{
+    const auto now = TscClock::now();
+    for(auto& w : pipelines_) {
+        const auto current = w.pipeline->GetCurrentTask();
+        if (!current.name || (current.started == w.reported)
+            || ((now - current.started) < config_.threshold)) {
+            continue;
+        }
+
+        w.reported = current.started;
+        ++reports_;
+
+        Report report;
+        report.pipeline = w.pipeline;
+        report.task = current.name;
+        report.duration = now - current.started;
+        if (config_.stack_trace) {
+            report.stack = CaptureStackTrace(*w.pipeline, GetStackTraceSignal(config_));
+        }
+
+        try {
+            handler_(report);
+        } WAR_CATCH_ALL_E;
+    }
+}
+
+} // namespace war
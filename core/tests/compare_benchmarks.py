@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Compare two result-files from warcore_perf_test or warcore_log_perf_test.
+
+The files can be JSON (--format json) or CSV (--format csv). Results are
+matched on their benchmark, variant, pinning and number of threads, and
+a result is flagged as a regression if the metric is more than
+--threshold percent worse than in the baseline.
+
+    compare_benchmarks.py baseline.json current.json
+    compare_benchmarks.py --metric p99_ns --threshold 25 baseline.csv current.csv
+
+The exit code is 1 if there are regressions, 0 otherwise.
+"""
+
+import argparse
+import csv
+import json
+import sys
+
+KEYS = ("benchmark", "variant", "pinned", "threads")
+
+# Metrics where a lower value is better. Anything else (like ops_per_sec)
+# is treated as higher is better.
+LOWER_IS_BETTER = ("ns_per_op", "ns_per_record", "p50_ns", "p90_ns", "p99_ns", "max_ns")
+
+
+def load(path):
+    with open(path) as f:
+        if path.endswith(".json"):
+            rows = json.load(f)
+        else:
+            rows = list(csv.DictReader(f))
+
+    results = {}
+    for row in rows:
+        key = tuple(str(row.get(k, "")).lower() for k in KEYS)
+        results[key] = row
+    return results
+
+
+def default_metric(results):
+    for row in results.values():
+        return "ns_per_op" if "ns_per_op" in row else "ns_per_record"
+    return "ns_per_op"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline", help="Results to compare with")
+    parser.add_argument("current", help="New results")
+    parser.add_argument("--metric", help="Metric to compare (default: ns_per_op or ns_per_record)")
+    parser.add_argument("--threshold", type=float, default=10.0,
+                        help="Percent change that counts as a regression (default: 10)")
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    metric = args.metric or default_metric(baseline)
+    lower_is_better = metric in LOWER_IS_BETTER
+
+    regressions = 0
+    print("%-20s %-22s %-6s %7s %14s %14s %9s" % (
+        "benchmark", "variant", "pinned", "threads", "baseline", "current", "change"))
+    for key in sorted(baseline):
+        if key not in current:
+            print("%-20s %-22s %-6s %7s %14s" % (key + ("missing",)))
+            continue
+
+        try:
+            before = float(baseline[key][metric])
+            after = float(current[key][metric])
+        except (KeyError, ValueError):
+            sys.exit("No metric named %s in the results" % metric)
+
+        change = ((after - before) / before * 100.0) if before else 0.0
+        worse = change if lower_is_better else -change
+        flag = ""
+        if worse > args.threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif worse < -args.threshold:
+            flag = "  improved"
+
+        print("%-20s %-22s %-6s %7s %14.2f %14.2f %+8.1f%%%s" % (
+            key + (before, after, change, flag)))
+
+    for key in sorted(set(current) - set(baseline)):
+        print("%-20s %-22s %-6s %7s %14s" % (key + ("new",)))
+
+    if regressions:
+        print("\n%d regression(s) in %s (threshold %.1f%%)" % (regressions, metric, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,466 @@
+/* Open-loop load generator for Threadpool.
+ *
+ * Tasks are posted at a fixed rate, on a schedule that does not depend
+ * on how fast the pool executes them. The latency of each task is
+ * measured from the time it was scheduled to be sent, to when it
+ * started and when it finished. So when the pool falls behind, the
+ * time the tasks spend in the queue (and the time the sender was held
+ * up) is included, and not hidden like in a closed-loop test, where the
+ * producers slow down when the pool is slow (coordinated omission).
+ *
+ * The load is increased step by step, until the pool can't keep up
+ * with the rate, or the p99 latency gets above --max-latency. The last
+ * rate that was handled is the saturation knee for the pool.
+ *
+ *   warcore_load_test --threads 4 --work 20 --start-rate 10000 --factor 1.25
+ *   warcore_load_test --rate 50000 --rate 100000 --format csv
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <warlib/WarThreadpool.h>
+#include <warlib/WarLog.h>
+
+#include <boost/program_options.hpp>
+
+using namespace std;
+using namespace war;
+
+namespace {
+
+/*! Log-linear histogram for latencies, like HdrHistogram
+
+    Values below 256 are counted exactly. Above that, each power of
+    two is divided in 128 buckets, so the value reported for a
+    percentile is within 1% of the real value. The counters are
+    atomic, so that all the threads in the pool can record to the
+    same histogram.
+*/
+class Histogram
+{
+public:
+    static constexpr unsigned sub_bits = 7;
+    static constexpr unsigned sub_buckets = 1u << sub_bits;
+    // Up to 2^40 ns (about 18 minutes)
+    static constexpr unsigned max_bits = 40;
+    static constexpr unsigned num_buckets = (max_bits - sub_bits + 1) * sub_buckets;
+
+    Histogram()
+        : counts_(new atomic<uint64_t>[num_buckets])
+    {
+        Reset();
+    }
+
+    void Record(const uint64_t ns) noexcept {
+        counts_[GetIndex(ns)].fetch_add(1, memory_order_relaxed);
+        auto prev = max_.load(memory_order_relaxed);
+        while((ns > prev) && !max_.compare_exchange_weak(prev, ns, memory_order_relaxed))
+            ;
+    }
+
+    void Reset() noexcept {
+        for(unsigned i = 0; i < num_buckets; ++i) {
+            counts_[i].store(0, memory_order_relaxed);
+        }
+        max_ = 0;
+    }
+
+    uint64_t GetCount() const noexcept {
+        uint64_t total = 0;
+        for(unsigned i = 0; i < num_buckets; ++i) {
+            total += counts_[i].load(memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /*! Returns the value at the percentile (0 - 100) */
+    uint64_t GetPercentile(const double percentile) const noexcept {
+        const uint64_t total = GetCount();
+        if (!total) {
+            return 0;
+        }
+        const auto wanted = max<uint64_t>(1, static_cast<uint64_t>(
+            ceil(percentile / 100.0 * static_cast<double>(total))));
+        uint64_t seen = 0;
+        for(unsigned i = 0; i < num_buckets; ++i) {
+            seen += counts_[i].load(memory_order_relaxed);
+            if (seen >= wanted) {
+                return min(GetHighestValue(i), GetMax());
+            }
+        }
+        return GetMax();
+    }
+
+    uint64_t GetMax() const noexcept {
+        return max_.load(memory_order_relaxed);
+    }
+
+private:
+    static unsigned GetIndex(uint64_t value) noexcept {
+        if (value < (2 * sub_buckets)) {
+            return static_cast<unsigned>(value);
+        }
+        unsigned msb = 0;
+        for(auto v = value; v >>= 1;) {
+            ++msb;
+        }
+        const unsigned shift = msb - sub_bits;
+        const unsigned index = ((shift + 1) * sub_buckets)
+            + static_cast<unsigned>((value >> shift) - sub_buckets);
+        return min(index, num_buckets - 1);
+    }
+
+    static uint64_t GetHighestValue(const unsigned index) noexcept {
+        if (index < (2 * sub_buckets)) {
+            return index;
+        }
+        const unsigned shift = (index / sub_buckets) - 1;
+        const uint64_t base = static_cast<uint64_t>((index % sub_buckets) + sub_buckets) << shift;
+        return base + (static_cast<uint64_t>(1) << shift) - 1;
+    }
+
+    unique_ptr<atomic<uint64_t>[]> counts_;
+    atomic<uint64_t> max_ {0};
+};
+
+struct Result {
+    double target_rate = 0;
+    double achieved_rate = 0;
+    uint64_t sent = 0;
+    uint64_t rejected = 0;
+    uint64_t start_p50 = 0, start_p90 = 0, start_p99 = 0, start_p999 = 0, start_max = 0;
+    uint64_t end_p50 = 0, end_p90 = 0, end_p99 = 0, end_p999 = 0, end_max = 0;
+    bool saturated = false;
+};
+
+struct Config {
+    unsigned threads = 0;
+    unsigned capacity = 1024 * 16;
+    chrono::microseconds work {10};
+    chrono::milliseconds duration {1000};
+    chrono::milliseconds max_latency {100};
+    double start_rate = 1000;
+    double factor = 1.5;
+    double max_rate = 10000000;
+    vector<double> rates;
+};
+
+class LoadGenerator
+{
+public:
+    LoadGenerator(const Config& config)
+        : config_(config)
+        , pool_(config.threads, config.capacity)
+        , ns_per_tick_(chrono::duration<double, nano>(
+            TscClock::ToDuration(1000000000) - TscClock::ToDuration(0)).count() / 1e9)
+    {
+    }
+
+    ~LoadGenerator() {
+        pool_.Close();
+        pool_.WaitUntilClosed();
+    }
+
+    void Run()
+    {
+        if (!config_.rates.empty()) {
+            for(const auto rate : config_.rates) {
+                results_.push_back(RunAt(rate));
+            }
+            return;
+        }
+
+        for(double rate = config_.start_rate; rate <= config_.max_rate; rate *= config_.factor) {
+            results_.push_back(RunAt(rate));
+            if (results_.back().saturated) {
+                break;
+            }
+        }
+    }
+
+    const vector<Result>& GetResults() const noexcept {
+        return results_;
+    }
+
+private:
+    /*! Spin for the configured amount of work */
+    void Work() const noexcept {
+        const auto until = chrono::steady_clock::now() + config_.work;
+        while(chrono::steady_clock::now() < until)
+            ;
+    }
+
+    uint64_t ToNanoseconds(const uint64_t ticks) const noexcept {
+        return static_cast<uint64_t>(static_cast<double>(ticks) * ns_per_tick_);
+    }
+
+    Result RunAt(const double rate)
+    {
+        Histogram to_start;
+        Histogram to_end;
+        atomic<uint64_t> done {0};
+        atomic<uint64_t> last_end {0};
+        uint64_t sent = 0;
+        uint64_t rejected = 0;
+
+        // The schedule, in ticks. Task #n is due at start + n * interval.
+        const double interval = 1e9 / rate / ns_per_tick_;
+        const auto duration = static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(config_.duration).count() / ns_per_tick_);
+        const auto spin_ticks = static_cast<uint64_t>(50000 / ns_per_tick_);
+
+        const uint64_t start = TscClock::Ticks();
+        for(uint64_t n = 0;; ++n) {
+            const auto due = start + static_cast<uint64_t>(n * interval);
+            if ((due - start) >= duration) {
+                break;
+            }
+
+            auto now = TscClock::Ticks();
+            if (due > now) {
+                if ((due - now) > spin_ticks) {
+                    this_thread::sleep_for(chrono::nanoseconds(
+                        static_cast<int64_t>((due - now - spin_ticks) * ns_per_tick_)));
+                }
+                while(TscClock::Ticks() < due)
+                    ;
+            }
+
+            try {
+                pool_.Post(task_t{[this, due, &to_start, &to_end, &done, &last_end] {
+                    to_start.Record(ToNanoseconds(TscClock::Ticks() - due));
+                    Work();
+                    const auto end = TscClock::Ticks();
+                    to_end.Record(ToNanoseconds(end - due));
+                    auto prev = last_end.load(memory_order_relaxed);
+                    while((end > prev)
+                          && !last_end.compare_exchange_weak(prev, end, memory_order_relaxed))
+                        ;
+                    done.fetch_add(1, memory_order_release);
+                }, "load"});
+                ++sent;
+            } catch(const Pipeline::ExceptionCapacityExceeded&) {
+                ++rejected;
+            }
+        }
+
+        // Let the pool drain. Tasks that are still queued after that are
+        // in the histograms as late as they are when we stop waiting.
+        const auto deadline = chrono::steady_clock::now()
+            + max(config_.duration, config_.max_latency * 10);
+        while((done.load(memory_order_acquire) < sent)
+              && (chrono::steady_clock::now() < deadline)) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        // From the first scheduled send, until the last task finished
+        const auto elapsed = max(static_cast<double>(last_end.load() - start),
+                                 static_cast<double>(duration)) * ns_per_tick_ / 1e9;
+
+        Result r;
+        r.target_rate = rate;
+        r.sent = sent;
+        r.rejected = rejected;
+        r.achieved_rate = done.load() / elapsed;
+        r.start_p50 = to_start.GetPercentile(50);
+        r.start_p90 = to_start.GetPercentile(90);
+        r.start_p99 = to_start.GetPercentile(99);
+        r.start_p999 = to_start.GetPercentile(99.9);
+        r.start_max = to_start.GetMax();
+        r.end_p50 = to_end.GetPercentile(50);
+        r.end_p90 = to_end.GetPercentile(90);
+        r.end_p99 = to_end.GetPercentile(99);
+        r.end_p999 = to_end.GetPercentile(99.9);
+        r.end_max = to_end.GetMax();
+
+        const auto max_latency = static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(config_.max_latency).count());
+        r.saturated = rejected || (done.load() < sent)
+            || (r.end_p99 > max_latency)
+            || (r.achieved_rate < (rate * 0.95));
+
+        // Anything left must be done before the next step
+        while(done.load(memory_order_acquire) < sent) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+
+        return r;
+    }
+
+    const Config config_;
+    Threadpool pool_;
+    const double ns_per_tick_;
+    vector<Result> results_;
+};
+
+string ToMicroseconds(const uint64_t ns)
+{
+    ostringstream out;
+    out << fixed << setprecision(1) << (static_cast<double>(ns) / 1000.0);
+    return out.str();
+}
+
+void WriteText(ostream& out, const vector<Result>& results)
+{
+    out << right << setw(12) << "rate" << setw(12) << "achieved"
+        << setw(10) << "rejected"
+        << setw(11) << "start-p50" << setw(11) << "start-p99"
+        << setw(11) << "end-p50" << setw(11) << "end-p90"
+        << setw(11) << "end-p99" << setw(12) << "end-p99.9"
+        << setw(12) << "end-max" << endl;
+    const Result *knee = nullptr;
+    for(const auto& r : results) {
+        out << fixed << setprecision(0) << setw(12) << r.target_rate
+            << setw(12) << r.achieved_rate << setw(10) << r.rejected
+            << setw(11) << ToMicroseconds(r.start_p50) << setw(11) << ToMicroseconds(r.start_p99)
+            << setw(11) << ToMicroseconds(r.end_p50) << setw(11) << ToMicroseconds(r.end_p90)
+            << setw(11) << ToMicroseconds(r.end_p99) << setw(12) << ToMicroseconds(r.end_p999)
+            << setw(12) << ToMicroseconds(r.end_max)
+            << (r.saturated ? "  saturated" : "") << endl;
+        if (!r.saturated) {
+            knee = &r;
+        }
+    }
+    out << "Latencies in microseconds, from the scheduled send-time." << endl;
+    if (knee) {
+        out << "Highest rate without saturation: " << fixed << setprecision(0)
+            << knee->target_rate << " tasks/sec" << endl;
+    }
+}
+
+void WriteCsv(ostream& out, const vector<Result>& results)
+{
+    out << "target_rate,achieved_rate,sent,rejected,"
+        "start_p50_ns,start_p90_ns,start_p99_ns,start_p999_ns,start_max_ns,"
+        "end_p50_ns,end_p90_ns,end_p99_ns,end_p999_ns,end_max_ns,saturated" << endl;
+    for(const auto& r : results) {
+        out << fixed << setprecision(0) << r.target_rate << ',' << r.achieved_rate << ','
+            << r.sent << ',' << r.rejected << ','
+            << r.start_p50 << ',' << r.start_p90 << ',' << r.start_p99 << ','
+            << r.start_p999 << ',' << r.start_max << ','
+            << r.end_p50 << ',' << r.end_p90 << ',' << r.end_p99 << ','
+            << r.end_p999 << ',' << r.end_max << ','
+            << (r.saturated ? "true" : "false") << endl;
+    }
+}
+
+void WriteJson(ostream& out, const vector<Result>& results)
+{
+    out << "[" << endl;
+    bool virgin = true;
+    for(const auto& r : results) {
+        if (!virgin) {
+            out << ',' << endl;
+        }
+        virgin = false;
+        out << fixed << setprecision(0)
+            << "  {\"target_rate\":" << r.target_rate
+            << ",\"achieved_rate\":" << r.achieved_rate
+            << ",\"sent\":" << r.sent << ",\"rejected\":" << r.rejected
+            << ",\"start_p50_ns\":" << r.start_p50 << ",\"start_p90_ns\":" << r.start_p90
+            << ",\"start_p99_ns\":" << r.start_p99 << ",\"start_p999_ns\":" << r.start_p999
+            << ",\"start_max_ns\":" << r.start_max
+            << ",\"end_p50_ns\":" << r.end_p50 << ",\"end_p90_ns\":" << r.end_p90
+            << ",\"end_p99_ns\":" << r.end_p99 << ",\"end_p999_ns\":" << r.end_p999
+            << ",\"end_max_ns\":" << r.end_max
+            << ",\"saturated\":" << (r.saturated ? "true" : "false") << '}';
+    }
+    out << endl << "]" << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    Config config;
+    string format = "text";
+    string output;
+    unsigned work = static_cast<unsigned>(config.work.count());
+    unsigned duration = static_cast<unsigned>(config.duration.count());
+    unsigned max_latency = static_cast<unsigned>(config.max_latency.count());
+
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Print help and exit")
+        ("threads,t", po::value<unsigned>(&config.threads)->default_value(config.threads),
+            "Threads in the pool. 0 use the Threadpool's default")
+        ("capacity,c", po::value<unsigned>(&config.capacity)->default_value(config.capacity),
+            "Queue capacity for each thread in the pool")
+        ("work,w", po::value<unsigned>(&work)->default_value(work),
+            "Microseconds of CPU work in each task")
+        ("duration,d", po::value<unsigned>(&duration)->default_value(duration),
+            "Milliseconds to run each load level")
+        ("rate,r", po::value<vector<double>>(&config.rates),
+            "Tasks per second. Can be repeated. Disables the sweep.")
+        ("start-rate", po::value<double>(&config.start_rate)->default_value(config.start_rate),
+            "Tasks per second for the first step in the sweep")
+        ("factor", po::value<double>(&config.factor)->default_value(config.factor),
+            "Multiply the rate with this for each step in the sweep")
+        ("max-rate", po::value<double>(&config.max_rate)->default_value(config.max_rate),
+            "Stop the sweep at this rate")
+        ("max-latency", po::value<unsigned>(&max_latency)->default_value(max_latency),
+            "Milliseconds. The pool is saturated if the p99 latency is higher")
+        ("format,f", po::value<string>(&format)->default_value(format),
+            "Output format: text, csv or json")
+        ("output,o", po::value<string>(&output),
+            "Write the results to this file in stead of stdout")
+        ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        cerr << ex.what() << endl << options << endl;
+        return -1;
+    }
+
+    if (vm.count("help") || (config.factor <= 1.0) || (config.start_rate <= 0)
+        || ((format != "text") && (format != "csv") && (format != "json"))) {
+        cout << options << endl;
+        return -1;
+    }
+
+    config.work = chrono::microseconds(work);
+    config.duration = chrono::milliseconds(duration);
+    config.max_latency = chrono::milliseconds(max_latency);
+
+    log::LogEngine logger;
+    logger.AddHandler(make_shared<log::LogToStream>(cerr, "console", log::LL_WARNING));
+
+    LoadGenerator generator(config);
+    generator.Run();
+
+    ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file.is_open()) {
+            cerr << "Failed to open " << output << endl;
+            return -1;
+        }
+    }
+    ostream& out = output.empty() ? cout : file;
+
+    if (format == "csv") {
+        WriteCsv(out, generator.GetResults());
+    } else if (format == "json") {
+        WriteJson(out, generator.GetResults());
+    } else {
+        WriteText(out, generator.GetResults());
+    }
+
+    return 0;
+}
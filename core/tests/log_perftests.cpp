@@ -0,0 +1,487 @@
+/* Benchmarks for the logging library.
+ *
+ * Each benchmark runs for a fixed time, and reports the cost per
+ * record and the number of records per second. The results can be
+ * written as text (default), CSV or JSON, so that they can be compared
+ * between builds.
+ *
+ *   warcore_log_perf_test --format csv --duration 500 > before.csv
+ */
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <warlib/WarLog.h>
+
+using namespace std;
+using namespace war;
+
+namespace {
+
+/*! Stream-buffer that discards the data, but still copies it to a buffer */
+class NullBuffer : public std::streambuf
+{
+public:
+    NullBuffer() {
+        setp(buffer_, buffer_ + sizeof(buffer_));
+    }
+
+protected:
+    int overflow(int ch) override {
+        setp(buffer_, buffer_ + sizeof(buffer_));
+        if (ch != traits_type::eof()) {
+            *pptr() = static_cast<char>(ch);
+            pbump(1);
+        }
+        return ch;
+    }
+
+private:
+    char buffer_[1024 * 64];
+};
+
+/*! Exposes the formatting methods of the handlers */
+class MessageWriter : public log::LogEventHandler
+{
+public:
+    MessageWriter()
+        : LogEventHandler("writer", log::LL_TRACE4, log::LA_DEFAULT_ENABLE) {}
+
+    void Submit(const SubmitInfo&) noexcept override {}
+
+    void Write(ostream& out, const SubmitInfo& si) const {
+        WriteMessage(out, si);
+    }
+
+    void Timestamp(ostream& out, const SubmitInfo& si) const {
+        WriteTimestamp(out, si);
+    }
+
+    void Line(ostream& out, const SubmitInfo& si) const {
+        WriteDefaulInfo(out, si);
+    }
+};
+
+/*! The original, char by char, implementation of WriteMessage() */
+void LegacyWriteMessage(ostream& out, const log::LogEventHandler::SubmitInfo& si,
+                        const locale& loc)
+{
+    string::const_iterator ch = si.buf_.begin();
+    const string::const_iterator end = si.buf_.end();
+    for(; ch != end; ++ch) {
+        const char c = *ch;
+        if ('\r' == c)
+            continue;
+        if ('\n' == c) {
+            if (++ch == end)
+                break;
+            --ch;
+            out << endl << "  ";
+        } else if (iscntrl(c, loc) && !isspace(c, loc)) {
+            const ios::fmtflags saved = out.flags();
+            out << '%' << setw(2) << setfill('0') << hex << ((unsigned int)c);
+            out.flags(saved);
+        } else {
+            out << c;
+        }
+    }
+}
+
+/*! Log-message like text, with a line-break now and then */
+string MakeMessage(const size_t size)
+{
+    static const string words = "Connection from 192.168.10.42:51234 accepted on "
+        "socket 17, request GET /api/v1/users/8812/sessions?limit=50 took 12 ms. ";
+    string msg;
+    msg.reserve(size);
+    for(size_t i = 0; msg.size() < size; ++i) {
+        msg += words[i % words.size()];
+        if ((i % 200) == 199) {
+            msg += '\n';
+        }
+    }
+    msg.resize(size);
+    return msg;
+}
+
+struct Result {
+    string benchmark;
+    string variant;
+    unsigned threads = 1;
+    uint64_t records = 0;
+    double ns_per_record = 0;
+    double records_per_sec = 0;
+};
+
+class Benchmarks
+{
+public:
+    Benchmarks(const chrono::milliseconds duration, const string& filter,
+               const string& path)
+        : duration_(duration), filter_(filter), path_(path) {}
+
+    void Run()
+    {
+        DisabledStatements();
+        EnabledPerHandler();
+        Contention();
+        MessageSize();
+        Timestamps();
+    }
+
+    const vector<Result>& GetResults() const noexcept {
+        return results_;
+    }
+
+private:
+    bool Wanted(const string& benchmark) const {
+        return filter_.empty() || (benchmark.find(filter_) != string::npos);
+    }
+
+    /*! Call fn in batches of 1000 until duration_ has passed */
+    template <typename FnT>
+    void Measure(const string& benchmark, const string& variant, FnT&& fn)
+    {
+        uint64_t iterations = 0;
+        const auto start = chrono::steady_clock::now();
+        auto now = start;
+        do {
+            for(int i = 0; i < 1000; ++i) {
+                fn();
+            }
+            iterations += 1000;
+            now = chrono::steady_clock::now();
+        } while(now - start < duration_);
+
+        Add(benchmark, variant, 1, iterations, now - start);
+    }
+
+    void Add(const string& benchmark, const string& variant,
+             const unsigned threads, const uint64_t records,
+             const chrono::steady_clock::duration elapsed)
+    {
+        Result r;
+        r.benchmark = benchmark;
+        r.variant = variant;
+        r.threads = threads;
+        r.records = records;
+        const double ns = chrono::duration<double, nano>(elapsed).count();
+        // For several threads, this is the cost of one record for one thread
+        r.ns_per_record = ns * threads / records;
+        r.records_per_sec = records / (ns / 1e9);
+        results_.push_back(r);
+    }
+
+    /*! Log-statements that are filtered out */
+    void DisabledStatements()
+    {
+        if (!Wanted("disabled")) {
+            return;
+        }
+
+        log::LogEngine engine;
+        engine.AddHandler(make_shared<log::LogToStream>(null_out_));
+        int value = 0;
+
+        Measure("disabled", "stream", [&] {
+            LOG_TRACE4 << "Not logged " << ++value;
+        });
+        Measure("disabled", "format", [&] {
+            LOG_TRACE4_FMT("Not logged {}", ++value);
+        });
+        Measure("disabled", "rate-limited", [&] {
+            LOG_TRACE4_RL(10) << "Not logged " << ++value;
+        });
+        Measure("disabled", "unused-category", [&] {
+            LOG_NOTICE_F(log::LA_FUNCTION_CALL << 1) << "Not logged " << ++value;
+        });
+    }
+
+    /*! The cost of a typical log-statement for each handler type */
+    void EnabledPerHandler()
+    {
+        if (!Wanted("enabled")) {
+            return;
+        }
+
+        const string payload = MakeMessage(64);
+
+        auto run = [&](const string& variant, log::LogEventHandler::ptr_t handler,
+                       const bool format = false) {
+            log::LogEngine engine;
+            engine.AddHandler(handler);
+            int i = 0;
+            if (format) {
+                Measure("enabled", variant, [&] {
+                    LOG_NOTICE_FMT("Message {} {}", ++i, payload);
+                });
+            } else {
+                Measure("enabled", variant, [&] {
+                    LOG_NOTICE << "Message " << ++i << ' ' << payload;
+                });
+            }
+        };
+
+        run("null-stream", make_shared<log::LogToStream>(null_out_));
+        run("null-stream-format", make_shared<log::LogToStream>(null_out_), true);
+        {
+            auto handler = make_shared<log::LogToStream>(null_out_);
+            handler->SetFlushPolicy(log::FlushPolicy::Never());
+            run("null-stream-noflush", handler);
+        }
+        run("file", log::LogToFile::Create(path_ + ".log", true));
+        {
+            auto handler = log::LogToFile::Create(path_ + ".log", true);
+            handler->SetFlushPolicy(log::FlushPolicy::Batched());
+            run("file-batched", handler);
+        }
+        {
+            auto handler = log::LogToJsonFile::Create(path_ + ".json", true);
+            handler->SetFlushPolicy(log::FlushPolicy::Batched());
+            run("json-batched", handler);
+        }
+        run("queue-null-stream", log::LogQueue::Create(
+            make_shared<log::LogToStream>(null_out_), 4096, log::LogQueue::OP_DROP));
+        run("flight-recorder", log::LogFlightRecorder::Create());
+
+        // Structured fields
+        {
+            log::LogEngine engine;
+            engine.AddHandler(make_shared<log::LogToStream>(null_out_));
+            int i = 0;
+            Measure("enabled", "null-stream-fields", [&] {
+                LOG_NOTICE << "Message" << log::Field("seq", ++i)
+                    << log::Field("payload", payload);
+            });
+        }
+    }
+
+    /*! Several threads logging at the same time */
+    void Contention()
+    {
+        if (!Wanted("contention")) {
+            return;
+        }
+
+        const unsigned max_threads = max(2u, thread::hardware_concurrency());
+        for(unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            log::LogEngine engine;
+            auto handler = make_shared<log::LogToStream>(null_out_);
+            handler->SetFlushPolicy(log::FlushPolicy::Never());
+            engine.AddHandler(handler);
+
+            atomic<bool> go {false};
+            atomic<bool> done {false};
+            atomic<uint64_t> records {0};
+            vector<thread> workers;
+            for(unsigned t = 0; t < threads; ++t) {
+                workers.emplace_back([&] {
+                    while(!go) {
+                        this_thread::yield();
+                    }
+                    uint64_t count = 0;
+                    while(!done.load(memory_order_relaxed)) {
+                        for(int i = 0; i < 100; ++i) {
+                            LOG_NOTICE << "Message " << ++count;
+                        }
+                    }
+                    records += count;
+                });
+            }
+
+            const auto start = chrono::steady_clock::now();
+            go = true;
+            this_thread::sleep_for(duration_);
+            done = true;
+            for(auto& w : workers) {
+                w.join();
+            }
+
+            Add("contention", "null-stream", threads, records,
+                chrono::steady_clock::now() - start);
+        }
+    }
+
+    /*! WriteMessage() compared to the char by char implementation */
+    void MessageSize()
+    {
+        if (!Wanted("write-message")) {
+            return;
+        }
+
+        const MessageWriter writer;
+        const locale loc;
+
+        for(const size_t size : {16, 64, 128, 256, 1024, 4096}) {
+            const log::LogEventHandler::SubmitInfo si {
+                log::LL_NOTICE, log::LA_GENERAL, MakeMessage(size), {}, {}, {}, {}};
+
+            Measure("write-message", to_string(size), [&] {
+                writer.Write(null_out_, si);
+            });
+            Measure("write-message-legacy", to_string(size), [&] {
+                LegacyWriteMessage(null_out_, si, loc);
+            });
+        }
+    }
+
+    /*! Formatting of the record, without the message */
+    void Timestamps()
+    {
+        if (!Wanted("timestamp")) {
+            return;
+        }
+
+        const MessageWriter writer;
+        const log::LogEventHandler::SubmitInfo si {
+            log::LL_NOTICE, log::LA_GENERAL, "Message", TscClock::Ticks(),
+            this_thread::get_id(), {}, log::ThreadIdentity::GetCurrent()};
+
+        Measure("timestamp", "text", [&] {
+            writer.Timestamp(null_out_, si);
+        });
+        Measure("timestamp", "line", [&] {
+            writer.Line(null_out_, si);
+        });
+        Measure("timestamp", "json-line", [&] {
+            log::LogToJsonFile::WriteJson(null_out_, si);
+        });
+        Measure("timestamp", "system-clock", [&] {
+            const auto now = chrono::system_clock::now();
+            null_out_.write(reinterpret_cast<const char *>(&now), 1);
+        });
+        Measure("timestamp", "steady-clock", [&] {
+            const auto now = chrono::steady_clock::now();
+            null_out_.write(reinterpret_cast<const char *>(&now), 1);
+        });
+        Measure("timestamp", TscClock::IsUsingTsc() ? "tsc-ticks" : "tsc-ticks-fallback", [&] {
+            const auto now = TscClock::Ticks();
+            null_out_.write(reinterpret_cast<const char *>(&now), 1);
+        });
+        Measure("timestamp", "tsc-clock-now", [&] {
+            const auto now = TscClock::now();
+            null_out_.write(reinterpret_cast<const char *>(&now), 1);
+        });
+    }
+
+    const chrono::milliseconds duration_;
+    const string filter_;
+    const string path_;
+    NullBuffer null_buffer_;
+    ostream null_out_ {&null_buffer_};
+    vector<Result> results_;
+};
+
+void WriteText(ostream& out, const vector<Result>& results)
+{
+    out << left << setw(22) << "benchmark" << setw(22) << "variant"
+        << right << setw(8) << "threads" << setw(14) << "ns/record"
+        << setw(16) << "records/sec" << endl;
+    for(const auto& r : results) {
+        out << left << setw(22) << r.benchmark << setw(22) << r.variant
+            << right << setw(8) << r.threads
+            << fixed << setprecision(1) << setw(14) << r.ns_per_record
+            << setprecision(0) << setw(16) << r.records_per_sec << endl;
+    }
+}
+
+void WriteCsv(ostream& out, const vector<Result>& results)
+{
+    out << "benchmark,variant,threads,records,ns_per_record,records_per_sec" << endl;
+    for(const auto& r : results) {
+        out << r.benchmark << ',' << r.variant << ',' << r.threads << ','
+            << r.records << ',' << fixed << setprecision(2) << r.ns_per_record
+            << ',' << setprecision(0) << r.records_per_sec << endl;
+    }
+}
+
+void WriteJson(ostream& out, const vector<Result>& results)
+{
+    out << "[" << endl;
+    bool virgin = true;
+    for(const auto& r : results) {
+        if (!virgin) {
+            out << ',' << endl;
+        }
+        virgin = false;
+        out << "  {\"benchmark\":\"" << r.benchmark << "\",\"variant\":\""
+            << r.variant << "\",\"threads\":" << r.threads
+            << ",\"records\":" << r.records << ",\"ns_per_record\":"
+            << fixed << setprecision(2) << r.ns_per_record
+            << ",\"records_per_sec\":" << setprecision(0) << r.records_per_sec << '}';
+    }
+    out << endl << "]" << endl;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    string format = "text";
+    string filter;
+    string output;
+    string path = "log_perf_tests";
+    unsigned duration = 200;
+
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Print help and exit")
+        ("format,f", po::value<string>(&format)->default_value(format),
+            "Output format: text, csv or json")
+        ("duration,d", po::value<unsigned>(&duration)->default_value(duration),
+            "Milliseconds to run each benchmark")
+        ("benchmark,b", po::value<string>(&filter),
+            "Only run benchmarks with this text in their name")
+        ("output,o", po::value<string>(&output),
+            "Write the results to this file in stead of stdout")
+        ("path,p", po::value<string>(&path)->default_value(path),
+            "Base name for the log-files used by the file handlers")
+        ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        cerr << ex.what() << endl << options << endl;
+        return -1;
+    }
+
+    if (vm.count("help") || ((format != "text") && (format != "csv") && (format != "json"))) {
+        cout << options << endl;
+        return -1;
+    }
+
+    Benchmarks benchmarks(chrono::milliseconds(duration), filter, path);
+    benchmarks.Run();
+
+    ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file.is_open()) {
+            cerr << "Failed to open " << output << endl;
+            return -1;
+        }
+    }
+    ostream& out = output.empty() ? cout : file;
+
+    if (format == "csv") {
+        WriteCsv(out, benchmarks.GetResults());
+    } else if (format == "json") {
+        WriteJson(out, benchmarks.GetResults());
+    } else {
+        WriteText(out, benchmarks.GetResults());
+    }
+
+    return 0;
+}
@@ -1,8 +1,33 @@
+/* Benchmarks for Pipeline and Threadpool.
+ *
+ * Each scenario runs for a fixed time, both with the threads pinned to
+ * CPUs and unpinned, and reports the number of operations per second
+ * and percentiles for the time of one operation. For the round-trip
+ * scenarios (ping-pong, timers, PostSynchronously, coroutines), the
+ * percentiles are for single operations, and for fan-out, for a whole
+ * round. For the throughput scenarios, they are for batches of
+ * operations, divided by the batch-size.
+ *
+ * The results can be written as text (default), CSV or JSON. Use
+ * compare_benchmarks.py to compare two JSON or CSV files:
+ *
+ *   warcore_perf_test --format json --duration 500 > baseline.json
+ *   ... change and rebuild ...
+ *   warcore_perf_test --format json --duration 500 > current.json
+ *   compare_benchmarks.py baseline.json current.json
+ */
 
-
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <chrono>
+#include <fstream>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include <warlib/WarThreadpool.h>
 #include <warlib/WarLog.h>
@@ -12,112 +37,673 @@
 using namespace std;
 using namespace war;
 
-Threadpool::pinning_t pinning;
+namespace {
 
-class Test
+/*! Time for each operation (or batch of operations), in TscClock ticks */
+class Samples
 {
 public:
-    Test(const std::string& name) : name_(name) {}
-    virtual ~Test() {}
+    static constexpr size_t max_samples = 1024 * 1024 * 4;
 
-    void RunTests()
-    {
-        LOG_NOTICE << "Starting test " << GetName();
-        const auto start = std::chrono::steady_clock::now();
-        try {
-            DoRunTests();
-        } WAR_CATCH_ALL_E;
-        const auto finished = std::chrono::steady_clock::now();
-        const auto extime = finished - start;
-        LOG_NOTICE << "Ended test " << GetName()
-            << " with execution-time "
-            << std::chrono::duration <double, std::milli> (extime).count()
-            << " ms.";
+    Samples() {
+        samples_.reserve(1024 * 64);
+    }
+
+    void Add(const uint64_t ticks, const unsigned operations = 1) {
+        if (samples_.size() < max_samples) {
+            samples_.push_back(static_cast<double>(ticks) / operations);
+        }
     }
 
-    inline const std::string& GetName() { return name_; }
+    void Merge(const Samples& other) {
+        samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+    }
 
-protected:
-    virtual void DoRunTests() = 0;
+    /*! Sorts the samples and converts them to nanoseconds */
+    vector<double> GetNanoseconds() const {
+        const double ns_per_tick = chrono::duration<double, nano>(
+            TscClock::ToDuration(1000000000) - TscClock::ToDuration(0)).count() / 1e9;
+        vector<double> ns;
+        ns.reserve(samples_.size());
+        for(const auto ticks : samples_) {
+            ns.push_back(ticks * ns_per_tick);
+        }
+        sort(ns.begin(), ns.end());
+        return ns;
+    }
 
 private:
+    vector<double> samples_;
+};
 
-    const std::string name_;
+struct Result {
+    string benchmark;
+    string variant;
+    bool pinned = false;
+    unsigned threads = 1;
+    uint64_t operations = 0;
+    double ns_per_op = 0;
+    double ops_per_sec = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
 };
 
-class SimpleTest : public Test
+void Close(Pipeline& pipeline)
+{
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+}
+
+class Benchmarks
 {
 public:
-    SimpleTest(const std::string& name, uint64_t numTasks)
-        : Test(name), pool_(pinning.size(), static_cast<unsigned int>(numTasks),
-                            pinning.empty() ? nullptr : &pinning),
-        total_tasks_processed_(0), total_tasks_queued_(0),
-        done_{false},
-        num_tasks_to_do_{numTasks}
+    Benchmarks(const chrono::milliseconds duration, const string& filter,
+               const vector<int>& cpus)
+        : duration_(duration), filter_(filter), cpus_(cpus) {}
+
+    void Run(const bool unpinned, const bool pinned)
     {
+        for(const bool pin : {false, true}) {
+            if ((pin && !pinned) || (!pin && !unpinned)) {
+                continue;
+            }
+            pinned_ = pin;
+            PostThroughput();
+            DispatchInline();
+            PingPong();
+            Contention();
+            FanOutFanIn();
+            Timers();
+            PostSynchronously();
+            Coroutines();
+        }
+    }
+
+    const vector<Result>& GetResults() const noexcept {
+        return results_;
     }
 
-protected:
-    inline void QueueOne()
+private:
+    static constexpr unsigned batch_size = 1000;
+
+    bool Wanted(const string& benchmark) const {
+        return filter_.empty() || (benchmark.find(filter_) != string::npos);
+    }
+
+    /*! CPU for thread #n, or -1 if we don't pin */
+    int GetCpu(const size_t n) const {
+        if (!pinned_ || cpus_.empty()) {
+            return -1;
+        }
+        return cpus_[n % cpus_.size()];
+    }
+
+    bool IsTimeUp(const chrono::steady_clock::time_point start) const {
+        return (chrono::steady_clock::now() - start) >= duration_;
+    }
+
+    void Add(const string& benchmark, const string& variant,
+             const unsigned threads, const uint64_t operations,
+             const chrono::steady_clock::duration elapsed,
+             const Samples& samples)
     {
-        if (++total_tasks_queued_ > num_tasks_to_do_) {
-            done_ = true;
-        } else {
-            pool_.Post(task_t{bind(&SimpleTest::OneTask, this), "simple"});
+        Result r;
+        r.benchmark = benchmark;
+        r.variant = variant;
+        r.pinned = pinned_;
+        r.threads = threads;
+        r.operations = operations;
+        const double ns = chrono::duration<double, nano>(elapsed).count();
+        r.ns_per_op = operations ? (ns / operations) : 0;
+        r.ops_per_sec = operations / (ns / 1e9);
+
+        const auto sorted = samples.GetNanoseconds();
+        if (!sorted.empty()) {
+            auto percentile = [&sorted](const double p) {
+                const auto ix = static_cast<size_t>(p * (sorted.size() - 1));
+                return sorted[ix];
+            };
+            r.p50 = percentile(0.5);
+            r.p90 = percentile(0.9);
+            r.p99 = percentile(0.99);
+            r.max = sorted.back();
         }
+        results_.push_back(r);
     }
 
-    void OneTask()
+    /*! Tasks posted to one pipeline, from another thread and from the pipeline itself */
+    void PostThroughput()
     {
-        ++total_tasks_processed_;
-        if (!done_) {
-            QueueOne();
+        if (!Wanted("post")) {
+            return;
+        }
+
+        {
+            Pipeline pipeline("bench", -1, 1024 * 64, GetCpu(0));
+            atomic<uint64_t> executed {0};
+            uint64_t posted = 0;
+            Samples samples;
+
+            const auto start = chrono::steady_clock::now();
+            do {
+                const auto batch_start = TscClock::Ticks();
+                for(unsigned i = 0; i < batch_size; ++i) {
+                    pipeline.Post(task_t{[&executed] {
+                        executed.fetch_add(1, memory_order_relaxed);
+                    }, "bench"});
+                }
+                samples.Add(TscClock::Ticks() - batch_start, batch_size);
+                posted += batch_size;
+
+                // Don't let the queue fill up
+                while((posted - executed.load(memory_order_relaxed)) > (batch_size * 8)) {
+                    this_thread::yield();
+                }
+            } while(!IsTimeUp(start));
+
+            while(executed.load() < posted) {
+                this_thread::yield();
+            }
+            Add("post", "other-thread", 1, posted, chrono::steady_clock::now() - start, samples);
+            Close(pipeline);
+        }
+
+        {
+            Pipeline pipeline("bench", -1, 1024, GetCpu(0));
+            atomic<bool> done {false};
+            uint64_t executed = 0;
+            uint64_t batch_start = 0;
+            Samples samples;
+            promise<void> finished;
+
+            function<void()> task;
+            task = [&] {
+                if ((++executed % batch_size) == 0) {
+                    const auto now = TscClock::Ticks();
+                    samples.Add(now - batch_start, batch_size);
+                    batch_start = now;
+                }
+                if (done.load(memory_order_relaxed)) {
+                    finished.set_value();
+                } else {
+                    pipeline.Post(task_t{task, "bench"});
+                }
+            };
+
+            const auto start = chrono::steady_clock::now();
+            batch_start = TscClock::Ticks();
+            pipeline.Post(task_t{task, "bench"});
+            this_thread::sleep_for(duration_);
+            done = true;
+            finished.get_future().wait();
+            Add("post", "same-thread", 1, executed, chrono::steady_clock::now() - start, samples);
+            Close(pipeline);
         }
     }
 
-    void DoRunTests() override
+    /*! Dispatch() from the pipelines own thread, which runs the task inline */
+    void DispatchInline()
     {
-        LOG_NOTICE_FN << "I will now run " << num_tasks_to_do_ << " tasks";
-        for(int i = 0; i < 1000; i++) {
-            QueueOne();
+        if (!Wanted("dispatch")) {
+            return;
         }
 
-        while(total_tasks_processed_ < num_tasks_to_do_) {
-            this_thread::sleep_for(chrono::milliseconds(50));
+        Pipeline pipeline("bench", -1, 1024, GetCpu(0));
+        uint64_t executed = 0;
+
+        auto run = [&](const string& variant, const function<void()>& fn) {
+            Samples samples;
+            uint64_t operations = 0;
+            const auto start = chrono::steady_clock::now();
+            pipeline.PostSynchronously(task_t{[&] {
+                do {
+                    const auto batch_start = TscClock::Ticks();
+                    for(unsigned i = 0; i < batch_size; ++i) {
+                        fn();
+                    }
+                    samples.Add(TscClock::Ticks() - batch_start, batch_size);
+                    operations += batch_size;
+                } while(!IsTimeUp(start));
+            }, "bench"});
+            Add("dispatch", variant, 1, operations, chrono::steady_clock::now() - start, samples);
+        };
+
+        const function<void()> count = [&executed] { ++executed; };
+        run("inline", [&] {
+            pipeline.Dispatch(task_t{count, "bench"});
+        });
+        // For reference; the cost of calling the task directly
+        run("function-call", count);
+
+        Close(pipeline);
+    }
+
+    /*! Round-trips between two pipelines */
+    void PingPong()
+    {
+        if (!Wanted("ping-pong")) {
+            return;
         }
-        pool_.Close();
+
+        Pipeline ping("ping", -1, 1024, GetCpu(0));
+        Pipeline pong("pong", -1, 1024, GetCpu(1));
+        atomic<bool> done {false};
+        uint64_t rounds = 0;
+        Samples samples;
+        promise<void> finished;
+
+        function<void()> serve;
+        serve = [&] {
+            const auto sent = TscClock::Ticks();
+            pong.Post(task_t{[&, sent] {
+                ping.Post(task_t{[&, sent] {
+                    samples.Add(TscClock::Ticks() - sent);
+                    ++rounds;
+                    if (done.load(memory_order_relaxed)) {
+                        finished.set_value();
+                    } else {
+                        serve();
+                    }
+                }, "pong"});
+            }, "ping"});
+        };
+
+        const auto start = chrono::steady_clock::now();
+        ping.Post(task_t{serve, "serve"});
+        this_thread::sleep_for(duration_);
+        done = true;
+        finished.get_future().wait();
+        Add("ping-pong", "round-trip", 2, rounds, chrono::steady_clock::now() - start, samples);
+
+        Close(ping);
+        Close(pong);
     }
 
-private:
-    Threadpool pool_;
-    std::atomic<std::uint64_t> total_tasks_processed_;
-    std::atomic<std::uint64_t> total_tasks_queued_;
-    atomic<bool> done_;
-    const uint64_t num_tasks_to_do_;
+    /*! Several threads posting to one pipeline */
+    void Contention()
+    {
+        if (!Wanted("contention")) {
+            return;
+        }
+
+        const unsigned max_producers = max(2u, thread::hardware_concurrency());
+        for(unsigned producers = 1; producers <= max_producers; producers *= 2) {
+            Pipeline pipeline("bench", -1, 1024 * 64, GetCpu(0));
+            atomic<uint64_t> executed {0};
+            atomic<uint64_t> posted {0};
+            atomic<bool> go {false};
+            atomic<bool> done {false};
+            vector<Samples> samples(producers);
+            vector<thread> workers;
+
+            for(unsigned p = 0; p < producers; ++p) {
+                workers.emplace_back([&, p] {
+                    while(!go) {
+                        this_thread::yield();
+                    }
+                    constexpr unsigned batch = 100;
+                    while(!done.load(memory_order_relaxed)) {
+                        const auto batch_start = TscClock::Ticks();
+                        for(unsigned i = 0; i < batch; ++i) {
+                            pipeline.Post(task_t{[&executed] {
+                                executed.fetch_add(1, memory_order_relaxed);
+                            }, "bench"});
+                        }
+                        samples[p].Add(TscClock::Ticks() - batch_start, batch);
+                        posted += batch;
+
+                        while((posted.load(memory_order_relaxed)
+                               - executed.load(memory_order_relaxed)) > (batch_size * 8)) {
+                            this_thread::yield();
+                        }
+                    }
+                });
+            }
+
+            const auto start = chrono::steady_clock::now();
+            go = true;
+            this_thread::sleep_for(duration_);
+            done = true;
+            for(auto& w : workers) {
+                w.join();
+            }
+            while(executed.load() < posted.load()) {
+                this_thread::yield();
+            }
+
+            Samples all;
+            for(const auto& s : samples) {
+                all.Merge(s);
+            }
+            Add("contention", "post", producers, executed,
+                chrono::steady_clock::now() - start, all);
+            Close(pipeline);
+        }
+    }
+
+    /*! Post a round of tasks to a Threadpool, and wait for all of them */
+    void FanOutFanIn()
+    {
+        if (!Wanted("fan-out")) {
+            return;
+        }
+
+        const unsigned threads = max(2u, thread::hardware_concurrency());
+        Threadpool::pinning_t pinning;
+        for(unsigned i = 0; i < threads; ++i) {
+            pinning.push_back(GetCpu(i));
+        }
+
+        Threadpool pool(threads, 1024 * 4, &pinning);
+        for(const unsigned per_thread : {1u, 16u}) {
+            const unsigned round = threads * per_thread;
+            atomic<unsigned> remaining {0};
+            uint64_t operations = 0;
+            Samples samples;
+
+            const auto start = chrono::steady_clock::now();
+            do {
+                const auto round_start = TscClock::Ticks();
+                remaining = round;
+                for(unsigned i = 0; i < round; ++i) {
+                    pool.Post(task_t{[&remaining] {
+                        remaining.fetch_sub(1, memory_order_release);
+                    }, "bench"});
+                }
+                while(remaining.load(memory_order_acquire)) {
+                    this_thread::yield();
+                }
+                samples.Add(TscClock::Ticks() - round_start);
+                operations += round;
+            } while(!IsTimeUp(start));
 
+            Add("fan-out", "round-of-" + to_string(round), threads, operations,
+                chrono::steady_clock::now() - start, samples);
+        }
+
+        pool.Close();
+        pool.WaitUntilClosed();
+    }
+
+    /*! Timers that fire, and timers that are cancelled */
+    void Timers()
+    {
+        if (!Wanted("timer")) {
+            return;
+        }
+
+        Pipeline pipeline("bench", -1, 1024, GetCpu(0));
+
+        {
+            atomic<bool> done {false};
+            uint64_t fired = 0;
+            Samples samples;
+            promise<void> finished;
+
+            function<void()> arm;
+            arm = [&] {
+                const auto armed = TscClock::Ticks();
+                pipeline.PostWithTimer(task_t{[&, armed] {
+                    samples.Add(TscClock::Ticks() - armed);
+                    ++fired;
+                    if (done.load(memory_order_relaxed)) {
+                        finished.set_value();
+                    } else {
+                        arm();
+                    }
+                }, "timer"}, 0);
+            };
+
+            const auto start = chrono::steady_clock::now();
+            pipeline.Post(task_t{arm, "arm"});
+            this_thread::sleep_for(duration_);
+            done = true;
+            finished.get_future().wait();
+            Add("timer", "arm-fire", 1, fired, chrono::steady_clock::now() - start, samples);
+        }
+
+        {
+            // Cancelled in batches, so that the aborted handlers can run in between
+            atomic<bool> done {false};
+            uint64_t cancelled = 0;
+            Samples samples;
+            promise<void> finished;
+
+            function<void()> batch;
+            batch = [&] {
+                const auto batch_start = TscClock::Ticks();
+                for(unsigned i = 0; i < batch_size; ++i) {
+                    boost::asio::deadline_timer timer(pipeline.GetIoService());
+                    timer.expires_from_now(boost::posix_time::seconds(10));
+                    timer.async_wait([](const boost::system::error_code&) {});
+                    timer.cancel();
+                }
+                samples.Add(TscClock::Ticks() - batch_start, batch_size);
+                cancelled += batch_size;
+                if (done.load(memory_order_relaxed)) {
+                    finished.set_value();
+                } else {
+                    pipeline.Post(task_t{batch, "bench"});
+                }
+            };
+
+            const auto start = chrono::steady_clock::now();
+            pipeline.Post(task_t{batch, "bench"});
+            this_thread::sleep_for(duration_);
+            done = true;
+            finished.get_future().wait();
+            Add("timer", "arm-cancel", 1, cancelled, chrono::steady_clock::now() - start, samples);
+        }
+
+        Close(pipeline);
+    }
+
+    /*! PostSynchronously() from another thread */
+    void PostSynchronously()
+    {
+        if (!Wanted("post-synchronously")) {
+            return;
+        }
+
+        Pipeline pipeline("bench", -1, 1024, GetCpu(0));
+        uint64_t operations = 0;
+        Samples samples;
+
+        const auto start = chrono::steady_clock::now();
+        do {
+            const auto sent = TscClock::Ticks();
+            pipeline.PostSynchronously(task_t{[] {}, "bench"});
+            samples.Add(TscClock::Ticks() - sent);
+            ++operations;
+        } while(!IsTimeUp(start));
+
+        Add("post-synchronously", "round-trip", 1, operations,
+            chrono::steady_clock::now() - start, samples);
+        Close(pipeline);
+    }
+
+    /*! Post(task, yield) from a coroutine */
+    void Coroutines()
+    {
+        if (!Wanted("coroutine")) {
+            return;
+        }
+
+        Pipeline owner("coroutine", -1, 1024, GetCpu(0));
+        Pipeline other("other", -1, 1024, GetCpu(1));
+
+        for(auto target : {&owner, &other}) {
+            atomic<bool> done {false};
+            uint64_t operations = 0;
+            Samples samples;
+            promise<void> finished;
+
+            auto coroutine = [&](boost::asio::yield_context yield) {
+                while(!done.load(memory_order_relaxed)) {
+                    const auto sent = TscClock::Ticks();
+                    target->Post(task_t{[] {}, "bench"}, yield);
+                    samples.Add(TscClock::Ticks() - sent);
+                    ++operations;
+                }
+                finished.set_value();
+            };
+
+            const auto start = chrono::steady_clock::now();
+#if BOOST_VERSION >= 108000
+            boost::asio::spawn(owner.GetIoService(), coroutine, boost::asio::detached);
+#else
+            boost::asio::spawn(owner.GetIoService(), coroutine);
+#endif
+            this_thread::sleep_for(duration_);
+            done = true;
+            finished.get_future().wait();
+            Add("coroutine", (target == &owner) ? "same-pipeline" : "other-pipeline",
+                (target == &owner) ? 1 : 2, operations,
+                chrono::steady_clock::now() - start, samples);
+        }
+
+        Close(owner);
+        Close(other);
+    }
+
+    const chrono::milliseconds duration_;
+    const string filter_;
+    const vector<int> cpus_;
+    bool pinned_ = false;
+    vector<Result> results_;
 };
 
+void WriteText(ostream& out, const vector<Result>& results)
+{
+    out << left << setw(20) << "benchmark" << setw(16) << "variant"
+        << setw(8) << "pinned" << right << setw(8) << "threads"
+        << setw(12) << "ns/op" << setw(14) << "ops/sec"
+        << setw(10) << "p50" << setw(10) << "p90" << setw(10) << "p99"
+        << setw(12) << "max" << endl;
+    for(const auto& r : results) {
+        out << left << setw(20) << r.benchmark << setw(16) << r.variant
+            << setw(8) << (r.pinned ? "yes" : "no") << right << setw(8) << r.threads
+            << fixed << setprecision(1) << setw(12) << r.ns_per_op
+            << setprecision(0) << setw(14) << r.ops_per_sec
+            << setprecision(1) << setw(10) << r.p50 << setw(10) << r.p90
+            << setw(10) << r.p99 << setw(12) << r.max << endl;
+    }
+}
+
+void WriteCsv(ostream& out, const vector<Result>& results)
+{
+    out << "benchmark,variant,pinned,threads,operations,ns_per_op,ops_per_sec,"
+        "p50_ns,p90_ns,p99_ns,max_ns" << endl;
+    for(const auto& r : results) {
+        out << r.benchmark << ',' << r.variant << ',' << (r.pinned ? "true" : "false")
+            << ',' << r.threads << ',' << r.operations << ','
+            << fixed << setprecision(2) << r.ns_per_op << ','
+            << setprecision(0) << r.ops_per_sec << ','
+            << setprecision(2) << r.p50 << ',' << r.p90 << ',' << r.p99 << ','
+            << r.max << endl;
+    }
+}
+
+void WriteJson(ostream& out, const vector<Result>& results)
+{
+    out << "[" << endl;
+    bool virgin = true;
+    for(const auto& r : results) {
+        if (!virgin) {
+            out << ',' << endl;
+        }
+        virgin = false;
+        out << "  {\"benchmark\":\"" << r.benchmark << "\",\"variant\":\""
+            << r.variant << "\",\"pinned\":" << (r.pinned ? "true" : "false")
+            << ",\"threads\":" << r.threads
+            << ",\"operations\":" << r.operations << ",\"ns_per_op\":"
+            << fixed << setprecision(2) << r.ns_per_op
+            << ",\"ops_per_sec\":" << setprecision(0) << r.ops_per_sec
+            << setprecision(2) << ",\"p50_ns\":" << r.p50 << ",\"p90_ns\":" << r.p90
+            << ",\"p99_ns\":" << r.p99 << ",\"max_ns\":" << r.max << '}';
+    }
+    out << endl << "]" << endl;
+}
+
+} // anonymous namespace
 
 int main(int argc, char *argv[])
 {
+    namespace po = boost::program_options;
+
+    string format = "text";
+    string filter;
+    string output;
+    string pinning = "both";
+    vector<int> cpus;
+    unsigned duration = 200;
+
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Print help and exit")
+        ("format,f", po::value<string>(&format)->default_value(format),
+            "Output format: text, csv or json")
+        ("duration,d", po::value<unsigned>(&duration)->default_value(duration),
+            "Milliseconds to run each benchmark")
+        ("benchmark,b", po::value<string>(&filter),
+            "Only run benchmarks with this text in their name")
+        ("output,o", po::value<string>(&output),
+            "Write the results to this file in stead of stdout")
+        ("pinning,p", po::value<string>(&pinning)->default_value(pinning),
+            "Run with the threads pinned to CPUs, unpinned, or both: on, off or both")
+        ("cpu,c", po::value<vector<int>>(&cpus)->multitoken(),
+            "CPUs to pin the threads to, in order. Default is all the CPUs.")
+        ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, options), vm);
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        cerr << ex.what() << endl << options << endl;
+        return -1;
+    }
+
+    if (vm.count("help")
+        || ((format != "text") && (format != "csv") && (format != "json"))
+        || ((pinning != "on") && (pinning != "off") && (pinning != "both"))) {
+        cout << options << endl;
+        return -1;
+    }
+
+    if (cpus.empty()) {
+        for(unsigned i = 0; i < max(1u, thread::hardware_concurrency()); ++i) {
+            cpus.push_back(static_cast<int>(i));
+        }
+    }
+
+    // Only warnings and errors, so that logging don't skew the results.
+    // Logging has its own benchmarks in log_perftests.cpp.
     log::LogEngine logger;
-    logger.AddHandler(make_shared<log::LogToStream>());
-    logger.AddHandler(make_shared<log::LogToFile>("perf_tests.log", true,
-                                                  "file", log::LL_TRACE1));
-
-    for(auto i = 1; i < argc; ++i) {
-        const char *p = argv[i];
-        if (*p == '-' && p[1] == 'h') {
-            cout << "Usage: perftests [cpu [cpu ...]]" << endl;
+    logger.AddHandler(make_shared<log::LogToStream>(cerr, "console", log::LL_WARNING));
+
+    Benchmarks benchmarks(chrono::milliseconds(duration), filter, cpus);
+    benchmarks.Run(pinning != "on", pinning != "off");
+
+    ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file.is_open()) {
+            cerr << "Failed to open " << output << endl;
             return -1;
         }
-
-        pinning.push_back(atoi(argv[i]));
-        LOG_DEBUG_FN << "Adding one thread pinned to CPU# " << pinning.back();
     }
+    ostream& out = output.empty() ? cout : file;
 
-    SimpleTest ss("SimpleTest", 50000000L);
-    ss.RunTests();
+    if (format == "csv") {
+        WriteCsv(out, benchmarks.GetResults());
+    } else if (format == "json") {
+        WriteJson(out, benchmarks.GetResults());
+    } else {
+        WriteText(out, benchmarks.GetResults());
+    }
 
     return 0;
 }
@@ -0,0 +1,920 @@
+#define BOOST_TEST_MODULE WarlibLogTests
+#include "war_tests.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <iomanip>
+#include <random>
+#include <limits>
+#include <warlib/WarLog.h>
+#include <warlib/WarPipeline.h>
+#include <warlib/log_query.h>
+#include <boost/filesystem.hpp>
+
+
+using namespace std;
+using namespace war;
+using namespace chrono_literals;
+
+namespace {
+
+/*! Handler that collects the messages, and that can be blocked */
+class LogToMemory : public log::LogEventHandler
+{
+public:
+    LogToMemory(const log::LogLevel level = log::LL_NOTICE,
+                const log::filter_t filter = log::LA_DEFAULT_ENABLE)
+        : LogEventHandler("memory", level, filter) {}
+
+    void Submit(const SubmitInfo& info) noexcept override {
+        unique_lock<mutex> lock(lock_);
+        cond_.wait(lock, [this] { return !blocked_; });
+        messages_.push_back(info.buf_);
+        thread_ids_.push_back(info.thread_);
+    }
+
+    void Block(bool blocked) {
+        {
+            lock_guard<mutex> lock(lock_);
+            blocked_ = blocked;
+        }
+        cond_.notify_all();
+    }
+
+    vector<string> GetMessages() const {
+        lock_guard<mutex> lock(lock_);
+        return messages_;
+    }
+
+    vector<thread::id> GetThreadIds() const {
+        lock_guard<mutex> lock(lock_);
+        return thread_ids_;
+    }
+
+private:
+    mutable mutex lock_;
+    condition_variable cond_;
+    bool blocked_ = false;
+    vector<string> messages_;
+    vector<thread::id> thread_ids_;
+};
+
+/*! Exposes the message formatting */
+class MessageWriter : public log::LogEventHandler
+{
+public:
+    MessageWriter()
+        : LogEventHandler("writer", log::LL_TRACE4, log::LA_DEFAULT_ENABLE) {}
+
+    void Submit(const SubmitInfo&) noexcept override {}
+
+    string Write(const string& msg) const {
+        const SubmitInfo si{log::LL_NOTICE, log::LA_GENERAL, msg, {}, {}, {}, {}};
+        ostringstream out;
+        WriteMessage(out, si);
+        return out.str();
+    }
+};
+
+/*! Stream buffer that counts the flushes */
+class CountingBuffer : public stringbuf
+{
+public:
+    int GetSyncs() const {
+        return syncs_;
+    }
+
+protected:
+    int sync() override {
+        ++syncs_;
+        return stringbuf::sync();
+    }
+
+private:
+    atomic<int> syncs_ {0};
+};
+
+/*! The original, char by char, implementation of WriteMessage() */
+string ReferenceWriteMessage(const string& msg) {
+    const locale loc;
+    ostringstream out;
+    string::const_iterator ch = msg.begin();
+    const string::const_iterator end = msg.end();
+    for(; ch != end; ++ch) {
+        const char c = *ch;
+        if ('\r' == c)
+            continue;
+        if ('\n' == c) {
+            if (++ch == end)
+                break;
+            --ch;
+            out << endl << "  ";
+        } else if (iscntrl(c, loc) && !isspace(c, loc)) {
+            const ios::fmtflags saved = out.flags();
+            out << '%' << setw(2) << setfill('0') << hex << ((unsigned int)c);
+            out.flags(saved);
+        } else {
+            out << c;
+        }
+    }
+    return out.str();
+}
+
+} // anonymous namespace
+
+const lest::test specification[] = {
+
+STARTCASE(Test_LogQueue_Block)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    auto queue = make_shared<log::LogQueue>(memory, 4, log::LogQueue::OP_BLOCK);
+    engine.AddHandler(queue);
+
+    for(int i = 0; i < 100; ++i) {
+        LOG_NOTICE << "Message " << i;
+    }
+
+    // Let the queue drain
+    while(queue->GetStats().written_ < 100) {
+        this_thread::sleep_for(1ms);
+    }
+
+    const auto messages = memory->GetMessages();
+    EXPECT(messages.size() == 100u);
+    EXPECT(messages.front() == "Message 0");
+    EXPECT(messages.back() == "Message 99");
+
+    // The records must carry the identity of the thread that logged them
+    EXPECT(memory->GetThreadIds().front() == this_thread::get_id());
+
+    const auto stats = queue->GetStats();
+    EXPECT(stats.queued_ == 100u);
+    EXPECT(stats.dropped_ == 0u);
+} ENDCASE
+
+STARTCASE(Test_LogQueue_Drop)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    auto stalled = make_shared<LogToMemory>();
+    auto queue = make_shared<log::LogQueue>(stalled, 8, log::LogQueue::OP_DROP);
+    engine.AddHandler(memory);
+    engine.AddHandler(queue);
+
+    stalled->Block(true);
+    for(int i = 0; i < 100; ++i) {
+        LOG_NOTICE << "Message " << i;
+    }
+
+    // The other handler is not affected by the stalled one
+    EXPECT(memory->GetMessages().size() == 100u);
+
+    stalled->Block(false);
+    while(queue->GetCount()) {
+        this_thread::sleep_for(1ms);
+    }
+
+    const auto stats = queue->GetStats();
+    EXPECT(stats.dropped_ > 0u);
+    EXPECT((stats.queued_ + stats.dropped_) == 100u);
+    // The batch the consumer was blocked on, and a full queue
+    EXPECT(stats.queued_ <= 16u);
+} ENDCASE
+
+STARTCASE(Test_LogQueue_Sample)
+{
+    log::LogEngine engine;
+    auto stalled = make_shared<LogToMemory>();
+    auto queue = make_shared<log::LogQueue>(stalled, 100, log::LogQueue::OP_SAMPLE, 10);
+    engine.AddHandler(queue);
+
+    stalled->Block(true);
+    for(int i = 0; i < 300; ++i) {
+        LOG_NOTICE << "Message " << i;
+    }
+    stalled->Block(false);
+
+    const auto stats = queue->GetStats();
+    EXPECT(stats.dropped_ > 0u);
+    EXPECT((stats.queued_ + stats.dropped_) == 300u);
+    // More than half the capacity, but far from all the messages. The
+    // consumer may have swapped out a batch before it blocked, so the
+    // queue itself can have sampled on top of that batch.
+    EXPECT(stats.queued_ > 51u);
+    EXPECT(stats.queued_ < 150u);
+} ENDCASE
+
+STARTCASE(Test_HandlerFilter)
+{
+    log::LogEngine engine;
+    auto general = make_shared<LogToMemory>(log::LL_NOTICE, log::LA_GENERAL);
+    auto network = make_shared<LogToMemory>(log::LL_NOTICE, log::LA_NETWORK);
+    engine.AddHandler(general);
+    engine.AddHandler(network);
+
+    LOG_NOTICE << "general";
+    LOG_NOTICE_F(log::LA_NETWORK) << "network";
+    LOG_NOTICE_F(log::LA_NETWORK | log::LA_GENERAL) << "both";
+    LOG_DEBUG_F(log::LA_NETWORK) << "debug";
+
+    EXPECT(general->GetMessages() == (vector<string>{"general", "both"}));
+    EXPECT(network->GetMessages() == (vector<string>{"network", "both"}));
+} ENDCASE
+
+STARTCASE(Test_ChangeHandlers)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>(log::LL_NOTICE, log::LA_GENERAL);
+    engine.AddHandler(memory);
+
+    EXPECT(log::LogEngine::IsRelevant(log::LL_NOTICE, log::LA_GENERAL));
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_DEBUG, log::LA_GENERAL));
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_NOTICE, log::LA_NETWORK));
+
+    memory->SetLevel(log::LL_DEBUG);
+    EXPECT(log::LogEngine::IsRelevant(log::LL_DEBUG, log::LA_GENERAL));
+
+    memory->SetFilter(log::LA_NETWORK);
+    EXPECT(log::LogEngine::IsRelevant(log::LL_DEBUG, log::LA_NETWORK));
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_DEBUG, log::LA_GENERAL));
+
+    engine.RemoveHandler(memory);
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_FATAL, log::LA_NETWORK));
+    const auto count = memory->GetMessages().size();
+    LOG_FATAL_F(log::LA_NETWORK) << "Not logged";
+    EXPECT(memory->GetMessages().size() == count);
+
+    // The engine does not keep removed handlers alive
+    weak_ptr<LogToMemory> removed = memory;
+    memory.reset();
+    EXPECT(removed.expired());
+} ENDCASE
+
+STARTCASE(Test_ConcurrentLogging)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    engine.AddHandler(memory);
+
+    vector<thread> threads;
+    for(int t = 0; t < 8; ++t) {
+        threads.emplace_back([t] {
+            for(int i = 0; i < 1000; ++i) {
+                LOG_NOTICE << "Thread " << t << " message " << i;
+            }
+        });
+    }
+
+    // Add and remove handlers while the other threads log
+    vector<weak_ptr<LogToMemory>> removed;
+    for(int i = 0; i < 20; ++i) {
+        auto other = make_shared<LogToMemory>();
+        engine.AddHandler(other);
+        engine.RemoveHandler(other);
+        removed.push_back(other);
+    }
+
+    for(auto& t : threads) {
+        t.join();
+    }
+
+    EXPECT(memory->GetMessages().size() == 8000u);
+
+    // Sets that were pinned by the logging threads are freed on the next change
+    engine.RemoveHandler(memory);
+    for(const auto& handler : removed) {
+        EXPECT(handler.expired());
+    }
+} ENDCASE
+
+STARTCASE(Test_RateLimited)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    engine.AddHandler(memory);
+
+    auto log_burst = [] {
+        for(int i = 0; i < 1000; ++i) {
+            LOG_NOTICE_RL(5) << "Message " << i;
+        }
+    };
+
+    log_burst();
+    auto messages = memory->GetMessages();
+    // We may cross into the next second during the burst
+    EXPECT(messages.size() >= 5u);
+    EXPECT(messages.size() <= 10u);
+    EXPECT(messages.front() == "Message 0");
+
+    this_thread::sleep_for(1100ms);
+    log_burst();
+    messages = memory->GetMessages();
+    bool reported = false;
+    for(const auto& m : messages) {
+        if (m.find(" messages suppressed] Message 0") != string::npos) {
+            reported = true;
+        }
+    }
+    EXPECT(reported);
+
+    // The limit holds when several threads share the call-site
+    this_thread::sleep_for(1100ms);
+    const auto before = memory->GetMessages().size();
+    vector<thread> threads;
+    for(int t = 0; t < 4; ++t) {
+        threads.emplace_back(log_burst);
+    }
+    for(auto& t : threads) {
+        t.join();
+    }
+    const auto logged = memory->GetMessages().size() - before;
+    EXPECT(logged >= 1u);
+    EXPECT(logged <= 10u);
+} ENDCASE
+
+STARTCASE(Test_Sampled)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    engine.AddHandler(memory);
+
+    for(int i = 0; i < 100; ++i) {
+        LOG_NOTICE_SAMPLED(10) << "Message " << i;
+    }
+
+    // Not relevant, so the sampler is not consulted
+    for(int i = 0; i < 100; ++i) {
+        LOG_DEBUG_SAMPLED(10) << "Message " << i;
+    }
+
+    const auto messages = memory->GetMessages();
+    EXPECT(messages.size() == 10u);
+    EXPECT(messages.at(0) == "Message 0");
+    EXPECT(messages.at(1) == "[9 messages suppressed] Message 10");
+
+    // Nothing is suppressed when every message is allowed
+    for(const std::uint32_t every : {0u, 1u}) {
+        const auto before = memory->GetMessages().size();
+        for(int i = 0; i < 3; ++i) {
+            LOG_NOTICE_SAMPLED(every) << "Every " << i;
+        }
+        const auto all = memory->GetMessages();
+        EXPECT(all.size() == before + 3u);
+        EXPECT(all.back() == "Every 2");
+    }
+} ENDCASE
+
+STARTCASE(Test_WriteMessage)
+{
+    const MessageWriter writer;
+
+    EXPECT(writer.Write("") == "");
+    EXPECT(writer.Write("Hello") == "Hello");
+    EXPECT(writer.Write("Hello\r\nWorld\n") == "Hello\n  World");
+    EXPECT(writer.Write("Tab\tis kept") == "Tab\tis kept");
+    EXPECT(writer.Write(string("Null\0Bell\a", 10)) == "Null%00Bell%07");
+    EXPECT(writer.Write("\x7f") == "%7f");
+
+    // Compare with the original implementation on random data, with
+    // the special characters at all offsets relative to the SIMD blocks.
+    mt19937 rnd(42);
+    uniform_int_distribution<int> any_char(0, 255);
+    uniform_int_distribution<int> printable(0x20, 0x7e);
+    uniform_int_distribution<int> percent(0, 99);
+    for(size_t len = 0; len < 300; ++len) {
+        for(int round = 0; round < 10; ++round) {
+            string msg;
+            for(size_t i = 0; i < len; ++i) {
+                const int kind = percent(rnd);
+                if (kind < 3) {
+                    msg += '\n';
+                } else if (kind < 5) {
+                    msg += '\r';
+                } else if (kind < (round * 2)) {
+                    msg += static_cast<char>(any_char(rnd));
+                } else {
+                    msg += static_cast<char>(printable(rnd));
+                }
+            }
+            EXPECT(writer.Write(msg) == ReferenceWriteMessage(msg));
+        }
+    }
+} ENDCASE
+
+STARTCASE(Test_Categories)
+{
+    log::LogEngine engine;
+
+    const auto db = log::LogEngine::RegisterCategory("DB");
+    EXPECT((db & log::LA_DEFAULT_ENABLE) == 0u);
+    EXPECT(log::LogEngine::GetCategoryFromName("DB") == db);
+    EXPECT(string(log::LogEngine::GetCategoryName(db)) == "DB");
+    EXPECT(log::LogEngine::GetCategoryFromName("NETWORK") == log::LA_NETWORK);
+    EXPECT_THROWS_AS(log::LogEngine::RegisterCategory("DB"), ExceptionAlreadyExist);
+
+    ostringstream filters;
+    log::LogEventHandler::WriteFilter(filters, log::LA_GENERAL | db, 0);
+    EXPECT(filters.str() == "GENERAL|DB ");
+
+    auto memory = make_shared<LogToMemory>(log::LL_NOTICE, log::LA_DEFAULT_ENABLE | db);
+    engine.AddHandler(memory);
+
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_TRACE2, db));
+
+    // Trace only the DB category
+    engine.SetCategoryLevel(db, log::LL_TRACE2);
+    EXPECT(log::LogEngine::IsRelevant(log::LL_TRACE2, db));
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_TRACE3, db));
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_DEBUG, log::LA_GENERAL));
+    EXPECT(memory->IsRelevant(log::LL_TRACE2, db | log::LA_GENERAL));
+
+    // Silence a noisy category
+    engine.SetCategoryLevel(log::LA_NETWORK, log::LL_ERROR);
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_NOTICE, log::LA_NETWORK));
+    EXPECT(log::LogEngine::IsRelevant(log::LL_NOTICE, log::LA_NETWORK | log::LA_GENERAL));
+
+    const auto count = memory->GetMessages().size();
+    LOG_TRACE2_F(db) << "db trace";
+    LOG_TRACE3_F(db) << "db trace3";
+    LOG_DEBUG << "general debug";
+    LOG_NOTICE_F(log::LA_NETWORK) << "network notice";
+    LOG_ERROR_F(log::LA_NETWORK) << "network error";
+
+    auto messages = memory->GetMessages();
+    messages.erase(messages.begin(), messages.begin() + count);
+    EXPECT(messages == (vector<string>{"db trace", "network error"}));
+
+    engine.ClearCategoryLevel(db | log::LA_NETWORK);
+    EXPECT_NOT(log::LogEngine::IsRelevant(log::LL_TRACE2, db));
+    EXPECT(log::LogEngine::IsRelevant(log::LL_NOTICE, log::LA_NETWORK));
+} ENDCASE
+
+STARTCASE(Test_FormatMacros)
+{
+    static_assert(log::CountFormatArgs("") == 0, "");
+    static_assert(log::CountFormatArgs("{} and {}") == 2, "");
+    static_assert(log::CountFormatArgs("{{}} {}") == 1, "");
+    static_assert(log::CountFormatArgs("{ }") == -1, "");
+    static_assert(log::CountFormatArgs("}") == -1, "");
+
+    // Same output as the ostream operators
+    auto expect_same = [&lest_env](const auto& value) {
+        ostringstream o;
+        o << value;
+        EXPECT(log::Format("{}", value) == o.str());
+    };
+
+    expect_same(0);
+    expect_same(-1);
+    expect_same(numeric_limits<int64_t>::min());
+    expect_same(numeric_limits<uint64_t>::max());
+    expect_same(static_cast<short>(-123));
+    expect_same(3.14159265);
+    expect_same(1e100);
+    expect_same(0.5f);
+    expect_same('x');
+    expect_same(true);
+    expect_same("text");
+    expect_same(string("string"));
+    expect_same(log::LL_WARNING);
+    expect_same(log::Esc("escaped"));
+    expect_same(static_cast<const void *>(&lest_env));
+    expect_same(static_cast<const void *>(nullptr));
+    expect_same(chrono::milliseconds(5).count());
+
+    EXPECT(log::Format("{{{}}} {}", 1, "two") == "{1} two");
+    EXPECT(log::Format("No args") == "No args");
+    EXPECT(log::Format("{}", static_cast<const char *>(nullptr)) == "(null)");
+
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    engine.AddHandler(memory);
+
+    int evaluated = 0;
+    auto count = [&evaluated] { return ++evaluated; };
+
+    LOG_NOTICE_FMT("Hello {}, you are {} years old", "Alice", 42);
+    LOG_NOTICE_FMT("No arguments");
+    LOG_NOTICE_F_FMT(log::LA_NETWORK, "Network {}", count());
+    LOG_DEBUG_FMT("Not relevant {}", count());
+    LOG_NOTICE_F_FMT(log::LA_FUNCTION_CALL | log::LA_GENERAL, "Fallback {}", log::Errno(0));
+
+    const auto messages = memory->GetMessages();
+    EXPECT(messages.size() == 4u);
+    EXPECT(messages.at(0) == "Hello Alice, you are 42 years old");
+    EXPECT(messages.at(1) == "No arguments");
+    EXPECT(messages.at(2) == "Network 1");
+    EXPECT(messages.at(3).find("Fallback {errno 0") == 0);
+    EXPECT(evaluated == 1);
+} ENDCASE
+
+STARTCASE(Test_Fields)
+{
+    {
+        ostringstream plain;
+        plain << log::Field("ratio", 0.5) << ' ' << log::Field("empty", "");
+        EXPECT(plain.str() == "ratio=0.5 empty=\"\"");
+    }
+
+    log::LogEngine engine;
+    ostringstream text;
+    engine.AddHandler(make_shared<log::LogToStream>(text));
+    const auto start = text.str().size();
+
+    LOG_NOTICE << "Done" << log::Field("status", 200) << log::Field("ok", true)
+        << log::Field("user", "John \"Doe\"") << log::Field("delta", -3);
+
+    const string line = text.str().substr(start);
+    EXPECT(line.find(": Done status=200 ok=true user=\"John \\\"Doe\\\"\" delta=-3\n")
+           != string::npos);
+
+    const log::LogEventHandler::SubmitInfo si{log::LL_WARNING,
+        log::LA_GENERAL | log::LA_NETWORK, "Line\n\"two\"",
+        TscClock::FromSystemTime(chrono::system_clock::from_time_t(0) + 500500us), {},
+        {log::Field("count", 7u), log::Field("name", "a\tb"),
+         log::Field("nan", numeric_limits<double>::quiet_NaN())}, {}};
+    ostringstream json;
+    log::LogToJsonFile::WriteJson(json, si);
+    const string expected_start = R"({"ts":"1970-01-01T00:00:00.500Z","level":"WARN","filter":["GENERAL","NETWORK"],"thread":")";
+    const string expected_end = R"(","msg":"Line\n\"two\"","fields":{"count":7,"name":"a\tb","nan":null}})";
+    EXPECT(json.str().find(expected_start) == 0);
+    EXPECT(json.str().rfind(expected_end) == json.str().size() - expected_end.size());
+} ENDCASE
+
+STARTCASE(Test_FlightRecorder)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    auto target = make_shared<LogToMemory>(log::LL_FATAL);
+    auto recorder = make_shared<log::LogFlightRecorder>(4, target);
+    engine.AddHandler(memory);
+    engine.AddHandler(recorder);
+    const auto count = memory->GetMessages().size();
+
+    for(int i = 0; i < 10; ++i) {
+        LOG_TRACE4 << "trace " << i;
+    }
+    thread([] {
+        LOG_DEBUG << "other thread";
+    }).join();
+
+    // The other handlers are not affected
+    EXPECT(memory->GetMessages().size() == count);
+    EXPECT(recorder->GetCount() == 5u);
+
+    ostringstream dump;
+    recorder->Dump(dump);
+    EXPECT(dump.str().find("trace 5") == string::npos);
+    EXPECT(dump.str().find("trace 6") != string::npos);
+    EXPECT(dump.str().find("trace 9") != string::npos);
+    EXPECT(dump.str().find("other thread") != string::npos);
+    EXPECT(dump.str().find("trace 6") < dump.str().find("trace 9"));
+
+    EXPECT(target->GetMessages().empty());
+    LOG_FATAL << "fatal";
+    const auto dumped = target->GetMessages();
+    EXPECT(dumped.size() == 5u);
+    EXPECT(dumped.back() == "[flight-recorder] fatal");
+} ENDCASE
+
+STARTCASE(Test_LogContext)
+{
+    log::LogEngine engine;
+    auto memory = make_shared<LogToMemory>();
+    engine.AddHandler(memory);
+    Pipeline pipeline("ctx-test");
+    const auto count = memory->GetMessages().size();
+
+    LOG_TRACE2 << "not logged";
+    {
+        const log::ScopedLogContext scope({log::LL_TRACE2, log::LA_NETWORK});
+        EXPECT(log::LogContext::IsAnyActive());
+        LOG_TRACE2_F(log::LA_NETWORK) << "in context";
+        LOG_TRACE3_F(log::LA_NETWORK) << "too detailed";
+        LOG_TRACE2 << "wrong filter";
+
+        thread([] {
+            LOG_TRACE2_F(log::LA_NETWORK) << "other thread";
+        }).join();
+
+        pipeline.PostSynchronously({[] {
+            LOG_TRACE2_F(log::LA_NETWORK) << "posted";
+        }, "posted"});
+
+        pipeline.PostWithTimer({[] {
+            LOG_TRACE2_F(log::LA_NETWORK) << "timer";
+        }, "timer"}, 1);
+    }
+
+    // Runs after the timer, without a context
+    this_thread::sleep_for(20ms);
+    pipeline.PostSynchronously({[] {
+        LOG_TRACE2_F(log::LA_NETWORK) << "posted without context";
+    }, "posted"});
+
+    // A task that replaces a pending unique task runs with its own context
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    pipeline.Post({[released] { released.wait(); }, "blocker"});
+    {
+        const log::ScopedLogContext scope({log::LL_TRACE2, log::LA_NETWORK});
+        pipeline.PostUnique("a", {[] {
+            LOG_TRACE2_F(log::LA_NETWORK) << "replaced";
+        }, "unique"});
+    }
+    pipeline.PostUnique("a", {[] {
+        LOG_TRACE2_F(log::LA_NETWORK) << "unique without context";
+    }, "unique"});
+    pipeline.PostUnique("b", {[] {
+        LOG_TRACE2_F(log::LA_NETWORK) << "replaced";
+    }, "unique"});
+    {
+        const log::ScopedLogContext scope({log::LL_TRACE2, log::LA_NETWORK});
+        pipeline.PostUnique("b", {[] {
+            LOG_TRACE2_F(log::LA_NETWORK) << "unique with context";
+        }, "unique"});
+    }
+    release.set_value();
+    pipeline.PostSynchronously({[] {}, "sync"});
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+    EXPECT_NOT(log::LogContext::IsAnyActive());
+
+    auto messages = memory->GetMessages();
+    messages.erase(messages.begin(), messages.begin() + count);
+    EXPECT(messages == (vector<string>{"in context", "posted", "timer",
+                                       "unique with context"}));
+} ENDCASE
+
+STARTCASE(Test_FlushPolicy)
+{
+    log::LogEngine engine;
+    CountingBuffer buffer;
+    ostream out(&buffer);
+    auto handler = make_shared<log::LogToStream>(out);
+    engine.AddHandler(handler);
+
+    // The default is to flush every record
+    auto syncs = buffer.GetSyncs();
+    LOG_NOTICE << "one";
+    LOG_NOTICE << "two";
+    EXPECT(buffer.GetSyncs() == syncs + 2);
+
+    handler->SetFlushPolicy(log::FlushPolicy::Batched(10, 0ms));
+    syncs = buffer.GetSyncs();
+    for(int i = 0; i < 25; ++i) {
+        LOG_NOTICE << "Message " << i;
+    }
+    EXPECT(buffer.GetSyncs() == syncs + 2);
+    LOG_ERROR << "error";
+    EXPECT(buffer.GetSyncs() == syncs + 3);
+
+    handler->SetFlushPolicy(log::FlushPolicy::Never());
+    syncs = buffer.GetSyncs();
+    for(int i = 0; i < 25; ++i) {
+        LOG_ERROR << "Error " << i;
+    }
+    EXPECT(buffer.GetSyncs() == syncs);
+    LOG_FATAL << "fatal";
+    EXPECT(buffer.GetSyncs() == syncs + 1);
+
+    handler->SetFlushPolicy(log::FlushPolicy::Batched(0, 10ms));
+    syncs = buffer.GetSyncs();
+    LOG_NOTICE << "timed";
+    EXPECT(buffer.GetSyncs() == syncs);
+    for(int i = 0; (i < 1000) && (buffer.GetSyncs() == syncs); ++i) {
+        this_thread::sleep_for(1ms);
+    }
+    EXPECT(buffer.GetSyncs() == syncs + 1);
+} ENDCASE
+
+STARTCASE(Test_ThreadIdentity)
+{
+    const auto& me = log::ThreadIdentity::GetCurrent();
+    EXPECT(me.GetId() > 0u);
+    EXPECT(me.GetText() == ("#" + to_string(me.GetId())));
+
+    log::LogEngine engine;
+    ostringstream out;
+    auto queue = make_shared<log::LogQueue>(make_shared<log::LogToStream>(out));
+    engine.AddHandler(queue);
+
+    uint32_t producer_id = 0;
+    size_t truncated_size = 0;
+    thread([&] {
+        log::ThreadIdentity::SetName("producer");
+        producer_id = log::ThreadIdentity::GetCurrent().GetId();
+        LOG_NOTICE << "from producer";
+
+        log::ThreadIdentity::SetName(string(100, 'x'));
+        truncated_size = log::ThreadIdentity::GetCurrent().GetText().size();
+    }).join();
+
+    EXPECT(truncated_size == log::ThreadIdentity::max_length);
+
+    while(queue->GetStats().written_ < queue->GetStats().queued_) {
+        this_thread::sleep_for(1ms);
+    }
+
+    // The queue's thread writes the line, with the identity of the producer
+    const string expected = " producer#" + to_string(producer_id) + " NOTICE: from producer";
+    EXPECT(out.str().find(expected) != string::npos);
+} ENDCASE
+
+STARTCASE(Test_TscClock)
+{
+    const auto ticks = TscClock::Ticks();
+    const auto system_now = chrono::system_clock::now();
+    const auto diff = TscClock::ToSystemTime(ticks) - system_now;
+    EXPECT(std::abs(chrono::duration_cast<chrono::milliseconds>(diff).count()) < 50);
+
+    const auto start = TscClock::now();
+    const auto steady_start = chrono::steady_clock::now();
+    this_thread::sleep_for(20ms);
+    const auto elapsed = TscClock::now() - start;
+    const auto steady_elapsed = chrono::steady_clock::now() - steady_start;
+    EXPECT(elapsed >= 20ms);
+    EXPECT(elapsed <= steady_elapsed + 1ms);
+
+    auto prev = TscClock::now();
+    for(int i = 0; i < 10000; ++i) {
+        const auto now = TscClock::now();
+        EXPECT(now >= prev);
+        prev = now;
+    }
+
+    const auto when = chrono::system_clock::from_time_t(1000000000) + 123ms;
+    const auto back = TscClock::ToSystemTime(TscClock::FromSystemTime(when));
+    EXPECT(std::abs(chrono::duration_cast<chrono::microseconds>(back - when).count()) < 1000);
+
+    // The snapshot gives the same wall time as the clock
+    auto snapshot = TscClock::GetWallTimeSnapshot();
+    TscClock::UpdateWallTimeSnapshot(snapshot);
+    const auto later = TscClock::Ticks();
+    const auto snapshot_diff = snapshot.ToSystemTime(later) - TscClock::ToSystemTime(later);
+    EXPECT(std::abs(chrono::duration_cast<chrono::microseconds>(snapshot_diff).count()) < 1000);
+} ENDCASE
+
+STARTCASE(Test_LogCallSite)
+{
+    log::LogEngine engine;
+    auto handler = make_shared<LogToMemory>(log::LL_TRACE4);
+    engine.AddHandler(handler);
+
+    // This is what the log macros do when WAR_LOG_CALLSITE_STATS is defined
+    static log::LogCallSite streamed(__FILE__, __LINE__, log::LL_NOTICE);
+    static log::LogCallSite formatted(__FILE__, __LINE__, log::LL_DEBUG);
+
+    // When the library is built with WAR_LOG_CALLSITE_STATS, its own log
+    // statements have call-sites as well.
+    log::LogCallSite::Reset();
+    for(int i = 0; i < 10; ++i) {
+        log::Log(log::LL_NOTICE, log::LA_GENERAL, streamed).Get() << "Message #" << i;
+        log::SubmitFormatted(formatted, log::LL_DEBUG, log::LA_GENERAL, "{}", "0123456789ABCDEF");
+    }
+
+    // The first message is from the engine, when the handler was added
+    EXPECT(handler->GetMessages().size() == 21u);
+    EXPECT(handler->GetMessages().at(1) == "Message #0");
+
+    const auto all = log::LogCallSite::GetAll();
+    const auto find_site = [&all](const log::LogCallSite& site) {
+        const auto wanted = site.GetStats();
+        const auto it = find_if(all.begin(), all.end(), [&wanted](const log::LogCallSite::Stats& stats) {
+            return (stats.line == wanted.line) && (strcmp(stats.file, wanted.file) == 0);
+        });
+        return (it != all.end()) ? *it : log::LogCallSite::Stats{};
+    };
+
+    const auto debug = find_site(formatted);
+    EXPECT(debug.bytes == 160u);
+    EXPECT(debug.count == 10u);
+    EXPECT(debug.level == log::LL_DEBUG);
+
+    const auto notice = find_site(streamed);
+    EXPECT(notice.bytes == 100u);
+    EXPECT(notice.level == log::LL_NOTICE);
+    EXPECT(notice.format_time.count() > 0);
+
+    // The most bytes first
+    EXPECT(is_sorted(all.begin(), all.end(), [](const log::LogCallSite::Stats& left,
+                                                 const log::LogCallSite::Stats& right) {
+        return left.bytes > right.bytes;
+    }));
+
+    ostringstream out;
+    log::LogCallSite::Dump(out);
+    const auto dump = out.str();
+    const auto debug_row = dump.find("test_log.cpp:" + to_string(debug.line));
+    EXPECT(debug_row != string::npos);
+    const auto row_start = dump.rfind('\n', debug_row) + 1;
+    EXPECT(dump.substr(row_start, debug_row - row_start).find("DEBUG") != string::npos);
+
+    // Dump(out, 1) writes the header and one row
+    ostringstream top;
+    log::LogCallSite::Dump(top, 1);
+    const auto top_dump = top.str();
+    EXPECT(count(top_dump.begin(), top_dump.end(), '\n') == 2);
+
+    log::LogCallSite::Reset();
+    EXPECT(streamed.GetStats().count == 0u);
+    EXPECT(formatted.GetStats().count == 0u);
+} ENDCASE
+
+STARTCASE(Test_LogIndex)
+{
+    const string path = "test_log_index.log";
+    const auto base = chrono::system_clock::from_time_t(1500000000) + 500ms;
+
+    const auto write_records = [&](log::LogEventHandler& handler, const int first) {
+        for(int i = first; i < 300; ++i) {
+            const log::LogEventHandler::SubmitInfo si{
+                (i % 2) ? log::LL_DEBUG : log::LL_WARNING,
+                static_cast<log::filter_t>((i % 3) ? log::LA_GENERAL
+                                                   : log::LA_GENERAL | log::LA_NETWORK),
+                "Record #" + to_string(i),
+                TscClock::FromSystemTime(base + chrono::seconds(i)), {}, {}, {}};
+            handler.Submit(si);
+        }
+    };
+
+    for(const bool json : {false, true}) {
+        {
+            auto handler = json ? log::LogToJsonFile::Create(path, true)
+                                : log::LogToFile::Create(path, true);
+            auto& file = dynamic_cast<log::LogToFile&>(*handler);
+            file.EnableIndex(512);
+            write_records(*handler, 0);
+        }
+
+        // Every entry must point to the start of the first record after it
+        const auto index = log::ReadLogIndex(path);
+        EXPECT(index.size() > 10u);
+        ifstream in(path);
+        for(size_t i = 0; i < index.size(); ++i) {
+            in.seekg(static_cast<streamoff>(index[i].second));
+            string line;
+            EXPECT(getline(in, line));
+            const auto nr = line.substr(line.find("Record #") + 8);
+            const auto diff = index[i].first - (base + chrono::seconds(stoi(nr)));
+            EXPECT(std::abs(chrono::duration_cast<chrono::milliseconds>(diff).count()) <= 1);
+        }
+
+        log::LogQuery query;
+        query.from_ = base + 100s - 250ms;
+        query.to_ = base + 109s + 250ms;
+        ostringstream out;
+        EXPECT(log::QueryLogFile(path, query, out) == 10u);
+        EXPECT(out.str().find("Record #100") != string::npos);
+        EXPECT(out.str().find("Record #99") == string::npos);
+        EXPECT(out.str().find("Record #110") == string::npos);
+
+        query.level_ = log::LL_WARNING;
+        out.str("");
+        EXPECT(log::QueryLogFile(path, query, out) == 5u);
+        EXPECT(out.str().find("DEBUG") == string::npos);
+
+        query.level_ = log::LL_TRACE4;
+        query.categories_ = {"NETWORK"};
+        EXPECT(log::QueryLogFile(path, query, out) == 3u);
+    }
+
+    // A new log-file must not append to the index left behind by the old one
+    EXPECT(boost::filesystem::remove(path));
+    EXPECT(boost::filesystem::exists(path + ".idx"));
+    {
+        auto handler = log::LogToFile::Create(path, false);
+        dynamic_cast<log::LogToFile&>(*handler).EnableIndex(512);
+        write_records(*handler, 200);
+    }
+
+    {
+        const auto index = log::ReadLogIndex(path);
+        EXPECT(index.size() > 3u);
+        EXPECT(index.front().second == 0u);
+        EXPECT(std::abs(chrono::duration_cast<chrono::milliseconds>(
+            index.front().first - (base + 200s)).count()) <= 1);
+
+        log::LogQuery query;
+        query.from_ = base + 250s - 250ms;
+        query.to_ = base + 259s + 250ms;
+        ostringstream out;
+        EXPECT(log::QueryLogFile(path, query, out) == 10u);
+        EXPECT(out.str().find("Record #250") != string::npos);
+    }
+
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(path + ".idx");
+} ENDCASE
+
+}; //lest
+
+
+int main( int argc, char * argv[] )
+{
+    return lest::run( specification, argc, argv );
+}
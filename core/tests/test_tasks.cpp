@@ -2,8 +2,16 @@
 #define BOOST_TEST_MODULE WarlibTests
 #include "war_tests.h"
 #include <chrono>
+#include <csignal>
+#include <sstream>
 #include <warlib/WarPipeline.h>
+#include <warlib/WarThreadpool.h>
+#include <warlib/rate_limited_executor.h>
+#include <warlib/task_trace.h>
+#include <warlib/watchdog.h>
 #include <warlib/basics.h>
+#include <warlib/batcher.h>
+#include <warlib/channel.h>
 #include <warlib/WarLog.h>
 
 
@@ -261,6 +269,607 @@ STARTCASE(Test_Pipeline)
     EXPECT(pipeline->IsClosed());
     pipeline.reset();
 } ENDCASE
+
+STARTCASE(Test_TaskStats)
+{
+    Threadpool pool(2);
+    pool.EnableTaskStats();
+
+    const auto spin = [](const chrono::milliseconds duration) {
+        const auto until = chrono::steady_clock::now() + duration;
+        while(chrono::steady_clock::now() < until)
+            ;
+    };
+
+    for(int i = 0; i < 10; ++i) {
+        pool.Post({[&spin] { spin(2ms); }, "busy"});
+        pool.Post({[] { this_thread::sleep_for(2ms); }, "sleepy"});
+    }
+    pool.GetPipeline(0).PostSynchronously({[&spin] { spin(1ms); }, "sync"});
+
+    const auto stats = pool.GetTaskStats();
+    const auto find = [&stats](const string& name) {
+        return find_if(stats.begin(), stats.end(), [&name](const auto& s) {
+            return name == s.name;
+        });
+    };
+
+    const auto busy = find("busy");
+    const auto sleepy = find("sleepy");
+    const auto sync = find("sync");
+    EXPECT(busy != stats.end());
+    EXPECT(sleepy != stats.end());
+    EXPECT(sync != stats.end());
+    EXPECT(busy->count == 10u);
+    EXPECT(sleepy->count == 10u);
+    EXPECT(sync->count == 1u);
+    EXPECT(busy->wall_time >= 20ms);
+    EXPECT(sleepy->wall_time >= 20ms);
+    EXPECT(busy->max_wall_time >= 2ms);
+    EXPECT(busy->max_wall_time <= busy->wall_time);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    // Sleeping does not use CPU
+    EXPECT(busy->cpu_time > sleepy->cpu_time);
+#endif
+
+    pool.ResetTaskStats();
+    pool.EnableTaskStats(false);
+    pool.Post({[] {}, "not-counted"});
+    EXPECT(pool.GetTaskStats().empty());
+
+    pool.Close();
+    pool.WaitUntilClosed();
+
+    // Still available after the pool is closed
+    EXPECT(pool.GetTaskStats().empty());
+} ENDCASE
+
+STARTCASE(Test_TaskTrace)
+{
+    TaskTrace::Start(1024);
+    {
+        Threadpool pool(2);
+        for(int i = 0; i < 10; ++i) {
+            pool.Post({[] { this_thread::sleep_for(1ms); }, "traced"});
+        }
+        pool.PostWithTimer({[] {}, "timed"}, 1);
+        pool.GetPipeline(0).PostSynchronously({[] {}, "sync"});
+        this_thread::sleep_for(50ms);
+        pool.Close();
+        pool.WaitUntilClosed();
+    }
+    TaskTrace::Stop();
+
+    ostringstream out;
+    EXPECT(TaskTrace::WriteChromeTrace(out) > 20u);
+    const auto json = out.str();
+    EXPECT(json.find("{\"traceEvents\":[") == 0);
+    EXPECT(json.find("\"name\":\"Pool-worker_0") != string::npos);
+    EXPECT(json.find("{\"ph\":\"X\",\"name\":\"traced\",\"cat\":\"task\"") != string::npos);
+    EXPECT(json.find("{\"ph\":\"X\",\"name\":\"traced\",\"cat\":\"enqueue\"") != string::npos);
+    EXPECT(json.find("{\"ph\":\"X\",\"name\":\"timed\",\"cat\":\"timer\"") != string::npos);
+    EXPECT(json.find("{\"ph\":\"i\",\"name\":\"timed\",\"cat\":\"timer\"") != string::npos);
+    EXPECT(json.find("\"ph\":\"f\"") != string::npos);
+
+    // Nothing was recorded in the last 20 milliseconds
+    this_thread::sleep_for(30ms);
+    ostringstream recent;
+    EXPECT(TaskTrace::WriteChromeTrace(recent, 20ms) == 0u);
+
+    TaskTrace::Clear();
+    ostringstream cleared;
+    EXPECT(TaskTrace::WriteChromeTrace(cleared) == 0u);
+
+    // Threads that have exited give their buffers to new threads
+    TaskTrace::Start(1024);
+    const auto buffers = TaskTrace::GetBufferCount();
+    for(int i = 0; i < 10; ++i) {
+        thread([] {
+            TaskTrace::Record(TaskTrace::ET_RESUME, "short-lived");
+        }).join();
+    }
+    TaskTrace::Stop();
+    EXPECT(TaskTrace::GetBufferCount() <= buffers + 1);
+
+    ostringstream reused;
+    EXPECT(TaskTrace::WriteChromeTrace(reused) >= 1u);
+    EXPECT(reused.str().find("short-lived") != string::npos);
+    TaskTrace::Clear();
+} ENDCASE
+
+STARTCASE(Test_Watchdog)
+{
+    Pipeline pipeline("Watched");
+
+    mutex lock;
+    vector<Watchdog::Report> reports;
+    Watchdog::Config config;
+    config.threshold = 50ms;
+    config.interval = 10ms;
+    config.stack_trace = true;
+#if defined(__linux__) && defined(__GLIBC__)
+    config.stack_trace_signal = SIGRTMIN + 5;
+#endif
+    Watchdog watchdog(config, [&](const Watchdog::Report& report) {
+        lock_guard<mutex> guard(lock);
+        reports.push_back(report);
+    });
+    watchdog.Watch(pipeline);
+
+    EXPECT(pipeline.GetCurrentTask().name == nullptr);
+    pipeline.Post({[] {}, "quick"});
+    pipeline.Post({[] { this_thread::sleep_for(200ms); }, "blocker"});
+    string current;
+    pipeline.PostSynchronously({[&pipeline, &current] {
+        current = pipeline.GetCurrentTask().name;
+    }, "sync"});
+    EXPECT(current == "Post Synchronously");
+
+    // The caller is woken from inside the task, so let it finish first
+    for(int i = 0; (i < 1000) && (pipeline.GetCurrentTask().name != nullptr); ++i) {
+        this_thread::sleep_for(1ms);
+    }
+    EXPECT(pipeline.GetCurrentTask().name == nullptr);
+    EXPECT(pipeline.GetMaxTaskDuration() >= 200ms);
+    pipeline.ResetMaxTaskDuration();
+    EXPECT(pipeline.GetMaxTaskDuration() == 0ns);
+
+    {
+        lock_guard<mutex> guard(lock);
+        EXPECT(reports.size() == 1u);
+        EXPECT(watchdog.GetReportCount() == 1u);
+        EXPECT(string(reports.at(0).task) == "blocker");
+        EXPECT(reports.at(0).pipeline == &pipeline);
+        EXPECT(reports.at(0).duration >= 50ms);
+#if defined(__linux__) && defined(__GLIBC__)
+        EXPECT_NOT(reports.at(0).stack.empty());
+#endif
+    }
+
+    watchdog.Unwatch(pipeline);
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+} ENDCASE
+
+STARTCASE(Test_PostWithDeadline)
+{
+    Pipeline pipeline("Deadlines");
+
+    bool expired_ran = false, fresh_ran = false;
+    int expired_callbacks = 0;
+
+    pipeline.Post({[] { this_thread::sleep_for(50ms); }, "busy"});
+    pipeline.PostWithDeadline({[&] { expired_ran = true; }, "expired"},
+                              TscClock::now() + 10ms,
+                              [&] { ++expired_callbacks; });
+    pipeline.PostWithDeadline({[&] { fresh_ran = true; }, "fresh"},
+                              TscClock::now() + 10s);
+    pipeline.PostSynchronously({[] {}, "sync"});
+
+    EXPECT_NOT(expired_ran);
+    EXPECT(fresh_ran);
+    EXPECT(expired_callbacks == 1);
+    EXPECT(pipeline.GetExpiredCount() == 1u);
+    EXPECT(pipeline.GetCount() == 0u);
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+} ENDCASE
+
+STARTCASE(Test_PostUnique)
+{
+    Pipeline pipeline("Unique");
+
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    pipeline.Post({[released] { released.wait(); }, "blocker"});
+
+    int replaced = 0, replaced_runs = 0, kept = 0, kept_runs = 0;
+    int queued = 0;
+    for(int i = 1; i <= 5; ++i) {
+        queued += pipeline.PostUnique("replace", {[&, i] { replaced = i; ++replaced_runs; }, "replace"}) ? 1 : 0;
+        queued += pipeline.PostUnique("drop", {[&, i] { kept = i; ++kept_runs; }, "drop"},
+                                      Pipeline::UM_DROP) ? 1 : 0;
+    }
+    EXPECT(queued == 2);
+    release.set_value();
+    pipeline.PostSynchronously({[] {}, "sync"});
+
+    EXPECT(replaced == 5);
+    EXPECT(replaced_runs == 1);
+    EXPECT(kept == 1);
+    EXPECT(kept_runs == 1);
+
+    // When the task has started, a new post is queued
+    EXPECT(pipeline.PostUnique("replace", {[&] { ++replaced_runs; }, "replace"}));
+    pipeline.PostSynchronously({[] {}, "sync"});
+    EXPECT(replaced_runs == 2);
+
+    std::atomic_int debounced{0}, debounced_runs{0};
+    for(int i = 1; i <= 5; ++i) {
+        pipeline.PostDebounced("debounce", {[&, i] { debounced = i; ++debounced_runs; }, "debounce"}, 20);
+    }
+    for(int i = 0; (i < 100) && !debounced_runs; ++i) {
+        this_thread::sleep_for(10ms);
+    }
+    this_thread::sleep_for(50ms);
+    EXPECT(debounced == 5);
+    EXPECT(debounced_runs == 1);
+
+    // A shorter delay runs before the timer from an earlier post
+    std::atomic_int second{0};
+    pipeline.PostDebounced("debounce2", {[&] { second = 1; }, "debounce"}, 300);
+    pipeline.PostDebounced("debounce2", {[&] { second = 2; }, "debounce"}, 10);
+    for(int i = 0; (i < 100) && !second; ++i) {
+        this_thread::sleep_for(5ms);
+    }
+    EXPECT(second == 2);
+
+    // The timer from the first post must not run a new post early
+    pipeline.PostDebounced("debounce2", {[&] { second = 3; }, "debounce"}, 600);
+    this_thread::sleep_for(400ms);
+    EXPECT(second == 2);
+    for(int i = 0; (i < 100) && (second != 3); ++i) {
+        this_thread::sleep_for(10ms);
+    }
+    EXPECT(second == 3);
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+} ENDCASE
+
+STARTCASE(Test_Batcher)
+{
+    Pipeline pipeline("Batcher");
+
+    mutex lock;
+    vector<size_t> sizes;
+    uint64_t sum = 0, items = 0;
+    bool on_pipeline = true;
+    const void *buffer = nullptr;
+    bool recycled = false;
+
+    auto batcher = make_unique<Batcher<int>>(pipeline, [&](vector<int>&& batch) {
+        lock_guard<mutex> guard(lock);
+        on_pipeline = on_pipeline && pipeline.IsPipelineThread();
+        sizes.push_back(batch.size());
+        for(const auto v : batch) {
+            sum += v;
+        }
+        items += batch.size();
+        recycled = recycled || (buffer == batch.data());
+        buffer = batch.data();
+    }, 10, 20ms, 256);
+
+    vector<thread> producers;
+    for(int t = 0; t < 4; ++t) {
+        producers.emplace_back([&batcher] {
+            for(int i = 1; i <= 1000; ++i) {
+                while(!batcher->Add(i)) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+    for(auto& producer : producers) {
+        producer.join();
+    }
+
+    const auto wait_for = [&](const uint64_t expected) {
+        for(int i = 0; i < 200; ++i) {
+            {
+                lock_guard<mutex> guard(lock);
+                if (items >= expected) {
+                    return;
+                }
+            }
+            this_thread::sleep_for(5ms);
+        }
+    };
+
+    wait_for(4000);
+    {
+        lock_guard<mutex> guard(lock);
+        EXPECT(items == 4000u);
+        EXPECT(sum == 4u * 500500u);
+        EXPECT(on_pipeline);
+        EXPECT(recycled);
+        EXPECT(all_of(sizes.begin(), sizes.end(), [](auto s) { return s > 0 && s <= 10; }));
+        sizes.clear();
+    }
+
+    // Less than a batch is flushed by the timer
+    EXPECT(batcher->Add(1));
+    EXPECT(batcher->Add(2));
+    wait_for(4002);
+    {
+        lock_guard<mutex> guard(lock);
+        EXPECT(items == 4002u);
+        EXPECT(sizes.size() == 1u);
+        sizes.clear();
+    }
+
+    // The destructor delivers the pending items before it returns
+    EXPECT(batcher->Add(3));
+    batcher.reset();
+    {
+        lock_guard<mutex> guard(lock);
+        EXPECT(items == 4003u);
+        EXPECT(sizes.size() == 1u);
+    }
+
+    // The timer that was armed does not call the handler after that
+    this_thread::sleep_for(50ms);
+    {
+        lock_guard<mutex> guard(lock);
+        EXPECT(sizes.size() == 1u);
+    }
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+
+    // The destructor does not wait for a pipeline that is closed
+    Batcher<int> orphan(pipeline, [](vector<int>&&) {});
+    EXPECT(orphan.Add(1));
+} ENDCASE
+
+STARTCASE(Test_RateLimitedExecutor)
+{
+    Pipeline pipeline("RateLimited");
+
+    {
+        RateLimitedExecutor executor(pipeline, 100, 5);
+        std::atomic_int count{0};
+        const auto start = chrono::steady_clock::now();
+        for(int i = 0; i < 15; ++i) {
+            executor.Post({[&count] { ++count; }, "limited"});
+        }
+
+        // The burst runs at once, the rest is queued
+        EXPECT(executor.GetQueueDepth() >= 9u);
+        EXPECT(executor.GetQueueDepth() <= 10u);
+
+        for(int i = 0; (i < 200) && (count < 15); ++i) {
+            this_thread::sleep_for(5ms);
+        }
+        const auto elapsed = chrono::steady_clock::now() - start;
+        EXPECT(count == 15);
+        EXPECT(elapsed >= 80ms);
+
+        const auto stats = executor.GetStats();
+        EXPECT(stats.queue_depth == 0u);
+        EXPECT(stats.released == 15u);
+        EXPECT(stats.delayed >= 9u);
+        EXPECT(stats.max_wait >= 50ms);
+        EXPECT(stats.total_wait >= stats.max_wait);
+    }
+
+    {
+        RateLimitedExecutor executor(pipeline, 1, 1, 2);
+        executor.Post({[] {}, "now"});
+        executor.Post({[] {}, "queued"});
+        executor.Post({[] {}, "queued"});
+        EXPECT_THROWS_AS(executor.Post({[] {}, "full"}),
+                         RateLimitedExecutor::ExceptionCapacityExceeded);
+    }
+
+    EXPECT_THROWS_AS(RateLimitedExecutor(pipeline, 0, 1), ExceptionOutOfRange);
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+} ENDCASE
+
+STARTCASE(Test_RateLimitedExecutorFullPipeline)
+{
+    // Room for one queued task. A running task does not count.
+    Pipeline pipeline("RateLimitedFull", -1, 1);
+
+    {
+        promise<void> started, gate;
+        auto gate_future = gate.get_future().share();
+        pipeline.Post({[&started, gate_future] {
+            started.set_value();
+            gate_future.wait();
+        }, "blocker"});
+        started.get_future().wait();
+        pipeline.Post({[] {}, "filler"});
+
+        // The token must be given back when the pipeline refuses the task
+        RateLimitedExecutor executor(pipeline, 1, 1);
+        EXPECT_THROWS_AS(executor.Post({[] {}, "refused"}), Pipeline::ExceptionCapacityExceeded);
+        EXPECT_THROWS_AS(executor.Post({[] {}, "refused"}), Pipeline::ExceptionCapacityExceeded);
+        EXPECT(executor.GetQueueDepth() == 0u);
+        EXPECT(executor.GetStats().released == 0u);
+
+        gate.set_value();
+        for(int i = 0; (i < 200) && (pipeline.GetCount() > 0); ++i) {
+            this_thread::sleep_for(5ms);
+        }
+    }
+
+    {
+        RateLimitedExecutor executor(pipeline, 20, 2);
+        promise<void> started, gate;
+        auto gate_future = gate.get_future().share();
+        std::atomic_int count{0};
+
+        executor.Post({[&started, gate_future] {
+            started.set_value();
+            gate_future.wait();
+        }, "blocker"});
+        started.get_future().wait();
+
+        // The first uses the last token. The rest are queued.
+        for(int i = 0; i < 4; ++i) {
+            executor.Post({[&count] { ++count; }, "limited"});
+        }
+        EXPECT(executor.GetQueueDepth() == 3u);
+
+        // Let the bucket fill up, so the timer releases more tasks than the pipeline has room for
+        this_thread::sleep_for(150ms);
+        gate.set_value();
+
+        for(int i = 0; (i < 200) && (count < 4); ++i) {
+            this_thread::sleep_for(5ms);
+        }
+        EXPECT(count == 4);
+
+        const auto stats = executor.GetStats();
+        EXPECT(stats.queue_depth == 0u);
+        EXPECT(stats.released == 5u);
+        EXPECT(stats.delayed == 3u);
+        EXPECT(stats.requeued >= 1u);
+    }
+
+    pipeline.Close();
+    pipeline.WaitUntilClosed();
+} ENDCASE
+
+STARTCASE(Test_Channel)
+{
+    Pipeline receiver("Receiver");
+    Pipeline sender("Sender");
+
+    // Items are moved, so move-only types work
+    {
+        Channel<unique_ptr<int>> channel(receiver, 16, 8);
+
+        mutex lock;
+        uint64_t sum = 0, items = 0;
+        size_t max_batch = 0;
+        bool on_pipeline = true;
+        channel.SetReceiver([&](vector<unique_ptr<int>>& batch) {
+            lock_guard<mutex> guard(lock);
+            on_pipeline = on_pipeline && receiver.IsPipelineThread();
+            max_batch = max(max_batch, batch.size());
+            for(const auto& v : batch) {
+                sum += *v;
+            }
+            items += batch.size();
+        });
+
+        // More items than the capacity, so the senders must wait for room
+        vector<thread> producers;
+        for(int t = 0; t < 4; ++t) {
+            producers.emplace_back([&channel] {
+                for(int i = 1; i <= 1000; ++i) {
+                    channel.Send(make_unique<int>(i));
+                }
+            });
+        }
+        for(auto& producer : producers) {
+            producer.join();
+        }
+        receiver.PostSynchronously({[] {}, "sync"});
+        for(int i = 0; i < 200; ++i) {
+            lock_guard<mutex> guard(lock);
+            if (items == 4000u) {
+                break;
+            }
+            this_thread::sleep_for(5ms);
+        }
+
+        lock_guard<mutex> guard(lock);
+        EXPECT(items == 4000u);
+        EXPECT(sum == 4u * 500500u);
+        EXPECT(max_batch <= 8u);
+        EXPECT(on_pipeline);
+    }
+
+    // TrySend gives backpressure, and Close() stops the senders
+    {
+        Channel<int> channel(receiver, 4);
+        int sent = 0;
+        for(int i = 0; i < 10; ++i) {
+            if (channel.TrySend(move(i))) {
+                ++sent;
+            }
+        }
+        EXPECT(sent == 4);
+        channel.Close();
+        EXPECT(channel.IsClosed());
+        EXPECT_NOT(channel.TrySend(1));
+        EXPECT_NOT(channel.Send(1));
+    }
+
+    // async_send and async_receive with coroutines
+    {
+        Channel<int> channel(receiver, 4, 3);
+        std::promise<void> sent_all, received_all;
+        std::atomic_int received{0}, sum{0};
+        std::atomic_bool got_eof{false};
+
+        auto produce = [&](boost::asio::yield_context yield) {
+            for(int i = 1; i <= 100; ++i) {
+                channel.async_send(i, yield);
+            }
+            channel.Close();
+            sent_all.set_value();
+        };
+        auto consume = [&](boost::asio::yield_context yield) {
+            for(;;) {
+                boost::system::error_code ec;
+                auto batch = channel.async_receive(yield[ec]);
+                if (ec) {
+                    got_eof = (ec == boost::asio::error::eof);
+                    break;
+                }
+                for(const auto v : batch) {
+                    sum += v;
+                }
+                received += static_cast<int>(batch.size());
+            }
+            received_all.set_value();
+        };
+
+#if BOOST_VERSION >= 108000
+        boost::asio::spawn(receiver.GetIoService(), consume, boost::asio::detached);
+        boost::asio::spawn(sender.GetIoService(), produce, boost::asio::detached);
+#else
+        boost::asio::spawn(receiver.GetIoService(), consume);
+        boost::asio::spawn(sender.GetIoService(), produce);
+#endif
+
+        EXPECT(sent_all.get_future().wait_for(5s) == future_status::ready);
+        EXPECT(received_all.get_future().wait_for(5s) == future_status::ready);
+        EXPECT(received == 100);
+        EXPECT(sum == 5050);
+        EXPECT(got_eof);
+    }
+
+    {
+        // Set up, use and destroy a channel while the receiving pipeline is full
+        Pipeline full("ChannelFull", -1, 1);
+        promise<void> started, gate, got_item;
+        auto gate_future = gate.get_future().share();
+        full.Post({[&started, gate_future] {
+            started.set_value();
+            gate_future.wait();
+        }, "blocker"});
+        started.get_future().wait();
+        full.Post({[] {}, "filler"});
+
+        {
+            Channel<int> channel(full);
+            channel.SetReceiver([&got_item](Channel<int>::batch_t& batch) {
+                if (!batch.empty() && (batch.front() == 42)) {
+                    got_item.set_value();
+                }
+            });
+            EXPECT(channel.TrySend(42));
+        }
+
+        gate.set_value();
+        EXPECT(got_item.get_future().wait_for(5s) == future_status::ready);
+        full.Close();
+        full.WaitUntilClosed();
+    }
+
+    receiver.Close();
+    sender.Close();
+    receiver.WaitUntilClosed();
+    sender.WaitUntilClosed();
+} ENDCASE
 }; //lest
 
 
@@ -0,0 +1,122 @@
+
+/* Extract a time-range from a log-file written by LogToFile or LogToJsonFile.
+ *
+ *   warlog_query --from "2026-10-19 08:00:00" --to "2026-10-19 08:05:00" \
+ *       --level WARN --category NETWORK server.log
+ *
+ * If the log-file has an index (server.log.idx, see LogToFile::EnableIndex()),
+ * only the part of the file that covers the time-range is read.
+ */
+
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <warlib/WarLog.h>
+#include <warlib/log_query.h>
+
+using namespace std;
+using namespace war;
+
+namespace {
+
+/*! Parse "YYYY-MM-DD HH:MM:SS" (local time) or unix time in seconds */
+bool ParseTime(const string& text, war::log::LogQuery::time_point_t& when)
+{
+    std::tm tm = {};
+    int year = 0, mon = 0;
+    if (sscanf(text.c_str(), "%d-%d-%d %d:%d:%d", &year, &mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) >= 3) {
+        tm.tm_year = year - 1900;
+        tm.tm_mon = mon - 1;
+        tm.tm_isdst = -1;
+        when = chrono::system_clock::from_time_t(mktime(&tm));
+        return true;
+    }
+
+    try {
+        size_t end = 0;
+        const auto seconds = stoll(text, &end);
+        if (end == text.size()) {
+            when = chrono::system_clock::from_time_t(static_cast<time_t>(seconds));
+            return true;
+        }
+    } catch(const std::exception&) {
+        ;
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    namespace po = boost::program_options;
+
+    string from, to, level = "TRACE4", path;
+    war::log::LogQuery query;
+
+    po::options_description options("Options");
+    options.add_options()
+        ("help,h", "Print help and exit")
+        ("from,f", po::value<string>(&from),
+            "Start of the range, as \"YYYY-MM-DD HH:MM:SS\" (local time) or unix time")
+        ("to,t", po::value<string>(&to),
+            "End of the range, as \"YYYY-MM-DD HH:MM:SS\" (local time) or unix time")
+        ("level,l", po::value<string>(&level)->default_value(level),
+            "Include this level and more severe levels")
+        ("category,c", po::value<vector<string>>(&query.categories_),
+            "Include this category. Can be repeated.")
+        ("log-file", po::value<string>(&path)->required(),
+            "Log-file to read")
+        ;
+
+    po::positional_options_description positional;
+    positional.add("log-file", 1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(options)
+            .positional(positional).run(), vm);
+        if (vm.count("help")) {
+            cout << "Usage: " << argv[0] << " [options] log-file" << endl
+                << options << endl;
+            return 0;
+        }
+        po::notify(vm);
+    } catch(const std::exception& ex) {
+        cerr << ex.what() << endl << options << endl;
+        return -1;
+    }
+
+    if ((!from.empty() && !ParseTime(from, query.from_))
+        || (!to.empty() && !ParseTime(to, query.to_))) {
+        cerr << "Invalid time. Use \"YYYY-MM-DD HH:MM:SS\" or unix time." << endl;
+        return -1;
+    }
+
+    bool valid_level = false;
+    for(int ll = war::log::LL_FATAL; ll <= war::log::LL_TRACE4; ++ll) {
+        if (level == war::log::LogEventHandler::GetLevelName(static_cast<war::log::LogLevel>(ll))) {
+            query.level_ = static_cast<war::log::LogLevel>(ll);
+            valid_level = true;
+        }
+    }
+    if (!valid_level) {
+        cerr << "No such log-level: " << level << endl;
+        return -1;
+    }
+
+    try {
+        war::log::QueryLogFile(path, query, cout);
+    } catch(const std::exception& ex) {
+        cerr << ex.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}